@@ -0,0 +1,398 @@
+#ifndef COMMON_BASE64_H
+#define COMMON_BASE64_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_X86 1
+#endif
+
+// Base64 codec shared by the mail, WebSocket and TLS labs. The encoders and the decoder pick an AVX2, SSE4.1 or
+// scalar kernel at runtime; every kernel produces byte-identical output. Decoding skips characters outside the
+// alphabet (line breaks, spaces) and stops at the first '=', like the original per-lab decoder did.
+
+enum class Base64Kernel { Scalar, Sse, Avx2 };
+
+inline constexpr char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+inline constexpr size_t BASE64_MIME_LINE_LENGTH = 76;
+
+inline const int8_t *base64DecodeTable() {
+    static const auto table = [] {
+        static int8_t values[256];
+        memset(values, -1, sizeof(values));
+        for (int i = 0; i < 64; i++) {
+            values[static_cast<unsigned char>(BASE64_ALPHABET[i])] = static_cast<int8_t>(i);
+        }
+
+        return values;
+    }();
+
+    return table;
+}
+
+inline Base64Kernel base64BestKernel() {
+#ifdef BASE64_X86
+    static const Base64Kernel kernel = __builtin_cpu_supports("avx2") ? Base64Kernel::Avx2
+        : __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3") ? Base64Kernel::Sse
+        : Base64Kernel::Scalar;
+
+    return kernel;
+#else
+    return Base64Kernel::Scalar;
+#endif
+}
+
+inline const char *base64KernelName(const Base64Kernel kernel) {
+    switch (kernel) {
+        case Base64Kernel::Avx2:
+            return "avx2";
+        case Base64Kernel::Sse:
+            return "sse4.1";
+        default:
+            return "scalar";
+    }
+}
+
+inline constexpr size_t base64EncodedLength(const size_t length) {
+    return (length + 2) / 3 * 4;
+}
+
+inline constexpr size_t base64MimeEncodedLength(const size_t length, const size_t lineLength = BASE64_MIME_LINE_LENGTH) {
+    const size_t encodedLength = base64EncodedLength(length);
+
+    return encodedLength + (encodedLength + lineLength - 1) / lineLength * 2;
+}
+
+// Upper bound for base64DecodeInto, including the slack the vector kernels need for their full-width stores.
+inline constexpr size_t base64DecodedCapacity(const size_t length) {
+    return length / 4 * 3 + 32;
+}
+
+inline size_t base64EncodeScalar(const unsigned char *input, const size_t length, char *output) {
+    char *out = output;
+
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3) {
+        const uint32_t triple = input[i] << 16 | input[i + 1] << 8 | input[i + 2];
+        out[0] = BASE64_ALPHABET[triple >> 18 & 0x3F];
+        out[1] = BASE64_ALPHABET[triple >> 12 & 0x3F];
+        out[2] = BASE64_ALPHABET[triple >> 6 & 0x3F];
+        out[3] = BASE64_ALPHABET[triple & 0x3F];
+        out += 4;
+    }
+
+    if (i < length) {
+        const uint32_t triple = input[i] << 16 | (i + 1 < length ? input[i + 1] << 8 : 0);
+        out[0] = BASE64_ALPHABET[triple >> 18 & 0x3F];
+        out[1] = BASE64_ALPHABET[triple >> 12 & 0x3F];
+        out[2] = i + 1 < length ? BASE64_ALPHABET[triple >> 6 & 0x3F] : '=';
+        out[3] = '=';
+        out += 4;
+    }
+
+    return out - output;
+}
+
+struct Base64ScalarDecoder {
+    uint32_t accumulator = 0;
+    int pending = 0;
+
+    bool aligned() const {
+        return pending == 0;
+    }
+
+    bool feed(const unsigned char c, unsigned char *&out) {
+        const int8_t value = base64DecodeTable()[c];
+        if (value < 0) {
+            return false;
+        }
+
+        accumulator = accumulator << 6 | value;
+        if (++pending == 4) {
+            out[0] = static_cast<unsigned char>(accumulator >> 16);
+            out[1] = static_cast<unsigned char>(accumulator >> 8);
+            out[2] = static_cast<unsigned char>(accumulator);
+            out += 3;
+            accumulator = 0;
+            pending = 0;
+        }
+
+        return true;
+    }
+
+    void finish(unsigned char *&out) const {
+        if (pending >= 2) {
+            const uint32_t bits = accumulator << (6 * (4 - pending));
+            *out++ = static_cast<unsigned char>(bits >> 16);
+            if (pending == 3) {
+                *out++ = static_cast<unsigned char>(bits >> 8);
+            }
+        }
+    }
+};
+
+#ifdef BASE64_X86
+
+__attribute__((target("ssse3,sse4.1"))) inline __m128i base64EncodeLanes128(const __m128i input) {
+    const __m128i shuffled = _mm_shuffle_epi8(input, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+
+    const __m128i high = _mm_mulhi_epu16(_mm_and_si128(shuffled, _mm_set1_epi32(0x0fc0fc00)),
+                                         _mm_set1_epi32(0x04000040));
+    const __m128i low = _mm_mullo_epi16(_mm_and_si128(shuffled, _mm_set1_epi32(0x003f03f0)),
+                                        _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(high, low);
+
+    __m128i offsets = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    offsets = _mm_or_si128(offsets, _mm_and_si128(upper, _mm_set1_epi8(13)));
+
+    const __m128i shifts = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+    return _mm_add_epi8(_mm_shuffle_epi8(shifts, offsets), indices);
+}
+
+__attribute__((target("ssse3,sse4.1"))) inline size_t base64EncodeSse(const unsigned char *input, const size_t length,
+                                                                     char *output) {
+    size_t i = 0;
+    char *out = output;
+    for (; i + 16 <= length; i += 12) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), base64EncodeLanes128(block));
+        out += 16;
+    }
+
+    return (out - output) + base64EncodeScalar(input + i, length - i, out);
+}
+
+__attribute__((target("avx2"))) inline size_t base64EncodeAvx2(const unsigned char *input, const size_t length,
+                                                               char *output) {
+    const __m256i lanes = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                           1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shifts = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+    size_t i = 0;
+    char *out = output;
+    for (; i + 28 <= length; i += 24) {
+        const __m256i block = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i + 12)), 1);
+
+        const __m256i shuffled = _mm256_shuffle_epi8(block, lanes);
+        const __m256i high = _mm256_mulhi_epu16(_mm256_and_si256(shuffled, _mm256_set1_epi32(0x0fc0fc00)),
+                                                _mm256_set1_epi32(0x04000040));
+        const __m256i low = _mm256_mullo_epi16(_mm256_and_si256(shuffled, _mm256_set1_epi32(0x003f03f0)),
+                                               _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(high, low);
+
+        __m256i offsets = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        offsets = _mm256_or_si256(offsets, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out),
+                            _mm256_add_epi8(_mm256_shuffle_epi8(shifts, offsets), indices));
+        out += 32;
+    }
+
+    return (out - output) + base64EncodeSse(input + i, length - i, out);
+}
+
+// Decodes 16 characters into 12 bytes (16 are stored). Returns false, storing nothing, if any character is outside
+// the alphabet, so the caller can fall back to the scalar path for that stretch.
+__attribute__((target("ssse3,sse4.1"))) inline bool base64DecodeBlockSse(const char *input, unsigned char *output) {
+    const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input));
+
+    const __m128i highNibbles = _mm_and_si128(_mm_srli_epi32(block, 4), _mm_set1_epi8(0x0f));
+    const __m128i lowNibbles = _mm_and_si128(block, _mm_set1_epi8(0x0f));
+
+    const __m128i lowLookup = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i highLookup = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                             0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    if (!_mm_testz_si128(_mm_shuffle_epi8(lowLookup, lowNibbles), _mm_shuffle_epi8(highLookup, highNibbles))) {
+        return false;
+    }
+
+    const __m128i rolls = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i slashes = _mm_cmpeq_epi8(block, _mm_set1_epi8('/'));
+    const __m128i values = _mm_add_epi8(block, _mm_shuffle_epi8(rolls, _mm_add_epi8(slashes, highNibbles)));
+
+    const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    const __m128i packed = _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                                                 -1, -1, -1, -1));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output), packed);
+
+    return true;
+}
+
+__attribute__((target("avx2"))) inline bool base64DecodeBlockAvx2(const char *input, unsigned char *output) {
+    const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input));
+
+    const __m256i highNibbles = _mm256_and_si256(_mm256_srli_epi32(block, 4), _mm256_set1_epi8(0x0f));
+    const __m256i lowNibbles = _mm256_and_si256(block, _mm256_set1_epi8(0x0f));
+
+    const __m256i lowLookup = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                               0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                               0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                               0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i highLookup = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    if (!_mm256_testz_si256(_mm256_shuffle_epi8(lowLookup, lowNibbles),
+                            _mm256_shuffle_epi8(highLookup, highNibbles))) {
+        return false;
+    }
+
+    const __m256i rolls = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                           0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i slashes = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('/'));
+    const __m256i values = _mm256_add_epi8(block, _mm256_shuffle_epi8(rolls, _mm256_add_epi8(slashes, highNibbles)));
+
+    const __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    const __m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+    const __m256i packed = _mm256_shuffle_epi8(words, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                                                       -1, -1, -1, -1,
+                                                                       2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                                                       -1, -1, -1, -1));
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output),
+                        _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1)));
+
+    return true;
+}
+
+#endif
+
+inline size_t base64EncodeInto(const unsigned char *input, const size_t length, char *output,
+                               const Base64Kernel kernel = base64BestKernel()) {
+#ifdef BASE64_X86
+    if (kernel == Base64Kernel::Avx2) {
+        return base64EncodeAvx2(input, length, output);
+    }
+
+    if (kernel == Base64Kernel::Sse) {
+        return base64EncodeSse(input, length, output);
+    }
+#endif
+
+    return base64EncodeScalar(input, length, output);
+}
+
+// Encodes into CRLF-terminated lines of lineLength characters (a multiple of 4); the last line is terminated too.
+inline size_t base64EncodeMimeInto(const unsigned char *input, const size_t length, char *output,
+                                   const size_t lineLength = BASE64_MIME_LINE_LENGTH,
+                                   const Base64Kernel kernel = base64BestKernel()) {
+    const size_t lineInput = lineLength / 4 * 3;
+
+    char *out = output;
+    for (size_t offset = 0; offset < length; offset += lineInput) {
+        const size_t chunk = length - offset < lineInput ? length - offset : lineInput;
+        out += base64EncodeInto(input + offset, chunk, out, kernel);
+        *out++ = '\r';
+        *out++ = '\n';
+    }
+
+    return out - output;
+}
+
+// Decodes one piece of a longer input, carrying an incomplete quantum over to the next call in `scalar`. The caller
+// strips the padding and calls finish() on the decoder after the last piece.
+inline size_t base64DecodeUpdate(const char *input, const size_t length, unsigned char *output,
+                                 Base64ScalarDecoder &scalar, const Base64Kernel kernel = base64BestKernel()) {
+    unsigned char *out = output;
+    size_t i = 0;
+
+    while (i < length && !scalar.aligned()) {
+        scalar.feed(static_cast<unsigned char>(input[i++]), out);
+    }
+
+    while (i < length) {
+#ifdef BASE64_X86
+        if (kernel == Base64Kernel::Avx2) {
+            while (i + 32 <= length && base64DecodeBlockAvx2(input + i, out)) {
+                i += 32;
+                out += 24;
+            }
+        }
+
+        if (kernel != Base64Kernel::Scalar) {
+            while (i + 16 <= length && base64DecodeBlockSse(input + i, out)) {
+                i += 16;
+                out += 12;
+            }
+        }
+#endif
+
+        bool skipped = false;
+        while (i < length && (!skipped || !scalar.aligned() || kernel == Base64Kernel::Scalar)) {
+            if (!scalar.feed(static_cast<unsigned char>(input[i++]), out)) {
+                skipped = true;
+            }
+        }
+    }
+
+    return out - output;
+}
+
+inline size_t base64DecodeInto(const char *input, size_t length, unsigned char *output,
+                               const Base64Kernel kernel = base64BestKernel()) {
+    if (const void *padding = memchr(input, '=', length); padding != nullptr) {
+        length = static_cast<const char *>(padding) - input;
+    }
+
+    Base64ScalarDecoder scalar;
+    unsigned char *out = output + base64DecodeUpdate(input, length, output, scalar, kernel);
+    scalar.finish(out);
+
+    return out - output;
+}
+
+inline std::string base64Encode(const std::string_view input) {
+    std::string output(base64EncodedLength(input.size()), '\0');
+    base64EncodeInto(reinterpret_cast<const unsigned char *>(input.data()), input.size(), output.data());
+
+    return output;
+}
+
+inline std::string base64Encode(const std::vector<unsigned char> &input) {
+    std::string output(base64EncodedLength(input.size()), '\0');
+    base64EncodeInto(input.data(), input.size(), output.data());
+
+    return output;
+}
+
+inline std::string base64EncodeMime(const std::string_view input, const size_t lineLength = BASE64_MIME_LINE_LENGTH) {
+    std::string output(base64MimeEncodedLength(input.size(), lineLength), '\0');
+    base64EncodeMimeInto(reinterpret_cast<const unsigned char *>(input.data()), input.size(), output.data(), lineLength);
+
+    return output;
+}
+
+inline std::string base64EncodeMime(const std::vector<unsigned char> &input,
+                                    const size_t lineLength = BASE64_MIME_LINE_LENGTH) {
+    std::string output(base64MimeEncodedLength(input.size(), lineLength), '\0');
+    base64EncodeMimeInto(input.data(), input.size(), output.data(), lineLength);
+
+    return output;
+}
+
+inline std::string base64Decode(const std::string_view input) {
+    std::string output(base64DecodedCapacity(input.size()), '\0');
+    output.resize(base64DecodeInto(input.data(), input.size(), reinterpret_cast<unsigned char *>(output.data())));
+
+    return output;
+}
+
+#endif
@@ -0,0 +1,248 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include "base64.h"
+
+using namespace std;
+
+constexpr size_t BENCH_SIZE = 16 * 1024 * 1024;
+constexpr int BENCH_RUNS = 5;
+constexpr int RANDOM_CASES = 20000;
+
+string legacyBase64Encode(const vector<unsigned char> &input) {
+    static const string base64Chars =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string output;
+
+    int val = 0, valb = -6;
+    for (const unsigned char c : input) {
+        val = (val << 8) + c;
+        valb += 8;
+
+        while (valb >= 0) {
+            output.push_back(base64Chars[(val >> valb) & 0x3F]);
+            valb -= 6;
+        }
+    }
+
+    if (valb > -6) {
+        output.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
+    }
+
+    while (output.size() % 4) {
+        output.push_back('=');
+    }
+
+    return output;
+}
+
+string legacyBase64Decode(const string &encoded_string) {
+    static const string base64_chars =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    vector<unsigned char> decoded;
+    int val = 0;
+    int valb = -8;
+
+    for (const char c: encoded_string) {
+        if (c == '=') {
+            break;
+        }
+
+        if (const size_t pos = base64_chars.find(c); pos != string::npos) {
+            val = (val << 6) + static_cast<int>(pos);
+            valb += 6;
+
+            if (valb >= 0) {
+                decoded.push_back(static_cast<unsigned char>((val >> valb) & 0xFF));
+                valb -= 8;
+            }
+        }
+    }
+
+    return string(decoded.begin(), decoded.end());
+}
+
+string legacyMimeWrap(const string &encoded) {
+    string wrapped;
+    for (size_t i = 0; i < encoded.length(); i += 76) {
+        wrapped += encoded.substr(i, 76) + "\r\n";
+    }
+
+    return wrapped;
+}
+
+vector<Base64Kernel> availableKernels() {
+    vector<Base64Kernel> kernels = {Base64Kernel::Scalar};
+    if (base64BestKernel() != Base64Kernel::Scalar) {
+        kernels.push_back(Base64Kernel::Sse);
+    }
+    if (base64BestKernel() == Base64Kernel::Avx2) {
+        kernels.push_back(Base64Kernel::Avx2);
+    }
+
+    return kernels;
+}
+
+string encodeWith(const vector<unsigned char> &input, const Base64Kernel kernel) {
+    string output(base64EncodedLength(input.size()), '\0');
+    output.resize(base64EncodeInto(input.data(), input.size(), output.data(), kernel));
+
+    return output;
+}
+
+string encodeMimeWith(const vector<unsigned char> &input, const Base64Kernel kernel) {
+    string output(base64MimeEncodedLength(input.size()), '\0');
+    output.resize(base64EncodeMimeInto(input.data(), input.size(), output.data(), BASE64_MIME_LINE_LENGTH, kernel));
+
+    return output;
+}
+
+string decodeWith(const string &input, const Base64Kernel kernel) {
+    string output(base64DecodedCapacity(input.size()), '\0');
+    output.resize(base64DecodeInto(input.data(), input.size(), reinterpret_cast<unsigned char *>(output.data()),
+                                   kernel));
+
+    return output;
+}
+
+string decodeChunkedWith(const string &input, const Base64Kernel kernel, mt19937 &random) {
+    const size_t length = min(input.find('='), input.size());
+    string output(base64DecodedCapacity(input.size()), '\0');
+    auto *out = reinterpret_cast<unsigned char *>(output.data());
+
+    Base64ScalarDecoder state;
+    for (size_t offset = 0; offset < length; ) {
+        const size_t piece = min<size_t>(length - offset, 1 + random() % 97);
+        out += base64DecodeUpdate(input.data() + offset, piece, out, state, kernel);
+        offset += piece;
+    }
+    state.finish(out);
+
+    output.resize(out - reinterpret_cast<unsigned char *>(output.data()));
+
+    return output;
+}
+
+string mangle(string encoded, mt19937 &random) {
+    static const string noise = " \t\r\n.-_*#\x80\xff";
+
+    const int edits = random() % 6;
+    for (int i = 0; i < edits && !encoded.empty(); i++) {
+        const size_t position = random() % (encoded.size() + 1);
+        if (random() % 4 == 0) {
+            encoded.insert(position, 1, '=');
+        } else {
+            encoded.insert(position, 1, noise[random() % noise.size()]);
+        }
+    }
+
+    return encoded;
+}
+
+bool runDifferentialTest() {
+    mt19937 random(2024);
+    const vector<Base64Kernel> kernels = availableKernels();
+    size_t checks = 0;
+
+    for (int testCase = 0; testCase < RANDOM_CASES; testCase++) {
+        const size_t length = testCase < 300 ? testCase : random() % 5000;
+        vector<unsigned char> input(length);
+        for (auto &byte : input) {
+            byte = static_cast<unsigned char>(random());
+        }
+
+        const string expected = legacyBase64Encode(input);
+        const string expectedMime = legacyMimeWrap(expected);
+        const string mangled = mangle(random() % 2 ? expectedMime : expected, random);
+        const string expectedDecoded = legacyBase64Decode(mangled);
+
+        for (const Base64Kernel kernel : kernels) {
+            const bool encodeMatches = encodeWith(input, kernel) == expected;
+            const bool mimeMatches = encodeMimeWith(input, kernel) == expectedMime;
+            const bool roundTrips = decodeWith(expectedMime, kernel) == string(input.begin(), input.end());
+            const bool decodeMatches = decodeWith(mangled, kernel) == expectedDecoded;
+            const bool chunkedMatches = decodeChunkedWith(mangled, kernel, random) == expectedDecoded;
+
+            if (!encodeMatches || !mimeMatches || !roundTrips || !decodeMatches || !chunkedMatches) {
+                cerr << "Mismatch for " << base64KernelName(kernel) << " on case " << testCase << " (" << length
+                     << " bytes): encode " << encodeMatches << ", mime " << mimeMatches << ", round trip "
+                     << roundTrips << ", decode " << decodeMatches << ", chunked " << chunkedMatches << endl;
+
+                return false;
+            }
+
+            checks += 5;
+        }
+    }
+
+    cout << "Differential test passed: " << checks << " checks against the legacy codec" << endl;
+
+    return true;
+}
+
+template <typename Operation>
+double measureMegabytesPerSecond(const size_t bytes, Operation operation) {
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        const auto start = chrono::steady_clock::now();
+        operation();
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+        best = max(best, bytes / elapsed.count() / 1e6);
+    }
+
+    return best;
+}
+
+void runBenchmark() {
+    mt19937 random(7);
+    vector<unsigned char> input(BENCH_SIZE);
+    for (auto &byte : input) {
+        byte = static_cast<unsigned char>(random());
+    }
+
+    const string encoded = legacyBase64Encode(input);
+    const string mime = legacyMimeWrap(encoded);
+    size_t sink = 0;
+
+    cout << "Throughput over " << BENCH_SIZE / (1024 * 1024) << " MiB (best of " << BENCH_RUNS
+         << ", MB/s of raw data)" << endl;
+
+    cout << "  legacy   encode " << measureMegabytesPerSecond(BENCH_SIZE, [&] {
+        sink += legacyBase64Encode(input).size();
+    }) << ", decode mime " << measureMegabytesPerSecond(BENCH_SIZE, [&] {
+        sink += legacyBase64Decode(mime).size();
+    }) << endl;
+
+    for (const Base64Kernel kernel : availableKernels()) {
+        cout << "  " << base64KernelName(kernel) << string(9 - strlen(base64KernelName(kernel)), ' ')
+             << "encode " << measureMegabytesPerSecond(BENCH_SIZE, [&] {
+                 sink += encodeWith(input, kernel).size();
+             }) << ", encode mime " << measureMegabytesPerSecond(BENCH_SIZE, [&] {
+                 sink += encodeMimeWith(input, kernel).size();
+             }) << ", decode " << measureMegabytesPerSecond(BENCH_SIZE, [&] {
+                 sink += decodeWith(encoded, kernel).size();
+             }) << ", decode mime " << measureMegabytesPerSecond(BENCH_SIZE, [&] {
+                 sink += decodeWith(mime, kernel).size();
+             }) << endl;
+    }
+
+    cout << "Active kernel: " << base64KernelName(base64BestKernel()) << " (" << sink % 10 << ")" << endl;
+}
+
+int main(const int argc, char *argv[]) {
+    const string mode = argc > 1 ? argv[1] : "all";
+
+    if ((mode == "all" || mode == "test") && !runDifferentialTest()) {
+        return 1;
+    }
+
+    if (mode == "all" || mode == "bench") {
+        runBenchmark();
+    }
+
+    return 0;
+}
@@ -0,0 +1,892 @@
+#include <iostream>
+#include <cstring>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+constexpr int MAX_EVENTS = 256;
+constexpr size_t RECEIVE_SIZE = 65536;
+constexpr uint64_t DEFAULT_SESSIONS = 1000;
+constexpr size_t DEFAULT_CONCURRENCY = 100;
+constexpr int DEFAULT_TIMEOUT_MS = 10000;
+constexpr int HISTOGRAM_SUB_BUCKETS = 16;
+constexpr int HISTOGRAM_SUB_BITS = 4;
+constexpr int HISTOGRAM_BUCKETS = 40 * HISTOGRAM_SUB_BUCKETS;
+
+constexpr const char *DEFAULT_SMTP_SCRIPT =
+    "EHLO loadgen.local\n"
+    "MAIL FROM:<load{session}@loadgen.local>\n"
+    "RCPT TO:<user{session}@example.com>\n"
+    "DATA\n"
+    "Subject: load test {session}\n"
+    "\n"
+    "Generated by the mail load generator.\n"
+    ".\n"
+    "QUIT\n";
+
+constexpr const char *DEFAULT_POP3_SCRIPT =
+    "USER pas2017@interia.pl\n"
+    "PASS P4SInf2017\n"
+    "STAT\n"
+    "LIST\n"
+    "RETR 1\n"
+    "QUIT\n";
+
+constexpr const char *DEFAULT_IMAP_SCRIPT =
+    "LOGIN user password\n"
+    "SELECT INBOX\n"
+    "FETCH 1 BODY[]\n"
+    "LOGOUT\n";
+
+enum class Protocol { Smtp, Pop3, Imap };
+
+enum class ReplyStatus { Incomplete, Ok, Failed };
+
+enum class SessionPhase { Connecting, Greeting, Thinking, Awaiting };
+
+using Clock = chrono::steady_clock;
+
+struct ScriptStep {
+    string label;
+    string text;
+    bool multiLine = false;
+};
+
+struct LatencyHistogram {
+    vector<uint64_t> counts = vector<uint64_t>(HISTOGRAM_BUCKETS);
+    uint64_t total = 0;
+    uint64_t errors = 0;
+    uint64_t maxMicros = 0;
+    double sumMicros = 0;
+
+    static int bucketFor(const uint64_t micros) {
+        if (micros < HISTOGRAM_SUB_BUCKETS) {
+            return static_cast<int>(micros);
+        }
+
+        const int shift = 63 - __builtin_clzll(micros) - HISTOGRAM_SUB_BITS;
+        const int sub = static_cast<int>((micros >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+
+        return min((shift + 1) * HISTOGRAM_SUB_BUCKETS + sub, HISTOGRAM_BUCKETS - 1);
+    }
+
+    static uint64_t bucketLimit(const int bucket) {
+        if (bucket < HISTOGRAM_SUB_BUCKETS) {
+            return bucket;
+        }
+
+        const int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+        const uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+        return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+    void record(const uint64_t micros) {
+        counts[bucketFor(micros)]++;
+        total++;
+        sumMicros += micros;
+        maxMicros = max(maxMicros, micros);
+    }
+
+    uint64_t percentile(const double fraction) const {
+        const auto rank = static_cast<uint64_t>(ceil(fraction * total));
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            seen += counts[bucket];
+            if (seen >= rank && seen > 0) {
+                return min(bucketLimit(bucket), maxMicros);
+            }
+        }
+
+        return maxMicros;
+    }
+};
+
+struct Session {
+    uint64_t id = 0;
+    int socket = -1;
+    SessionPhase phase = SessionPhase::Connecting;
+    size_t step = 0;
+    string input;
+    size_t scanned = 0;
+    string output;
+    size_t outputOffset = 0;
+    string tag;
+    uint32_t interest = 0;
+    uint64_t timerGeneration = 0;
+    Clock::time_point startedAt;
+    Clock::time_point sentAt;
+};
+
+struct Timer {
+    Clock::time_point due;
+    uint64_t sessionId;
+    uint64_t generation;
+
+    bool operator>(const Timer &other) const {
+        return due > other.due;
+    }
+};
+
+struct LoadOptions {
+    Protocol protocol = Protocol::Smtp;
+    sockaddr_in address{};
+    uint64_t sessions = DEFAULT_SESSIONS;
+    size_t concurrency = DEFAULT_CONCURRENCY;
+    double rate = 0;
+    double thinkMillis = 0;
+    double durationSeconds = 0;
+    int timeoutMillis = DEFAULT_TIMEOUT_MS;
+    string scriptPath;
+};
+
+bool isMultiLinePop3(const string &command) {
+    istringstream fields(command);
+    string verb;
+    string argument;
+    fields >> verb >> argument;
+    transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
+
+    return verb == "RETR" || verb == "TOP" || verb == "CAPA" || ((verb == "LIST" || verb == "UIDL") && argument.empty());
+}
+
+string commandLabel(const string &command) {
+    string label = command.substr(0, command.find_first_of(" :"));
+    transform(label.begin(), label.end(), label.begin(), ::toupper);
+
+    return label;
+}
+
+vector<ScriptStep> parseScript(const Protocol protocol, istream &script) {
+    vector<ScriptStep> steps;
+    string line;
+    bool inMessage = false;
+
+    while (getline(script, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+
+        if (inMessage) {
+            steps.back().text += line + "\r\n";
+            if (line == ".") {
+                inMessage = false;
+            }
+
+            continue;
+        }
+
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        ScriptStep step;
+        step.label = commandLabel(line);
+        step.text = line + "\r\n";
+        step.multiLine = protocol == Protocol::Pop3 && isMultiLinePop3(line);
+        steps.push_back(std::move(step));
+
+        if (protocol == Protocol::Smtp && steps.back().label == "DATA") {
+            steps.push_back({"MESSAGE", "", false});
+            inMessage = true;
+        }
+    }
+
+    if (inMessage) {
+        steps.back().text += ".\r\n";
+    }
+
+    return steps;
+}
+
+struct LoadGenerator {
+    LoadOptions options;
+    vector<ScriptStep> script;
+    int epollFd = -1;
+    unordered_map<uint64_t, unique_ptr<Session> > sessions;
+    priority_queue<Timer, vector<Timer>, greater<> > timers;
+    mt19937_64 random{random_device{}()};
+
+    map<string, LatencyHistogram> latencies;
+    LatencyHistogram sessionLatency;
+    map<string, uint64_t> errors;
+    uint64_t nextSessionId = 1;
+    uint64_t started = 0;
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    uint64_t delayedArrivals = 0;
+    uint64_t backlog = 0;
+    Clock::time_point startTime;
+    Clock::time_point nextArrival;
+    Clock::time_point nextReport;
+    uint64_t reportedCompleted = 0;
+
+    bool arrivalsOpen(const Clock::time_point now) const {
+        if (started + backlog >= options.sessions) {
+            return false;
+        }
+
+        return options.durationSeconds <= 0 ||
+               now - startTime < chrono::duration<double>(options.durationSeconds);
+    }
+
+    double exponential(const double mean) {
+        return mean <= 0 ? 0 : exponential_distribution<double>(1.0 / mean)(random);
+    }
+
+    void armTimer(Session &session, const Clock::time_point due) {
+        session.timerGeneration++;
+        timers.push({due, session.id, session.timerGeneration});
+    }
+
+    void armReplyTimer(Session &session) {
+        armTimer(session, Clock::now() + chrono::milliseconds(options.timeoutMillis));
+    }
+
+    void setInterest(Session &session, const uint32_t interest) {
+        if (session.interest == interest) {
+            return;
+        }
+
+        epoll_event event{};
+        event.events = interest;
+        event.data.u64 = session.id;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, session.socket, &event);
+        session.interest = interest;
+    }
+
+    void startSession() {
+        const int clientSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (clientSocket < 0) {
+            errors["socket: " + string(strerror(errno))]++;
+            failed++;
+            started++;
+
+            return;
+        }
+
+        constexpr int opt = 1;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        auto session = make_unique<Session>();
+        session->id = nextSessionId++;
+        session->socket = clientSocket;
+        session->startedAt = Clock::now();
+        session->sentAt = session->startedAt;
+        started++;
+
+        if (connect(clientSocket, reinterpret_cast<const sockaddr *>(&options.address), sizeof(options.address)) < 0 &&
+            errno != EINPROGRESS) {
+            errors["connect: " + string(strerror(errno))]++;
+            failed++;
+            close(clientSocket);
+
+            return;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLOUT;
+        event.data.u64 = session->id;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+            errors["epoll: " + string(strerror(errno))]++;
+            failed++;
+            close(clientSocket);
+
+            return;
+        }
+
+        session->interest = EPOLLOUT;
+        armReplyTimer(*session);
+        sessions[session->id] = std::move(session);
+    }
+
+    void endSession(const uint64_t sessionId, const bool success, const string &error = string()) {
+        const auto it = sessions.find(sessionId);
+        if (it == sessions.end()) {
+            return;
+        }
+
+        Session &session = *it->second;
+        if (success) {
+            completed++;
+            sessionLatency.record(chrono::duration_cast<chrono::microseconds>(Clock::now() - session.startedAt).count());
+        } else {
+            failed++;
+            errors[error]++;
+        }
+
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, session.socket, nullptr);
+        close(session.socket);
+        sessions.erase(it);
+
+        if (backlog > 0) {
+            backlog--;
+            startSession();
+        }
+    }
+
+    string currentLabel(const Session &session) const {
+        return session.phase == SessionPhase::Greeting ? "GREETING" : script[session.step].label;
+    }
+
+    void sendStep(Session &session) {
+        string text = script[session.step].text;
+        for (size_t position = text.find("{session}"); position != string::npos;
+             position = text.find("{session}", position)) {
+            text.replace(position, 9, to_string(session.id));
+        }
+
+        if (options.protocol == Protocol::Imap) {
+            session.tag = "a" + to_string(session.step + 1);
+            text = session.tag + " " + text;
+        }
+
+        session.output = std::move(text);
+        session.outputOffset = 0;
+        session.phase = SessionPhase::Awaiting;
+        session.sentAt = Clock::now();
+        armReplyTimer(session);
+
+        flush(session);
+    }
+
+    bool flush(Session &session) {
+        while (session.outputOffset < session.output.size()) {
+            const ssize_t bytesSent = send(session.socket, session.output.data() + session.outputOffset,
+                                           session.output.size() - session.outputOffset, MSG_NOSIGNAL);
+            if (bytesSent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    setInterest(session, EPOLLIN | EPOLLOUT);
+
+                    return true;
+                }
+
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                endSession(session.id, false, "send in " + currentLabel(session) + ": " + strerror(errno));
+
+                return false;
+            }
+
+            session.outputOffset += bytesSent;
+        }
+
+        session.output.clear();
+        session.outputOffset = 0;
+        setInterest(session, EPOLLIN);
+
+        return true;
+    }
+
+    ReplyStatus parseReply(Session &session, size_t &consumed) const {
+        const string &input = session.input;
+        const bool greeting = session.phase == SessionPhase::Greeting;
+
+        if (options.protocol == Protocol::Pop3 && !greeting && script[session.step].multiLine) {
+            const size_t firstEnd = input.find("\r\n");
+            if (firstEnd == string::npos) {
+                return ReplyStatus::Incomplete;
+            }
+
+            if (!input.starts_with("+OK")) {
+                consumed = firstEnd + 2;
+
+                return ReplyStatus::Failed;
+            }
+
+            const size_t from = max(session.scanned, firstEnd);
+            const size_t terminator = input.find("\r\n.\r\n", from);
+            if (terminator == string::npos) {
+                session.scanned = input.size() > 4 ? input.size() - 4 : 0;
+
+                return ReplyStatus::Incomplete;
+            }
+
+            consumed = terminator + 5;
+
+            return ReplyStatus::Ok;
+        }
+
+        size_t lineStart = session.scanned;
+        while (true) {
+            const size_t lineEnd = input.find("\r\n", lineStart);
+            if (lineEnd == string::npos) {
+                session.scanned = lineStart;
+
+                return ReplyStatus::Incomplete;
+            }
+
+            const string_view line(input.data() + lineStart, lineEnd - lineStart);
+            lineStart = lineEnd + 2;
+
+            switch (options.protocol) {
+                case Protocol::Smtp:
+                    if (line.size() > 3 && line[3] == '-') {
+                        continue;
+                    }
+
+                    consumed = lineStart;
+
+                    return line.starts_with("2") || line.starts_with("3") ? ReplyStatus::Ok : ReplyStatus::Failed;
+                case Protocol::Pop3:
+                    consumed = lineStart;
+
+                    return line.starts_with("+OK") ? ReplyStatus::Ok : ReplyStatus::Failed;
+                case Protocol::Imap:
+                    if (greeting) {
+                        consumed = lineStart;
+
+                        return line.starts_with("* OK") ? ReplyStatus::Ok : ReplyStatus::Failed;
+                    }
+
+                    if (line.size() > session.tag.size() && line.starts_with(session.tag) &&
+                        line[session.tag.size()] == ' ') {
+                        consumed = lineStart;
+
+                        return line.substr(session.tag.size() + 1).starts_with("OK") ? ReplyStatus::Ok
+                                                                                      : ReplyStatus::Failed;
+                    }
+
+                    continue;
+            }
+        }
+    }
+
+    void handleReplies(Session &session) {
+        while (session.phase == SessionPhase::Greeting || session.phase == SessionPhase::Awaiting) {
+            size_t consumed = 0;
+            const ReplyStatus status = parseReply(session, consumed);
+            if (status == ReplyStatus::Incomplete) {
+                return;
+            }
+
+            const string label = currentLabel(session);
+            LatencyHistogram &histogram = latencies[label];
+            histogram.record(chrono::duration_cast<chrono::microseconds>(Clock::now() - session.sentAt).count());
+
+            if (status == ReplyStatus::Failed) {
+                histogram.errors++;
+
+                const size_t lineEnd = session.input.find("\r\n");
+                endSession(session.id, false, label + " rejected: " + session.input.substr(0, min<size_t>(lineEnd, 40)));
+
+                return;
+            }
+
+            session.input.erase(0, consumed);
+            session.scanned = 0;
+
+            if (session.phase == SessionPhase::Awaiting) {
+                session.step++;
+            }
+
+            if (session.step >= script.size()) {
+                endSession(session.id, true);
+
+                return;
+            }
+
+            if (options.thinkMillis > 0) {
+                session.phase = SessionPhase::Thinking;
+                armTimer(session, Clock::now() + chrono::duration_cast<Clock::duration>(
+                                      chrono::duration<double, milli>(exponential(options.thinkMillis))));
+
+                return;
+            }
+
+            // sendStep ends the session when the send fails, which frees it.
+            const uint64_t id = session.id;
+            sendStep(session);
+            if (!sessions.contains(id)) {
+                return;
+            }
+        }
+    }
+
+    void handleEvent(const uint64_t sessionId, const uint32_t events) {
+        const auto it = sessions.find(sessionId);
+        if (it == sessions.end()) {
+            return;
+        }
+
+        Session &session = *it->second;
+
+        if (session.phase == SessionPhase::Connecting) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(session.socket, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                endSession(sessionId, false, "connect: " + string(strerror(error)));
+
+                return;
+            }
+
+            latencies["CONNECT"].record(
+                chrono::duration_cast<chrono::microseconds>(Clock::now() - session.startedAt).count());
+
+            session.phase = SessionPhase::Greeting;
+            session.sentAt = Clock::now();
+            armReplyTimer(session);
+            setInterest(session, EPOLLIN);
+
+            return;
+        }
+
+        if ((events & EPOLLOUT) && !flush(session)) {
+            return;
+        }
+
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            return;
+        }
+
+        while (true) {
+            char buffer[RECEIVE_SIZE];
+            const ssize_t bytesRead = recv(session.socket, buffer, sizeof(buffer), 0);
+            if (bytesRead > 0) {
+                session.input.append(buffer, bytesRead);
+
+                continue;
+            }
+
+            if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+
+            handleReplies(session);
+            if (sessions.contains(sessionId)) {
+                endSession(sessionId, false, "closed during " + currentLabel(session));
+            }
+
+            return;
+        }
+
+        handleReplies(session);
+    }
+
+    void fireTimers(const Clock::time_point now) {
+        while (!timers.empty() && timers.top().due <= now) {
+            const Timer timer = timers.top();
+            timers.pop();
+
+            const auto it = sessions.find(timer.sessionId);
+            if (it == sessions.end() || it->second->timerGeneration != timer.generation) {
+                continue;
+            }
+
+            Session &session = *it->second;
+            if (session.phase == SessionPhase::Thinking) {
+                sendStep(session);
+            } else if (session.phase == SessionPhase::Connecting) {
+                endSession(session.id, false, "connect: timed out");
+            } else {
+                latencies[currentLabel(session)].errors++;
+                endSession(session.id, false, "timeout in " + currentLabel(session));
+            }
+        }
+    }
+
+    void admitArrivals(const Clock::time_point now) {
+        if (options.rate <= 0) {
+            while (sessions.size() < options.concurrency && arrivalsOpen(now)) {
+                startSession();
+            }
+
+            return;
+        }
+
+        while (nextArrival <= now && arrivalsOpen(now)) {
+            if (sessions.size() < options.concurrency) {
+                startSession();
+            } else {
+                backlog++;
+                delayedArrivals++;
+            }
+
+            nextArrival += chrono::duration_cast<Clock::duration>(chrono::duration<double>(exponential(1.0 / options.rate)));
+        }
+    }
+
+    void reportProgress(const Clock::time_point now) {
+        if (now < nextReport) {
+            return;
+        }
+
+        const double elapsed = chrono::duration<double>(now - startTime).count();
+        cout << fixed << setprecision(1) << "[" << elapsed << " s] active " << sessions.size() << ", completed "
+             << completed << " (" << completed - reportedCompleted << "/s), failed " << failed << ", backlog "
+             << backlog << endl;
+
+        reportedCompleted = completed;
+        nextReport += chrono::seconds(1);
+    }
+
+    int waitTimeout(const Clock::time_point now) const {
+        Clock::time_point due = nextReport;
+        if (!timers.empty()) {
+            due = min(due, timers.top().due);
+        }
+        if (options.rate > 0 && arrivalsOpen(now)) {
+            due = min(due, nextArrival);
+        }
+
+        return static_cast<int>(max<int64_t>(0, chrono::ceil<chrono::milliseconds>(due - now).count()));
+    }
+
+    bool finished(const Clock::time_point now) const {
+        return sessions.empty() && backlog == 0 && !arrivalsOpen(now);
+    }
+
+    bool run() {
+        epollFd = epoll_create1(0);
+        if (epollFd < 0) {
+            cerr << "Failed to create epoll instance." << endl;
+
+            return false;
+        }
+
+        startTime = Clock::now();
+        nextArrival = startTime;
+        nextReport = startTime + chrono::seconds(1);
+
+        epoll_event events[MAX_EVENTS];
+
+        while (true) {
+            Clock::time_point now = Clock::now();
+            admitArrivals(now);
+            fireTimers(now);
+            reportProgress(now);
+
+            if (finished(now)) {
+                break;
+            }
+
+            const int readyCount = epoll_wait(epollFd, events, MAX_EVENTS, waitTimeout(Clock::now()));
+            if (readyCount < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                cerr << "epoll_wait failed: " << strerror(errno) << endl;
+
+                return false;
+            }
+
+            for (int i = 0; i < readyCount; i++) {
+                handleEvent(events[i].data.u64, events[i].events);
+            }
+        }
+
+        close(epollFd);
+
+        return true;
+    }
+
+    void printLatencyRow(const string &label, const LatencyHistogram &histogram) const {
+        cout << "  " << left << setw(10) << label << right << setw(9) << histogram.total << setw(8) << histogram.errors
+             << fixed << setprecision(2)
+             << setw(10) << (histogram.total > 0 ? histogram.sumMicros / histogram.total / 1000 : 0)
+             << setw(10) << histogram.percentile(0.50) / 1000.0
+             << setw(10) << histogram.percentile(0.90) / 1000.0
+             << setw(10) << histogram.percentile(0.99) / 1000.0
+             << setw(10) << histogram.percentile(0.999) / 1000.0
+             << setw(10) << histogram.maxMicros / 1000.0 << endl;
+    }
+
+    void printReport() const {
+        const double elapsed = chrono::duration<double>(Clock::now() - startTime).count();
+
+        cout << endl << fixed << setprecision(2) << "Sessions: " << started << " started, " << completed
+             << " completed, " << failed << " failed in " << elapsed << " s (" << completed / elapsed
+             << " sessions/s)" << endl;
+
+        if (delayedArrivals > 0) {
+            cout << "Arrivals delayed by the concurrency limit: " << delayedArrivals << endl;
+        }
+
+        cout << endl << "  " << left << setw(10) << "command" << right << setw(9) << "count" << setw(8) << "errors"
+             << setw(10) << "mean ms" << setw(10) << "p50" << setw(10) << "p90" << setw(10) << "p99"
+             << setw(10) << "p99.9" << setw(10) << "max" << endl;
+
+        if (const auto it = latencies.find("CONNECT"); it != latencies.end()) {
+            printLatencyRow(it->first, it->second);
+        }
+        if (const auto it = latencies.find("GREETING"); it != latencies.end()) {
+            printLatencyRow(it->first, it->second);
+        }
+
+        vector<string> printed = {"CONNECT", "GREETING"};
+        for (const auto &step : script) {
+            if (find(printed.begin(), printed.end(), step.label) != printed.end()) {
+                continue;
+            }
+
+            printed.push_back(step.label);
+            if (const auto it = latencies.find(step.label); it != latencies.end()) {
+                printLatencyRow(it->first, it->second);
+            }
+        }
+
+        printLatencyRow("session", sessionLatency);
+
+        if (!errors.empty()) {
+            cout << endl << "Errors:" << endl;
+            for (const auto &[error, count] : errors) {
+                cout << "  " << setw(8) << count << "  " << error << endl;
+            }
+        }
+    }
+};
+
+bool parseAddress(const string &target, sockaddr_in &address) {
+    const size_t colon = target.rfind(':');
+    if (colon == string::npos) {
+        return false;
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(stoi(target.substr(colon + 1)));
+
+    return inet_pton(AF_INET, target.substr(0, colon).c_str(), &address.sin_addr) > 0;
+}
+
+void printUsage(const char *program) {
+    cerr << "Usage: " << program << " smtp|pop3|imap host:port [--sessions N] [--concurrency N] [--rate R]"
+         << " [--think MS] [--duration S] [--timeout MS] [--script FILE]" << endl;
+}
+
+int main(const int argc, char *argv[]) {
+    if (argc < 3) {
+        printUsage(argv[0]);
+
+        return 1;
+    }
+
+    LoadOptions options;
+    const string protocol = argv[1];
+    if (protocol == "smtp") {
+        options.protocol = Protocol::Smtp;
+    } else if (protocol == "pop3") {
+        options.protocol = Protocol::Pop3;
+    } else if (protocol == "imap") {
+        options.protocol = Protocol::Imap;
+    } else {
+        printUsage(argv[0]);
+
+        return 1;
+    }
+
+    if (!parseAddress(argv[2], options.address)) {
+        cerr << "Invalid address: " << argv[2] << endl;
+
+        return 1;
+    }
+
+    bool sessionsGiven = false;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        const string option = argv[i];
+        const string value = argv[i + 1];
+
+        if (option == "--sessions") {
+            options.sessions = stoull(value);
+            sessionsGiven = true;
+        } else if (option == "--concurrency") {
+            options.concurrency = stoul(value);
+        } else if (option == "--rate") {
+            options.rate = stod(value);
+        } else if (option == "--think") {
+            options.thinkMillis = stod(value);
+        } else if (option == "--duration") {
+            options.durationSeconds = stod(value);
+        } else if (option == "--timeout") {
+            options.timeoutMillis = stoi(value);
+        } else if (option == "--script") {
+            options.scriptPath = value;
+        } else {
+            printUsage(argv[0]);
+
+            return 1;
+        }
+    }
+
+    if (options.durationSeconds > 0 && !sessionsGiven) {
+        options.sessions = UINT64_MAX;
+    }
+
+    vector<ScriptStep> script;
+    if (!options.scriptPath.empty()) {
+        ifstream file(options.scriptPath);
+        if (!file) {
+            cerr << "Failed to open script: " << options.scriptPath << endl;
+
+            return 1;
+        }
+
+        script = parseScript(options.protocol, file);
+    } else {
+        istringstream builtin(options.protocol == Protocol::Smtp   ? DEFAULT_SMTP_SCRIPT
+                              : options.protocol == Protocol::Pop3 ? DEFAULT_POP3_SCRIPT
+                                                                   : DEFAULT_IMAP_SCRIPT);
+        script = parseScript(options.protocol, builtin);
+    }
+
+    if (script.empty()) {
+        cerr << "Script has no commands." << endl;
+
+        return 1;
+    }
+
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    LoadGenerator generator;
+    generator.options = options;
+    generator.script = std::move(script);
+
+    cout << "Driving " << protocol << " at " << argv[2] << " with " << generator.script.size()
+         << " commands per session, concurrency " << options.concurrency;
+    if (options.rate > 0) {
+        cout << ", " << options.rate << " arrivals/s";
+    }
+    if (options.thinkMillis > 0) {
+        cout << ", " << options.thinkMillis << " ms mean think time";
+    }
+    cout << endl;
+
+    if (!generator.run()) {
+        return 1;
+    }
+
+    generator.printReport();
+
+    return generator.failed > 0 ? 2 : 0;
+}
@@ -0,0 +1,339 @@
+#ifndef COMMON_MIME_H
+#define COMMON_MIME_H
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "base64.h"
+
+// Single-pass MIME walker for the mail clients. Parts are returned as string_views into the caller's message buffer
+// (usually an mmap of the saved .eml), so nothing is copied until an attachment is written out. Nested multiparts
+// are tracked with a stack of open boundaries; every line of the message is looked at once.
+
+inline constexpr size_t MIME_DECODE_CHUNK = 1024 * 1024;
+
+struct MimeAttachment {
+    std::string filename;
+    std::string contentType;
+    std::string encoding;
+    std::string_view data;
+};
+
+struct MimeHeaders {
+    std::string contentType = "text/plain";
+    std::string boundary;
+    std::string disposition;
+    std::string filename;
+    std::string encoding;
+};
+
+inline std::string mimeLowercase(const std::string_view value) {
+    std::string result(value);
+    std::transform(result.begin(), result.end(), result.begin(), [](const unsigned char c) {
+        return static_cast<char>(std::tolower(c));
+    });
+
+    return result;
+}
+
+inline std::string_view mimeTrim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t' || value.back() == '\r' ||
+                              value.back() == '\n')) {
+        value.remove_suffix(1);
+    }
+
+    return value;
+}
+
+inline bool mimeEqualsIgnoreCase(const std::string_view a, const std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const unsigned char x,
+                                                                                 const unsigned char y) {
+        return std::tolower(x) == std::tolower(y);
+    });
+}
+
+// Returns the value of `name` from a "type; name=value; name="quoted value"" header.
+inline std::string mimeParameter(const std::string_view value, const std::string_view name) {
+    size_t position = value.find(';');
+
+    while (position != std::string_view::npos) {
+        const size_t equals = value.find('=', position + 1);
+        if (equals == std::string_view::npos) {
+            break;
+        }
+
+        const std::string_view key = mimeTrim(value.substr(position + 1, equals - position - 1));
+        size_t end;
+        std::string parameter;
+
+        if (equals + 1 < value.size() && value[equals + 1] == '"') {
+            end = equals + 2;
+            while (end < value.size() && value[end] != '"') {
+                if (value[end] == '\\' && end + 1 < value.size()) {
+                    end++;
+                }
+
+                parameter += value[end++];
+            }
+
+            end = value.find(';', end);
+        } else {
+            end = value.find(';', equals + 1);
+            parameter = mimeTrim(value.substr(equals + 1, end == std::string_view::npos ? end : end - equals - 1));
+        }
+
+        if (mimeEqualsIgnoreCase(key, name)) {
+            return parameter;
+        }
+
+        position = end;
+    }
+
+    return "";
+}
+
+inline MimeHeaders parseMimeHeaders(const std::string_view headers) {
+    MimeHeaders result;
+    std::string contentType;
+    std::string disposition;
+
+    size_t position = 0;
+    while (position < headers.size()) {
+        size_t lineEnd = headers.find('\n', position);
+        if (lineEnd == std::string_view::npos) {
+            lineEnd = headers.size();
+        }
+
+        const std::string_view line = headers.substr(position, lineEnd - position);
+        position = lineEnd + 1;
+
+        const size_t colon = line.find(':');
+        if (colon == std::string_view::npos || line[0] == ' ' || line[0] == '\t') {
+            continue;
+        }
+
+        const std::string_view name = line.substr(0, colon);
+        std::string *target = nullptr;
+        if (mimeEqualsIgnoreCase(name, "Content-Type")) {
+            target = &contentType;
+        } else if (mimeEqualsIgnoreCase(name, "Content-Disposition")) {
+            target = &disposition;
+        } else if (mimeEqualsIgnoreCase(name, "Content-Transfer-Encoding")) {
+            target = &result.encoding;
+        } else {
+            continue;
+        }
+
+        *target = mimeTrim(line.substr(colon + 1));
+
+        while (position < headers.size() && (headers[position] == ' ' || headers[position] == '\t')) {
+            lineEnd = headers.find('\n', position);
+            if (lineEnd == std::string_view::npos) {
+                lineEnd = headers.size();
+            }
+
+            *target += ' ';
+            *target += mimeTrim(headers.substr(position, lineEnd - position));
+            position = lineEnd + 1;
+        }
+    }
+
+    if (!contentType.empty()) {
+        result.contentType = mimeLowercase(mimeTrim(std::string_view(contentType).substr(0, contentType.find(';'))));
+        result.boundary = mimeParameter(contentType, "boundary");
+    }
+
+    result.disposition = mimeLowercase(mimeTrim(std::string_view(disposition).substr(0, disposition.find(';'))));
+    result.filename = mimeParameter(disposition, "filename");
+    if (result.filename.empty()) {
+        result.filename = mimeParameter(contentType, "name");
+    }
+
+    result.encoding = mimeLowercase(result.encoding);
+
+    return result;
+}
+
+inline std::vector<MimeAttachment> parseMimeAttachments(const std::string_view message) {
+    std::vector<MimeAttachment> attachments;
+    std::vector<std::string> delimiters;
+
+    bool inHeaders = true;
+    size_t headerStart = 0;
+    bool inLeaf = false;
+    MimeHeaders leaf;
+    size_t leafStart = 0;
+    size_t position = 0;
+
+    auto finishLeaf = [&](const size_t end) {
+        if (inLeaf && leaf.disposition == "attachment" && !leaf.filename.empty()) {
+            attachments.push_back({std::move(leaf.filename), std::move(leaf.contentType), std::move(leaf.encoding),
+                                   message.substr(leafStart, std::max(end, leafStart) - leafStart)});
+        }
+
+        inLeaf = false;
+    };
+
+    while (position < message.size()) {
+        if (inHeaders) {
+            size_t lineEnd = message.find('\n', position);
+            lineEnd = lineEnd == std::string_view::npos ? message.size() : lineEnd + 1;
+
+            const std::string_view line = message.substr(position, lineEnd - position);
+            if (line == "\r\n" || line == "\n") {
+                MimeHeaders headers = parseMimeHeaders(message.substr(headerStart, position - headerStart));
+                inHeaders = false;
+
+                if (headers.contentType.starts_with("multipart/") && !headers.boundary.empty()) {
+                    delimiters.push_back("--" + headers.boundary);
+                } else {
+                    inLeaf = true;
+                    leaf = std::move(headers);
+                    leafStart = lineEnd;
+                }
+            }
+
+            position = lineEnd;
+
+            continue;
+        }
+
+        if (delimiters.empty()) {
+            break;
+        }
+
+        size_t candidate = position;
+        if (message.substr(position, 2) != "--") {
+            const size_t found = message.find("\n--", position);
+            if (found == std::string_view::npos) {
+                break;
+            }
+
+            candidate = found + 1;
+        }
+
+        size_t lineEnd = message.find('\n', candidate);
+        lineEnd = lineEnd == std::string_view::npos ? message.size() : lineEnd + 1;
+        position = lineEnd;
+
+        const std::string_view line = mimeTrim(message.substr(candidate, lineEnd - candidate));
+        for (size_t level = delimiters.size(); level-- > 0;) {
+            if (!line.starts_with(delimiters[level])) {
+                continue;
+            }
+
+            const std::string_view rest = line.substr(delimiters[level].size());
+            if (!rest.empty() && rest != "--") {
+                continue;
+            }
+
+            size_t bodyEnd = candidate;
+            if (bodyEnd > 0 && message[bodyEnd - 1] == '\n') {
+                bodyEnd--;
+            }
+            if (bodyEnd > 0 && message[bodyEnd - 1] == '\r') {
+                bodyEnd--;
+            }
+
+            finishLeaf(bodyEnd);
+            delimiters.resize(rest.empty() ? level + 1 : level);
+
+            if (rest.empty()) {
+                inHeaders = true;
+                headerStart = position;
+            }
+
+            break;
+        }
+    }
+
+    finishLeaf(message.size());
+
+    return attachments;
+}
+
+// Hands the decoded attachment body to `sink` in pieces of at most MIME_DECODE_CHUNK input bytes, so the decoded
+// file never has to exist in memory.
+template <typename Sink>
+bool decodeMimeAttachment(const MimeAttachment &attachment, Sink &&sink) {
+    if (attachment.encoding != "base64") {
+        return sink(reinterpret_cast<const unsigned char *>(attachment.data.data()), attachment.data.size());
+    }
+
+    const std::string_view encoded = attachment.data.substr(0, attachment.data.find('='));
+    std::vector<unsigned char> decoded(base64DecodedCapacity(MIME_DECODE_CHUNK));
+    Base64ScalarDecoder state;
+
+    for (size_t offset = 0; offset < encoded.size(); offset += MIME_DECODE_CHUNK) {
+        const size_t piece = std::min(MIME_DECODE_CHUNK, encoded.size() - offset);
+        if (!sink(decoded.data(), base64DecodeUpdate(encoded.data() + offset, piece, decoded.data(), state))) {
+            return false;
+        }
+    }
+
+    unsigned char *tail = decoded.data();
+    state.finish(tail);
+
+    return sink(decoded.data(), tail - decoded.data());
+}
+
+inline bool writeMimeAttachment(const MimeAttachment &attachment, std::ostream &out) {
+    return decodeMimeAttachment(attachment, [&out](const unsigned char *data, const size_t length) {
+        out.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(length));
+
+        return static_cast<bool>(out);
+    });
+}
+
+// Saves the decoded attachment with positional writes into a file preallocated for the largest possible result, so
+// attachments can be saved from several threads at once without sharing a stream or a file offset.
+inline bool saveMimeAttachment(const MimeAttachment &attachment, const std::string &path) {
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    const size_t capacity = attachment.encoding == "base64" ? base64DecodedCapacity(attachment.data.size())
+                                                            : attachment.data.size();
+    if (capacity > 0 && fallocate(fd, 0, 0, static_cast<off_t>(capacity)) < 0 && errno != EOPNOTSUPP) {
+        close(fd);
+
+        return false;
+    }
+
+    off_t written = 0;
+    bool complete = decodeMimeAttachment(attachment, [fd, &written](const unsigned char *data, const size_t length) {
+        for (size_t done = 0; done < length;) {
+            const ssize_t bytesWritten = pwrite(fd, data + done, length - done, written);
+            if (bytesWritten < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return false;
+            }
+
+            done += bytesWritten;
+            written += bytesWritten;
+        }
+
+        return true;
+    });
+
+    complete = complete && ftruncate(fd, written) == 0;
+
+    return close(fd) == 0 && complete;
+}
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef COMMON_POP3_CLIENT_H
+#define COMMON_POP3_CLIENT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// Client side of the POP3 labs: a buffered reader that frames status lines and streams dot-terminated bodies, the
+// CAPA and UIDL helpers, and the on-disk UIDL index the incremental sync clients keep between runs.
+
+inline constexpr size_t POP3_READ_CHUNK_SIZE = 65536;
+inline constexpr char UID_INDEX_MAGIC[8] = {'U', 'I', 'D', 'L', 'I', 'D', 'X', '1'};
+
+struct ResponseReader {
+    std::vector<char> buffer = std::vector<char>(POP3_READ_CHUNK_SIZE);
+    size_t head = 0;
+    size_t tail = 0;
+
+    bool fill(const int sock) {
+        if (head > 0) {
+            memmove(buffer.data(), buffer.data() + head, tail - head);
+            tail -= head;
+            head = 0;
+        }
+
+        const ssize_t bytesReceived = recv(sock, buffer.data() + tail, buffer.size() - tail, 0);
+        if (bytesReceived <= 0) {
+            return false;
+        }
+
+        tail += bytesReceived;
+
+        return true;
+    }
+
+    bool readLine(const int sock, std::string &line) {
+        line.clear();
+
+        while (true) {
+            const char *start = buffer.data() + head;
+            if (const auto *newline = static_cast<const char *>(memchr(start, '\n', tail - head))) {
+                line.append(start, newline + 1 - start);
+                head += newline + 1 - start;
+
+                return true;
+            }
+
+            line.append(start, tail - head);
+            head = tail;
+
+            if (!fill(sock)) {
+                return false;
+            }
+        }
+    }
+
+    // Hands the body of a multi-line response to `sink` line by line, with dot-stuffing removed, and consumes the
+    // terminating ".\r\n".
+    template <typename Sink>
+    bool streamBody(const int sock, Sink &&sink) {
+        bool lineStart = true;
+
+        while (true) {
+            if (lineStart) {
+                while (tail - head < 3) {
+                    if (!fill(sock)) {
+                        return false;
+                    }
+                }
+
+                if (buffer[head] == '.') {
+                    if (buffer[head + 1] == '\r' && buffer[head + 2] == '\n') {
+                        head += 3;
+
+                        return true;
+                    }
+
+                    head++;
+                }
+
+                lineStart = false;
+            }
+
+            const char *start = buffer.data() + head;
+            if (const auto *newline = static_cast<const char *>(memchr(start, '\n', tail - head))) {
+                sink(start, newline + 1 - start);
+                head += newline + 1 - start;
+                lineStart = true;
+
+                continue;
+            }
+
+            sink(start, tail - head);
+            head = tail;
+
+            if (!fill(sock)) {
+                return false;
+            }
+        }
+    }
+
+    bool readResponse(const int sock, const bool multiLine, std::string &status, std::string &body) {
+        body.clear();
+
+        if (!readLine(sock, status)) {
+            return false;
+        }
+
+        if (!multiLine || !status.starts_with("+OK")) {
+            return true;
+        }
+
+        return streamBody(sock, [&body](const char *data, const size_t length) {
+            body.append(data, length);
+        });
+    }
+};
+
+inline bool supportsPipelining(const int sock, ResponseReader &reader) {
+    const std::string capaCmd = "CAPA\r\n";
+    if (send(sock, capaCmd.c_str(), capaCmd.length(), 0) < 0) {
+        return false;
+    }
+
+    std::string status;
+    std::string capabilities;
+    if (!reader.readResponse(sock, true, status, capabilities)) {
+        return false;
+    }
+
+    return status.starts_with("+OK") && ("\r\n" + capabilities).find("\r\nPIPELINING") != std::string::npos;
+}
+
+// Fills uids[number] for every message the server lists; uids must already be sized to the message count plus one.
+inline bool fetchUids(const int sock, ResponseReader &reader, std::vector<std::string> &uids) {
+    const std::string uidlCmd = "UIDL\r\n";
+    if (send(sock, uidlCmd.c_str(), uidlCmd.length(), 0) < 0) {
+        return false;
+    }
+
+    std::string status;
+    std::string listing;
+    if (!reader.readResponse(sock, true, status, listing) || !status.starts_with("+OK")) {
+        return false;
+    }
+
+    std::istringstream lines(listing);
+    std::string line;
+    while (getline(lines, line)) {
+        int number = 0;
+        std::string uid;
+        if (std::istringstream fields(line); fields >> number >> uid && number > 0 &&
+                                             number < static_cast<int>(uids.size())) {
+            uids[number] = uid;
+        }
+    }
+
+    return true;
+}
+
+struct UidIndexHeader {
+    char magic[8];
+    uint64_t count;
+};
+
+struct UidIndexRecord {
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t length;
+};
+
+inline uint64_t hashUid(const std::string_view uid) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char c : uid) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// The UIDs already downloaded, as records sorted by hash followed by the UID strings, mapped read-only.
+struct UidIndex {
+    void *mapping = MAP_FAILED;
+    size_t mappingSize = 0;
+    const UidIndexRecord *records = nullptr;
+    uint64_t count = 0;
+    const char *strings = nullptr;
+    size_t stringsSize = 0;
+
+    UidIndex() = default;
+    UidIndex(const UidIndex &) = delete;
+    UidIndex &operator=(const UidIndex &) = delete;
+
+    ~UidIndex() {
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, mappingSize);
+        }
+    }
+
+    bool open(const std::string &path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return errno == ENOENT;
+        }
+
+        struct stat info{};
+        if (fstat(fd, &info) < 0 || info.st_size < static_cast<off_t>(sizeof(UidIndexHeader))) {
+            close(fd);
+
+            return false;
+        }
+
+        mappingSize = info.st_size;
+        mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+
+        const auto *header = static_cast<const UidIndexHeader *>(mapping);
+        const size_t recordsEnd = sizeof(UidIndexHeader) + header->count * sizeof(UidIndexRecord);
+        if (memcmp(header->magic, UID_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->count > mappingSize ||
+            recordsEnd > mappingSize) {
+            return false;
+        }
+
+        count = header->count;
+        records = reinterpret_cast<const UidIndexRecord *>(static_cast<const char *>(mapping) + sizeof(UidIndexHeader));
+        strings = static_cast<const char *>(mapping) + recordsEnd;
+        stringsSize = mappingSize - recordsEnd;
+
+        return true;
+    }
+
+    bool contains(const std::string_view uid) const {
+        const uint64_t hash = hashUid(uid);
+        const UidIndexRecord *end = records + count;
+        const UidIndexRecord *record = std::lower_bound(records, end, hash, [](const UidIndexRecord &entry,
+                                                                               const uint64_t value) {
+            return entry.hash < value;
+        });
+
+        for (; record != end && record->hash == hash; ++record) {
+            if (static_cast<size_t>(record->offset) + record->length <= stringsSize &&
+                std::string_view(strings + record->offset, record->length) == uid) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static bool write(const std::string &path, std::vector<std::string> uids) {
+        std::sort(uids.begin(), uids.end(), [](const std::string &a, const std::string &b) {
+            const uint64_t hashA = hashUid(a);
+            const uint64_t hashB = hashUid(b);
+
+            return hashA != hashB ? hashA < hashB : a < b;
+        });
+        uids.erase(std::unique(uids.begin(), uids.end()), uids.end());
+
+        UidIndexHeader header{};
+        memcpy(header.magic, UID_INDEX_MAGIC, sizeof(header.magic));
+        header.count = uids.size();
+
+        std::vector<UidIndexRecord> records;
+        records.reserve(uids.size());
+        std::string strings;
+        for (const auto &uid : uids) {
+            records.push_back({hashUid(uid), static_cast<uint32_t>(strings.size()),
+                               static_cast<uint32_t>(uid.size())});
+            strings += uid;
+        }
+
+        const std::string temporaryPath = path + ".tmp";
+        {
+            std::ofstream out(temporaryPath, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(records.data()),
+                      static_cast<std::streamsize>(records.size() * sizeof(UidIndexRecord)));
+            out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+
+            if (!out) {
+                return false;
+            }
+        }
+
+        return rename(temporaryPath.c_str(), path.c_str()) == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef COMMON_POP3_HEADERS_H
+#define COMMON_POP3_HEADERS_H
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "pop3_client.h"
+
+// Header survey for the mailbox size clients: TOP n 0 for every message, pipelined when the server allows it, with
+// the interesting headers kept column-wise and senders and content types interned.
+
+inline constexpr int POP3_TOP_WINDOW = 32;
+
+inline std::string trimHeaderValue(const std::string &value) {
+    const size_t first = value.find_first_not_of(" \t");
+    if (first == std::string::npos) {
+        return "";
+    }
+
+    return value.substr(first, value.find_last_not_of(" \t\r\n") - first + 1);
+}
+
+inline std::string lowercase(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+
+    return value;
+}
+
+struct HeaderSummary {
+    std::vector<int> numbers;
+    std::vector<uint32_t> sizes;
+    std::vector<uint32_t> senders;
+    std::vector<uint32_t> contentTypes;
+    std::vector<std::string> subjects;
+    std::vector<std::string> dates;
+
+    std::vector<std::string> senderNames;
+    std::vector<std::string> contentTypeNames;
+    std::unordered_map<std::string, uint32_t> senderIds;
+    std::unordered_map<std::string, uint32_t> contentTypeIds;
+
+    static uint32_t intern(const std::string &value, std::vector<std::string> &names,
+                           std::unordered_map<std::string, uint32_t> &ids) {
+        const auto [it, inserted] = ids.try_emplace(value, static_cast<uint32_t>(names.size()));
+        if (inserted) {
+            names.push_back(value);
+        }
+
+        return it->second;
+    }
+
+    void add(const int number, const uint32_t size, const std::string &headers) {
+        std::string from;
+        std::string subject;
+        std::string date;
+        std::string contentType = "text/plain";
+
+        std::string *current = nullptr;
+        std::istringstream lines(headers);
+        std::string line;
+        while (getline(lines, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            if (line.empty()) {
+                break;
+            }
+
+            if ((line[0] == ' ' || line[0] == '\t') && current != nullptr) {
+                *current += " " + trimHeaderValue(line);
+                continue;
+            }
+
+            current = nullptr;
+
+            const size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+
+            const std::string name = lowercase(line.substr(0, colon));
+            if (name == "from") {
+                current = &from;
+            } else if (name == "subject") {
+                current = &subject;
+            } else if (name == "date") {
+                current = &date;
+            } else if (name == "content-type") {
+                current = &contentType;
+            } else {
+                continue;
+            }
+
+            *current = trimHeaderValue(line.substr(colon + 1));
+        }
+
+        if (const size_t open = from.find('<'), close = from.find('>', open); open != std::string::npos &&
+                                                                           close != std::string::npos) {
+            from = from.substr(open + 1, close - open - 1);
+        }
+
+        numbers.push_back(number);
+        sizes.push_back(size);
+        senders.push_back(intern(lowercase(from), senderNames, senderIds));
+        contentTypes.push_back(intern(lowercase(trimHeaderValue(contentType.substr(0, contentType.find(';')))),
+                                      contentTypeNames, contentTypeIds));
+        subjects.push_back(std::move(subject));
+        dates.push_back(std::move(date));
+    }
+
+    bool hasAttachments(const size_t row) const {
+        const std::string &type = contentTypeNames[contentTypes[row]];
+
+        return type == "multipart/mixed" || (!type.starts_with("text/") && !type.starts_with("multipart/"));
+    }
+
+    void printRow(const size_t row) const {
+        std::cout << "  #" << numbers[row] << "  " << sizes[row] << " bytes  " << senderNames[senders[row]] << "  "
+                  << contentTypeNames[contentTypes[row]] << "  " << dates[row] << "  " << subjects[row] << std::endl;
+    }
+
+    void printLargestSenders(const size_t limit) const {
+        std::vector<uint64_t> bytes(senderNames.size());
+        std::vector<uint32_t> counts(senderNames.size());
+        for (size_t row = 0; row < numbers.size(); row++) {
+            bytes[senders[row]] += sizes[row];
+            counts[senders[row]]++;
+        }
+
+        std::vector<uint32_t> order(senderNames.size());
+        for (uint32_t id = 0; id < order.size(); id++) {
+            order[id] = id;
+        }
+
+        const size_t shown = std::min(limit, order.size());
+        std::partial_sort(order.begin(), order.begin() + shown, order.end(), [&bytes](const uint32_t a,
+                                                                                    const uint32_t b) {
+            return bytes[a] > bytes[b];
+        });
+
+        std::cout << "\nLargest senders by total size:" << std::endl;
+        for (size_t i = 0; i < shown; i++) {
+            std::cout << "  " << bytes[order[i]] << " bytes in " << counts[order[i]] << " messages from "
+                      << senderNames[order[i]] << std::endl;
+        }
+    }
+
+    void printMessagesWithAttachments() const {
+        size_t found = 0;
+        uint64_t bytes = 0;
+
+        std::cout << "\nMessages with attachments:" << std::endl;
+        for (size_t row = 0; row < numbers.size(); row++) {
+            if (hasAttachments(row)) {
+                printRow(row);
+                found++;
+                bytes += sizes[row];
+            }
+        }
+
+        std::cout << found << " of " << numbers.size() << " messages carry attachments (" << bytes << " bytes)."
+                  << std::endl;
+    }
+};
+
+inline bool scanHeaders(const int sock, ResponseReader &reader, const std::vector<std::pair<int, int>> &messageSizes,
+                        HeaderSummary &summary) {
+    const int window = supportsPipelining(sock, reader) ? POP3_TOP_WINDOW : 1;
+
+    std::cout << "\nScanning headers of " << messageSizes.size() << " messages with TOP";
+    if (window > 1) {
+        std::cout << " (pipelined, " << window << " commands in flight)";
+    }
+    std::cout << "..." << std::endl;
+
+    const auto scanStart = std::chrono::steady_clock::now();
+    size_t nextToSend = 0;
+    std::string status;
+    std::string headers;
+
+    for (size_t position = 0; position < messageSizes.size(); ++position) {
+        std::string topCmds;
+        while (nextToSend < messageSizes.size() && nextToSend - position < static_cast<size_t>(window)) {
+            topCmds += "TOP " + std::to_string(messageSizes[nextToSend++].first) + " 0\r\n";
+        }
+
+        if (!topCmds.empty() && send(sock, topCmds.c_str(), topCmds.length(), 0) < 0) {
+            std::cerr << "Failed to send TOP command." << std::endl;
+
+            return false;
+        }
+
+        const auto [number, size] = messageSizes[position];
+        if (!reader.readResponse(sock, true, status, headers)) {
+            std::cerr << "Failed to receive response to TOP command for message #" << number << std::endl;
+
+            return false;
+        }
+
+        if (!status.starts_with("+OK")) {
+            std::cerr << "Failed to read headers of message #" << number << ": " << status;
+            continue;
+        }
+
+        summary.add(number, size, headers);
+    }
+
+    const std::chrono::duration<double> scanTime = std::chrono::steady_clock::now() - scanStart;
+    std::cout << "Scanned " << summary.numbers.size() << " messages in " << scanTime.count() << " s: "
+              << summary.numbers.size() / scanTime.count() << " messages/s, " << summary.senderNames.size()
+              << " distinct senders." << std::endl;
+
+    return true;
+}
+
+#endif
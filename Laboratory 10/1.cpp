@@ -12,6 +12,7 @@
 #include <poll.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "../Common/base64.h"
 
 using namespace std;
 
@@ -19,33 +20,6 @@ void printSslError(const char* message) {
     cerr << message << ": " << ERR_error_string(ERR_get_error(), nullptr) << endl;
 }
 
-string base64Encode(const vector<unsigned char> &input) {
-    static const string base64Chars =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    string output;
-
-    int val = 0, valb = -6;
-    for (const unsigned char c: input) {
-        val = (val << 8) + c;
-        valb += 8;
-
-        while (valb >= 0) {
-            output.push_back(base64Chars[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
-    }
-
-    if (valb > -6) {
-        output.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    }
-
-    while (output.size() % 4) {
-        output.push_back('=');
-    }
-
-    return output;
-}
-
 string generateWebSocketKey() {
     vector<unsigned char> randomData(16);
     random_device rd;
@@ -10,6 +10,7 @@
 #include <sstream>
 #include <iomanip>
 #include <signal.h>
+#include "../Common/base64.h"
 
 using namespace std;
 
@@ -28,33 +29,6 @@ string computeSHA1(const string& input) {
     return binaryResult;
 }
 
-string base64Encode(const vector<unsigned char> &input) {
-    static const string base64Chars =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    string output;
-
-    int val = 0, valb = -6;
-    for (const unsigned char c: input) {
-        val = (val << 8) + c;
-        valb += 8;
-
-        while (valb >= 0) {
-            output.push_back(base64Chars[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
-    }
-
-    if (valb > -6) {
-        output.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    }
-
-    while (output.size() % 4) {
-        output.push_back('=');
-    }
-
-    return output;
-}
-
 string computeAcceptKey(const string& clientKey) {
     const string magicString = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
     const string concatenated = clientKey + magicString;
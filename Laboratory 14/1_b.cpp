@@ -9,46 +9,14 @@
 #include <sstream>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "../Common/base64.h"
 
 using namespace std;
 
 constexpr size_t BUFFER_SIZE = 1024;
 
-string base64Encode(const vector<unsigned char> &input) {
-    static const string base64Chars =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    string output;
-
-    int val = 0, valb = -6;
-    for (const unsigned char c: input) {
-        val = (val << 8) + c;
-        valb += 8;
-
-        while (valb >= 0) {
-            output.push_back(base64Chars[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
-    }
-
-    if (valb > -6) {
-        output.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    }
-
-    while (output.size() % 4) {
-        output.push_back('=');
-    }
-
-    return output;
-}
-
 string encodeString(const string &str) {
-    vector<unsigned char> data;
-
-    for (const char c: str) {
-        data.push_back(static_cast<unsigned char>(c));
-    }
-
-    return base64Encode(data);
+    return base64Encode(str);
 }
 
 bool sendCommand(SSL *ssl, const string &command, char *buffer, const size_t bufferSize) {
@@ -3,67 +3,179 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <vector>
 #include <chrono>
 #include <thread>
 
 using namespace std;
+using namespace std::chrono;
 
-bool knockUdpPort(const string &serverIp, const int port) {
-    const int udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+constexpr auto DISCOVERY_TIMEOUT = milliseconds(1000);
+constexpr auto KNOCK_INTERVAL = milliseconds(50);
+constexpr auto PORT_OPEN_DELAY = milliseconds(200);
+
+int createKnockSocket() {
+    const int udpSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (udpSocket < 0) {
         cerr << "Failed to create UDP socket." << endl;
 
-        return false;
+        return -1;
     }
 
-    sockaddr_in serverAddress;
+    constexpr int receiveBufferSize = 1 << 20;
+    setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize));
+
+    return udpSocket;
+}
+
+bool sendPing(const int udpSocket, const in_addr &serverAddr, const int port) {
+    sockaddr_in serverAddress{};
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_port = htons(port);
+    serverAddress.sin_addr = serverAddr;
 
-    if (inet_pton(AF_INET, serverIp.c_str(), &serverAddress.sin_addr) <= 0) {
-        cerr << "Invalid ip address format." << endl;
-
-        close(udpSocket);
+    const string message = "PING";
+    if (sendto(udpSocket, message.c_str(), message.length(), 0,
+               reinterpret_cast<const sockaddr *>(&serverAddress), sizeof(serverAddress)) < 0) {
+        cerr << "Failed to send UDP message to port " << port << ": " << strerror(errno) << endl;
 
         return false;
     }
 
-    timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    if (setsockopt(udpSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        cerr << "Failed to set socket timeout." << endl;
+    return true;
+}
+
+vector<int> discoverKnockSequence(const in_addr &serverAddr, const vector<int> &candidatePorts) {
+    vector<int> knockSequence;
+
+    const int udpSocket = createKnockSocket();
+    if (udpSocket < 0) {
+        return knockSequence;
+    }
+
+    const int epollFd = epoll_create1(0);
+    if (epollFd < 0) {
+        cerr << "Failed to create epoll instance." << endl;
 
         close(udpSocket);
 
-        return false;
+        return knockSequence;
     }
 
-    const string message = "PING";
-    if (sendto(udpSocket, message.c_str(), message.length(), 0,
-              reinterpret_cast<const sockaddr *>(&serverAddress), sizeof(serverAddress)) < 0) {
-        cerr << "Failed to send UDP message to port " << port << endl;
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = udpSocket;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, udpSocket, &event) < 0) {
+        cerr << "Failed to register UDP socket with epoll." << endl;
 
+        close(epollFd);
         close(udpSocket);
 
-        return false;
+        return knockSequence;
     }
 
-    char buffer[4096] = {};
-    sockaddr_in responseAddress;
-    socklen_t responseAddressLength = sizeof(responseAddress);
+    vector<bool> answered(65536, false);
+    vector<bool> probed(65536, false);
+    size_t pending = 0;
+
+    for (const int port : candidatePorts) {
+        if (sendPing(udpSocket, serverAddr, port)) {
+            probed[port] = true;
+            pending++;
+        }
+    }
+
+    const auto startTime = steady_clock::now();
+    const auto deadline = startTime + DISCOVERY_TIMEOUT;
+
+    while (pending > 0) {
+        const auto remaining = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+        if (remaining <= 0) {
+            break;
+        }
+
+        epoll_event events[1];
+        const int readyCount = epoll_wait(epollFd, events, 1, static_cast<int>(remaining));
+        if (readyCount < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            cerr << "epoll_wait failed: " << strerror(errno) << endl;
+            break;
+        }
+
+        if (readyCount == 0) {
+            break;
+        }
+
+        while (true) {
+            char buffer[64];
+            sockaddr_in responseAddress{};
+            socklen_t responseAddressLength = sizeof(responseAddress);
+
+            const ssize_t bytesRead = recvfrom(udpSocket, buffer, sizeof(buffer), 0,
+                                               reinterpret_cast<sockaddr *>(&responseAddress),
+                                               &responseAddressLength);
+            if (bytesRead < 0) {
+                break;
+            }
 
-    const ssize_t bytesRead = recvfrom(udpSocket, buffer, sizeof(buffer) - 1, 0,
-                             reinterpret_cast<sockaddr *>(&responseAddress), &responseAddressLength);
+            if (responseAddress.sin_addr.s_addr != serverAddr.s_addr) {
+                continue;
+            }
+
+            const int sourcePort = ntohs(responseAddress.sin_port);
+            if (!probed[sourcePort] || answered[sourcePort] || string(buffer, bytesRead) != "PONG") {
+                continue;
+            }
 
+            answered[sourcePort] = true;
+            pending--;
+
+            const auto elapsed = duration_cast<microseconds>(steady_clock::now() - startTime);
+            cout << "UDP port " << sourcePort << " [FOUND] after " << elapsed.count() / 1000.0 << " ms" << endl;
+        }
+    }
+
+    close(epollFd);
     close(udpSocket);
 
-    if (bytesRead < 0) {
+    for (const int port : candidatePorts) {
+        if (answered[port]) {
+            knockSequence.push_back(port);
+        }
+    }
+
+    return knockSequence;
+}
+
+bool replayKnockSequence(const in_addr &serverAddr, const vector<int> &knockSequence) {
+    const int udpSocket = createKnockSocket();
+    if (udpSocket < 0) {
         return false;
     }
 
-    return string(buffer, bytesRead) == "PONG";
+    auto nextKnock = steady_clock::now();
+
+    for (const int port : knockSequence) {
+        this_thread::sleep_until(nextKnock);
+
+        cout << "Knocking on UDP port " << port << endl;
+        if (!sendPing(udpSocket, serverAddr, port)) {
+            close(udpSocket);
+
+            return false;
+        }
+
+        nextKnock += KNOCK_INTERVAL;
+    }
+
+    close(udpSocket);
+
+    return true;
 }
 
 bool connectToTcpServer(const string &serverIp, const int port, string &response) {
@@ -128,34 +240,36 @@ bool connectToTcpServer(const string &serverIp, const int port, string &response
     return true;
 }
 
-int main() {
-    const string serverIp = "212.182.24.27";
+int main(const int argc, char *argv[]) {
+    const string serverIp = argc > 1 ? argv[1] : "212.182.24.27";
     constexpr int tcpPort = 2913;
 
+    in_addr serverAddr{};
+    if (inet_pton(AF_INET, serverIp.c_str(), &serverAddr) <= 0) {
+        cerr << "Invalid ip address format." << endl;
+
+        return 1;
+    }
+
     cout << "Starting port-knocking client for " << serverIp << endl;
     cout << "Looking for UDP ports ending with 666 that respond with PONG..." << endl;
 
-    vector<int> knockSequence;
-
     constexpr int startPort = 1000;
     constexpr int endPort = 65535;
     constexpr int suffixToFind = 666;
 
+    vector<int> candidatePorts;
     for (int port = startPort; port <= endPort; port++) {
         if (port % 1000 == suffixToFind) {
-            cout << "Trying UDP port " << port << "..." << flush;
-
-            if (knockUdpPort(serverIp, port)) {
-                cout << " [FOUND]" << endl;
-                knockSequence.push_back(port);
-            } else {
-                cout << " [not part of sequence]" << endl;
-            }
-
-            this_thread::sleep_for(chrono::milliseconds(100));
+            candidatePorts.push_back(port);
         }
     }
 
+    cout << "Probing " << candidatePorts.size() << " UDP ports in parallel..." << endl;
+
+    const auto startTime = steady_clock::now();
+    const vector<int> knockSequence = discoverKnockSequence(serverAddr, candidatePorts);
+
     cout << "Discovered knock sequence: ";
     for (size_t i = 0; i < knockSequence.size(); i++) {
         cout << knockSequence[i];
@@ -165,16 +279,21 @@ int main() {
     }
     cout << endl;
 
+    if (knockSequence.empty()) {
+        cerr << "No ports responded with PONG." << endl;
+
+        return 1;
+    }
+
     cout << "Applying the knock sequence..." << endl;
-    for (const int port : knockSequence) {
-        cout << "Knocking on UDP port " << port << endl;
-        knockUdpPort(serverIp, port);
+    if (!replayKnockSequence(serverAddr, knockSequence)) {
+        cerr << "Failed to apply the knock sequence." << endl;
 
-        this_thread::sleep_for(chrono::milliseconds(500));
+        return 1;
     }
 
     cout << "Waiting for the TCP port to open..." << endl;
-    this_thread::sleep_for(chrono::seconds(2));
+    this_thread::sleep_for(PORT_OPEN_DELAY);
 
     if (string response; connectToTcpServer(serverIp, tcpPort, response)) {
         cout << "Successfully connected to hidden TCP service!" << endl;
@@ -183,5 +302,8 @@ int main() {
         cerr << "Failed to connect to the hidden TCP service." << endl;
     }
 
+    const auto duration = duration_cast<milliseconds>(steady_clock::now() - startTime);
+    cout << "Total time: " << duration.count() << " ms" << endl;
+
     return 0;
 }
@@ -0,0 +1,521 @@
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <vector>
+#include <array>
+
+using namespace std;
+using namespace std::chrono;
+
+constexpr array<int, 3> KNOCK_SEQUENCE = {7666, 21666, 48666};
+constexpr int SERVICE_PORT = 2913;
+
+constexpr uint32_t MAX_KNOCKERS = 1 << 17;
+constexpr uint32_t TABLE_SLOTS = MAX_KNOCKERS * 2;
+constexpr uint32_t NO_ENTRY = UINT32_MAX;
+
+constexpr int TICK_MS = 10;
+constexpr uint64_t KNOCK_TIMEOUT_TICKS = 5000 / TICK_MS;
+constexpr uint64_t ACCESS_WINDOW_TICKS = 30000 / TICK_MS;
+
+constexpr int WHEEL_BITS = 6;
+constexpr int WHEEL_SLOTS = 1 << WHEEL_BITS;
+constexpr int WHEEL_LEVELS = 3;
+constexpr uint64_t WHEEL_MASK = WHEEL_SLOTS - 1;
+
+constexpr int RECEIVE_BATCH = 64;
+
+struct KnockEntry {
+    uint32_t address = 0;
+    uint8_t stage = 0;
+    bool authorized = false;
+    uint16_t timerSlot = 0;
+    uint32_t timerPrev = NO_ENTRY;
+    uint32_t timerNext = NO_ENTRY;
+    uint64_t expiresAt = 0;
+};
+
+struct KnockTable {
+    vector<KnockEntry> entries;
+    vector<uint32_t> slots;
+    vector<uint32_t> freeList;
+
+    KnockTable() : entries(MAX_KNOCKERS), slots(TABLE_SLOTS, NO_ENTRY) {
+        freeList.reserve(MAX_KNOCKERS);
+        for (uint32_t i = MAX_KNOCKERS; i > 0; i--) {
+            freeList.push_back(i - 1);
+        }
+    }
+
+    static uint32_t hashAddress(const uint32_t address) {
+        return static_cast<uint32_t>((address * 0x9E3779B97F4A7C15ULL) >> 32) & (TABLE_SLOTS - 1);
+    }
+
+    size_t size() const {
+        return MAX_KNOCKERS - freeList.size();
+    }
+
+    uint32_t find(const uint32_t address) const {
+        for (uint32_t slot = hashAddress(address);; slot = (slot + 1) & (TABLE_SLOTS - 1)) {
+            const uint32_t index = slots[slot];
+            if (index == NO_ENTRY) {
+                return NO_ENTRY;
+            }
+
+            if (entries[index].address == address) {
+                return index;
+            }
+        }
+    }
+
+    uint32_t insert(const uint32_t address) {
+        if (freeList.empty()) {
+            return NO_ENTRY;
+        }
+
+        const uint32_t index = freeList.back();
+        freeList.pop_back();
+
+        entries[index] = KnockEntry();
+        entries[index].address = address;
+
+        uint32_t slot = hashAddress(address);
+        while (slots[slot] != NO_ENTRY) {
+            slot = (slot + 1) & (TABLE_SLOTS - 1);
+        }
+        slots[slot] = index;
+
+        return index;
+    }
+
+    void erase(const uint32_t index) {
+        uint32_t slot = hashAddress(entries[index].address);
+        while (slots[slot] != index) {
+            slot = (slot + 1) & (TABLE_SLOTS - 1);
+        }
+
+        uint32_t hole = slot;
+        for (uint32_t next = (hole + 1) & (TABLE_SLOTS - 1); slots[next] != NO_ENTRY;
+             next = (next + 1) & (TABLE_SLOTS - 1)) {
+            const uint32_t home = hashAddress(entries[slots[next]].address);
+            if (((next - home) & (TABLE_SLOTS - 1)) >= ((next - hole) & (TABLE_SLOTS - 1))) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole] = NO_ENTRY;
+
+        freeList.push_back(index);
+    }
+};
+
+struct TimerWheel {
+    vector<KnockEntry> &entries;
+    array<uint32_t, WHEEL_LEVELS * WHEEL_SLOTS> heads{};
+    uint64_t currentTick = 0;
+
+    explicit TimerWheel(vector<KnockEntry> &entries) : entries(entries) {
+        heads.fill(NO_ENTRY);
+    }
+
+    void schedule(const uint32_t index, const uint64_t expiresAt) {
+        KnockEntry &entry = entries[index];
+        entry.expiresAt = expiresAt > currentTick ? expiresAt : currentTick;
+
+        const uint64_t delta = entry.expiresAt - currentTick;
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+            level++;
+        }
+
+        uint64_t clampedExpiry = entry.expiresAt;
+        if (const uint64_t horizon = currentTick + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+            clampedExpiry > horizon) {
+            clampedExpiry = horizon;
+        }
+
+        const int slot = level * WHEEL_SLOTS + static_cast<int>((clampedExpiry >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+        entry.timerSlot = static_cast<uint16_t>(slot);
+        entry.timerPrev = NO_ENTRY;
+        entry.timerNext = heads[slot];
+        if (heads[slot] != NO_ENTRY) {
+            entries[heads[slot]].timerPrev = index;
+        }
+        heads[slot] = index;
+    }
+
+    void cancel(const uint32_t index) {
+        KnockEntry &entry = entries[index];
+
+        if (entry.timerPrev != NO_ENTRY) {
+            entries[entry.timerPrev].timerNext = entry.timerNext;
+        } else {
+            heads[entry.timerSlot] = entry.timerNext;
+        }
+
+        if (entry.timerNext != NO_ENTRY) {
+            entries[entry.timerNext].timerPrev = entry.timerPrev;
+        }
+
+        entry.timerPrev = NO_ENTRY;
+        entry.timerNext = NO_ENTRY;
+    }
+
+    void reschedule(const uint32_t index, const uint64_t expiresAt) {
+        cancel(index);
+        schedule(index, expiresAt);
+    }
+
+    void cascade(const int level) {
+        const int slot = level * WHEEL_SLOTS + static_cast<int>((currentTick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+        uint32_t index = heads[slot];
+        heads[slot] = NO_ENTRY;
+
+        while (index != NO_ENTRY) {
+            const uint32_t next = entries[index].timerNext;
+            schedule(index, entries[index].expiresAt);
+            index = next;
+        }
+    }
+
+    template<typename ExpireCallback>
+    void advance(const uint64_t targetTick, ExpireCallback onExpire) {
+        while (currentTick < targetTick) {
+            currentTick++;
+
+            for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+                if ((currentTick & ((1ULL << (WHEEL_BITS * level)) - 1)) == 0) {
+                    cascade(level);
+                }
+            }
+
+            const int slot = static_cast<int>(currentTick & WHEEL_MASK);
+            uint32_t index = heads[slot];
+            heads[slot] = NO_ENTRY;
+
+            while (index != NO_ENTRY) {
+                const uint32_t next = entries[index].timerNext;
+                entries[index].timerPrev = NO_ENTRY;
+                entries[index].timerNext = NO_ENTRY;
+
+                if (entries[index].expiresAt <= currentTick) {
+                    onExpire(index);
+                } else {
+                    schedule(index, entries[index].expiresAt);
+                }
+
+                index = next;
+            }
+        }
+    }
+};
+
+struct KnockDaemon {
+    KnockTable table;
+    TimerWheel wheel{table.entries};
+    uint64_t completedSequences = 0;
+    uint64_t droppedKnockers = 0;
+
+    void expire(const uint32_t index) {
+        table.erase(index);
+    }
+
+    void handleKnock(const uint32_t address, const size_t sequenceIndex) {
+        uint32_t index = table.find(address);
+
+        if (index == NO_ENTRY) {
+            if (sequenceIndex != 0) {
+                return;
+            }
+
+            index = table.insert(address);
+            if (index == NO_ENTRY) {
+                droppedKnockers++;
+
+                return;
+            }
+
+            table.entries[index].stage = 1;
+            wheel.schedule(index, wheel.currentTick + KNOCK_TIMEOUT_TICKS);
+        } else {
+            KnockEntry &entry = table.entries[index];
+
+            if (entry.authorized) {
+                return;
+            }
+
+            if (sequenceIndex == entry.stage) {
+                entry.stage++;
+            } else if (sequenceIndex == 0) {
+                entry.stage = 1;
+            } else {
+                wheel.cancel(index);
+                table.erase(index);
+
+                return;
+            }
+
+            wheel.reschedule(index, wheel.currentTick + KNOCK_TIMEOUT_TICKS);
+        }
+
+        if (KnockEntry &entry = table.entries[index]; entry.stage == KNOCK_SEQUENCE.size()) {
+            entry.authorized = true;
+            completedSequences++;
+            wheel.reschedule(index, wheel.currentTick + ACCESS_WINDOW_TICKS);
+
+            char clientIp[INET_ADDRSTRLEN];
+            const in_addr clientAddr{address};
+            inet_ntop(AF_INET, &clientAddr, clientIp, INET_ADDRSTRLEN);
+            cout << "Source " << clientIp << " completed the knock sequence, opening port " << SERVICE_PORT << endl;
+        }
+    }
+
+    bool isAuthorized(const uint32_t address) const {
+        const uint32_t index = table.find(address);
+
+        return index != NO_ENTRY && table.entries[index].authorized;
+    }
+};
+
+int createUdpSocket(const in_addr &bindAddr, const int port) {
+    const int udpSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (udpSocket < 0) {
+        cerr << "Failed to create UDP socket." << endl;
+
+        return -1;
+    }
+
+    constexpr int receiveBufferSize = 4 << 20;
+    setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize));
+
+    sockaddr_in serverAddress{};
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    serverAddress.sin_addr = bindAddr;
+
+    if (bind(udpSocket, reinterpret_cast<const sockaddr *>(&serverAddress), sizeof(serverAddress)) < 0) {
+        cerr << "Failed to bind UDP port " << port << ": " << strerror(errno) << endl;
+
+        close(udpSocket);
+
+        return -1;
+    }
+
+    return udpSocket;
+}
+
+int createTcpSocket(const in_addr &bindAddr, const int port) {
+    const int serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (serverSocket < 0) {
+        cerr << "Failed to create TCP socket." << endl;
+
+        return -1;
+    }
+
+    constexpr int enable = 1;
+    if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
+        cerr << "Failed to set socket options." << endl;
+
+        close(serverSocket);
+
+        return -1;
+    }
+
+    sockaddr_in serverAddress{};
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    serverAddress.sin_addr = bindAddr;
+
+    if (bind(serverSocket, reinterpret_cast<const sockaddr *>(&serverAddress), sizeof(serverAddress)) < 0) {
+        cerr << "Failed to bind TCP port " << port << ": " << strerror(errno) << endl;
+
+        close(serverSocket);
+
+        return -1;
+    }
+
+    if (listen(serverSocket, SOMAXCONN) < 0) {
+        cerr << "Failed to listen for connections." << endl;
+
+        close(serverSocket);
+
+        return -1;
+    }
+
+    return serverSocket;
+}
+
+void handleUdpSocket(KnockDaemon &daemon, const int udpSocket, const size_t sequenceIndex) {
+    char buffers[RECEIVE_BATCH][16];
+    sockaddr_in addresses[RECEIVE_BATCH];
+    iovec receiveVectors[RECEIVE_BATCH];
+    mmsghdr receiveMessages[RECEIVE_BATCH];
+
+    static const char pong[] = "PONG";
+    iovec pongVectors[RECEIVE_BATCH];
+    mmsghdr replyMessages[RECEIVE_BATCH];
+
+    while (true) {
+        for (int i = 0; i < RECEIVE_BATCH; i++) {
+            receiveVectors[i] = {buffers[i], sizeof(buffers[i])};
+            receiveMessages[i] = {};
+            receiveMessages[i].msg_hdr.msg_name = &addresses[i];
+            receiveMessages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            receiveMessages[i].msg_hdr.msg_iov = &receiveVectors[i];
+            receiveMessages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        const int received = recvmmsg(udpSocket, receiveMessages, RECEIVE_BATCH, MSG_DONTWAIT, nullptr);
+        if (received <= 0) {
+            return;
+        }
+
+        int replies = 0;
+        for (int i = 0; i < received; i++) {
+            if (receiveMessages[i].msg_len != 4 || memcmp(buffers[i], "PING", 4) != 0) {
+                continue;
+            }
+
+            daemon.handleKnock(addresses[i].sin_addr.s_addr, sequenceIndex);
+
+            pongVectors[replies] = {const_cast<char *>(pong), 4};
+            replyMessages[replies] = {};
+            replyMessages[replies].msg_hdr.msg_name = &addresses[i];
+            replyMessages[replies].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            replyMessages[replies].msg_hdr.msg_iov = &pongVectors[replies];
+            replyMessages[replies].msg_hdr.msg_iovlen = 1;
+            replies++;
+        }
+
+        if (replies > 0) {
+            sendmmsg(udpSocket, replyMessages, replies, MSG_DONTWAIT);
+        }
+
+        if (received < RECEIVE_BATCH) {
+            return;
+        }
+    }
+}
+
+void handleServiceConnections(const KnockDaemon &daemon, const int serverSocket) {
+    while (true) {
+        sockaddr_in clientAddress{};
+        socklen_t clientAddressLength = sizeof(clientAddress);
+
+        const int clientSocket = accept(serverSocket, reinterpret_cast<sockaddr *>(&clientAddress),
+                                        &clientAddressLength);
+        if (clientSocket < 0) {
+            return;
+        }
+
+        char clientIp[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddress.sin_addr, clientIp, INET_ADDRSTRLEN);
+
+        if (daemon.isAuthorized(clientAddress.sin_addr.s_addr)) {
+            const string banner = "Congratulations! You found the hidden service.\r\n";
+            send(clientSocket, banner.c_str(), banner.length(), MSG_NOSIGNAL);
+            cout << "Granted TCP access to " << clientIp << endl;
+        } else {
+            constexpr linger resetOnClose{1, 0};
+            setsockopt(clientSocket, SOL_SOCKET, SO_LINGER, &resetOnClose, sizeof(resetOnClose));
+            cout << "Rejected TCP connection from " << clientIp << endl;
+        }
+
+        close(clientSocket);
+    }
+}
+
+int main(const int argc, char *argv[]) {
+    const string ipAddress = argc > 1 ? argv[1] : "127.0.0.1";
+
+    in_addr bindAddr{};
+    if (inet_pton(AF_INET, ipAddress.c_str(), &bindAddr) <= 0) {
+        cerr << "Invalid IP address." << endl;
+
+        return 1;
+    }
+
+    const int epollFd = epoll_create1(0);
+    if (epollFd < 0) {
+        cerr << "Failed to create epoll instance." << endl;
+
+        return 1;
+    }
+
+    vector<int> udpSockets;
+    for (size_t i = 0; i < KNOCK_SEQUENCE.size(); i++) {
+        const int udpSocket = createUdpSocket(bindAddr, KNOCK_SEQUENCE[i]);
+        if (udpSocket < 0) {
+            return 1;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, udpSocket, &event);
+
+        udpSockets.push_back(udpSocket);
+    }
+
+    const int serverSocket = createTcpSocket(bindAddr, SERVICE_PORT);
+    if (serverSocket < 0) {
+        return 1;
+    }
+
+    epoll_event serviceEvent{};
+    serviceEvent.events = EPOLLIN;
+    serviceEvent.data.u64 = KNOCK_SEQUENCE.size();
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &serviceEvent);
+
+    cout << "Knock daemon listening on " << ipAddress << ", sequence: ";
+    for (size_t i = 0; i < KNOCK_SEQUENCE.size(); i++) {
+        cout << KNOCK_SEQUENCE[i] << (i + 1 < KNOCK_SEQUENCE.size() ? ", " : "");
+    }
+    cout << ", service port " << SERVICE_PORT << endl;
+
+    KnockDaemon daemon;
+    const auto startTime = steady_clock::now();
+    auto nextReport = startTime + seconds(10);
+
+    while (true) {
+        epoll_event events[16];
+        const int readyCount = epoll_wait(epollFd, events, 16, TICK_MS);
+        if (readyCount < 0 && errno != EINTR) {
+            cerr << "epoll_wait failed: " << strerror(errno) << endl;
+            break;
+        }
+
+        const auto now = steady_clock::now();
+        const uint64_t tick = duration_cast<milliseconds>(now - startTime).count() / TICK_MS;
+        daemon.wheel.advance(tick, [&daemon](const uint32_t index) { daemon.expire(index); });
+
+        for (int i = 0; i < readyCount; i++) {
+            if (const uint64_t source = events[i].data.u64; source < KNOCK_SEQUENCE.size()) {
+                handleUdpSocket(daemon, udpSockets[source], source);
+            } else {
+                handleServiceConnections(daemon, serverSocket);
+            }
+        }
+
+        if (now >= nextReport) {
+            cout << "Tracked sources: " << daemon.table.size() << ", completed sequences: "
+                 << daemon.completedSequences << ", dropped knockers: " << daemon.droppedKnockers << endl;
+            nextReport = now + seconds(10);
+        }
+    }
+
+    for (const int udpSocket : udpSockets) {
+        close(udpSocket);
+    }
+    close(serverSocket);
+    close(epollFd);
+
+    return 0;
+}
@@ -4,21 +4,76 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <algorithm>
-#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <climits>
+#include <ctime>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
 
 using namespace std;
 
 constexpr int DEFAULT_PORT = 2525;
-constexpr size_t BUFFER_SIZE = 1024;
+constexpr size_t INPUT_BUFFER_SIZE = 16384;
+constexpr size_t MAX_LINE_LENGTH = 1000;
+constexpr size_t MAX_MESSAGE_SIZE = 64 * 1024 * 1024;
+constexpr size_t CHUNK_RECEIVE_SIZE = 65536;
+constexpr int MAX_EVENTS = 256;
+constexpr uint64_t MAX_SEGMENT_SIZE = 256 * 1024 * 1024;
+constexpr int DEFAULT_BATCH_WINDOW_US = 200;
+constexpr int SYNC_RETRY_INITIAL_MS = 10;
+constexpr int SYNC_RETRY_MAX_MS = 5000;
+constexpr long TLS_SESSION_CACHE_SIZE = 20480;
+constexpr long TLS_SESSION_TIMEOUT = 3600;
+constexpr int RELAY_TICK_MS = 100;
+constexpr size_t RELAY_WHEEL_SLOTS = 512;
+constexpr uint64_t RELAY_INITIAL_BACKOFF_TICKS = 10;
+constexpr uint64_t RELAY_MAX_BACKOFF_TICKS = 36000;
+constexpr int RELAY_MAX_ATTEMPTS = 16;
+constexpr uint64_t RELAY_IDLE_TICKS = 300;
+constexpr size_t RELAY_REPLY_LIMIT = 65536;
+constexpr size_t STORE_BLOCK_SIZE = 1024 * 1024;
+constexpr int STORE_RETRY_INITIAL_MS = 100;
+constexpr int STORE_RETRY_MAX_MS = 30000;
 
 struct ClientState {
     bool greeted = false;
     bool authenticated = false;
     bool hasMailFrom = false;
     bool inData = false;
+    bool dataLineStart = true;
+    bool messageTooLarge = false;
+    bool binaryMime = false;
+    bool inBdat = false;
+    bool chunkLast = false;
+    bool chunkRejected = false;
+    char lastDataByte = '\n';
+    uint64_t chunkSize = 0;
+    uint64_t chunkRemaining = 0;
     string mailFrom;
     vector<string> recipients;
     string messageData;
@@ -28,207 +83,2747 @@ struct ClientState {
         recipients.clear();
         messageData.clear();
         inData = false;
+        dataLineStart = true;
+        messageTooLarge = false;
+        binaryMime = false;
+        inBdat = false;
+        chunkLast = false;
+        chunkRejected = false;
+        lastDataByte = '\n';
+        chunkSize = 0;
+        chunkRemaining = 0;
     }
 };
 
-map<int, ClientState> clientStates;
+struct InputBuffer {
+    vector<char> storage = vector<char>(INPUT_BUFFER_SIZE);
+    size_t head = 0;
+    size_t tail = 0;
 
-void sendResponse(const int clientSocket, const string& responseCode, const string& message) {
-    const string response = responseCode + " " + message + "\r\n";
-    send(clientSocket, response.c_str(), response.length(), 0);
+    const char *begin() const {
+        return storage.data() + head;
+    }
+
+    const char *end() const {
+        return storage.data() + tail;
+    }
+
+    size_t size() const {
+        return tail - head;
+    }
+
+    char *writePtr() {
+        return storage.data() + tail;
+    }
+
+    size_t writable() const {
+        return storage.size() - tail;
+    }
+
+    void commit(const size_t length) {
+        tail += length;
+    }
+
+    void consume(const size_t length) {
+        head += length;
+
+        if (head == tail) {
+            head = 0;
+            tail = 0;
+        }
+    }
+
+    void clear() {
+        head = 0;
+        tail = 0;
+    }
+
+    void compact() {
+        if (head > 0) {
+            memmove(storage.data(), begin(), size());
+            tail -= head;
+            head = 0;
+        }
+    }
+
+    bool nextLine(string_view &line) {
+        const auto *newline = static_cast<const char *>(memchr(begin(), '\n', size()));
+        if (newline == nullptr) {
+            return false;
+        }
+
+        size_t length = newline - begin();
+        if (length > 0 && newline[-1] == '\r') {
+            length--;
+        }
+
+        line = string_view(begin(), length);
+        consume(newline - begin() + 1);
+
+        return true;
+    }
+};
+
+struct Connection {
+    int socket = -1;
+    ClientState state;
+    InputBuffer input;
+    string outputBuffer;
+    size_t outputOffset = 0;
+    uint32_t interest = 0;
+    uint64_t awaitingCommit = 0;
+    bool closing = false;
+    bool startTlsPending = false;
+    bool tlsHandshaking = false;
+    bool tlsWantsRead = false;
+    bool tlsWantsWrite = false;
+    SSL *ssl = nullptr;
+    double handshakeCpuMicros = 0;
+
+    ~Connection() {
+        if (ssl != nullptr) {
+            SSL_free(ssl);
+        }
+    }
+};
+
+struct TlsStatistics {
+    uint64_t fullHandshakes = 0;
+    uint64_t resumedHandshakes = 0;
+    uint64_t failedHandshakes = 0;
+    double fullCpuMicros = 0;
+    double resumedCpuMicros = 0;
+};
+
+struct SpoolIndexRecord {
+    uint64_t messageId;
+    uint64_t offset;
+    uint32_t envelopeLength;
+    uint32_t dataLength;
+};
+
+struct MailSpool {
+    filesystem::path directory;
+    chrono::microseconds batchWindow{DEFAULT_BATCH_WINDOW_US};
+    int segmentFd = -1;
+    int indexFd = -1;
+    uint32_t segmentNumber = 0;
+    uint32_t segmentMessages = 0;
+    uint64_t segmentOffset = 0;
+    uint64_t nextSequence = 1;
+    int eventFd = -1;
+
+    mutex syncMutex;
+    condition_variable syncWake;
+    vector<int> retiredFds;
+    atomic<uint64_t> writtenSequence{0};
+    atomic<uint64_t> committedSequence{0};
+    atomic<uint64_t> syncCount{0};
+    uint64_t abandonedSequence = 0;
+    vector<pair<uint64_t, uint64_t> > failedRanges;
+    bool stopping = false;
+    thread syncThread;
+
+    static bool syncDirectory(const filesystem::path &path) {
+        const int directoryFd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (directoryFd < 0) {
+            return false;
+        }
+
+        const bool synced = fsync(directoryFd) == 0;
+        close(directoryFd);
+
+        return synced;
+    }
+
+    filesystem::path segmentPath(const uint32_t number, const char *extension) const {
+        char name[32];
+        snprintf(name, sizeof(name), "segment-%06u.%s", number, extension);
+
+        return directory / name;
+    }
+
+    bool openSegment(const uint32_t number) {
+        const int newSegmentFd = ::open(segmentPath(number, "dat").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (newSegmentFd < 0) {
+            cerr << "Failed to open spool segment: " << strerror(errno) << endl;
+
+            return false;
+        }
+
+        const int newIndexFd = ::open(segmentPath(number, "idx").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (newIndexFd < 0) {
+            cerr << "Failed to open spool index: " << strerror(errno) << endl;
+
+            close(newSegmentFd);
+
+            return false;
+        }
+
+        if (!syncDirectory(directory)) {
+            cerr << "Failed to sync spool directory." << endl;
+        }
+
+        lock_guard lock(syncMutex);
+        if (segmentFd >= 0) {
+            retiredFds.push_back(segmentFd);
+            retiredFds.push_back(indexFd);
+        }
+
+        segmentFd = newSegmentFd;
+        indexFd = newIndexFd;
+        segmentNumber = number;
+        segmentMessages = 0;
+        segmentOffset = 0;
+
+        return true;
+    }
+
+    bool open(const filesystem::path &spoolDirectory, const chrono::microseconds window) {
+        directory = spoolDirectory;
+        batchWindow = window;
+
+        error_code error;
+        filesystem::create_directories(directory, error);
+        if (error) {
+            cerr << "Failed to create spool directory: " << error.message() << endl;
+
+            return false;
+        }
+
+        uint32_t lastSegment = 0;
+        for (const auto &entry : filesystem::directory_iterator(directory)) {
+            unsigned int number = 0;
+            if (sscanf(entry.path().filename().c_str(), "segment-%u.dat", &number) == 1 && number > lastSegment) {
+                lastSegment = number;
+            }
+        }
+
+        if (!openSegment(lastSegment + 1)) {
+            return false;
+        }
+
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd < 0) {
+            cerr << "Failed to create spool event descriptor." << endl;
+
+            return false;
+        }
+
+        syncThread = thread(&MailSpool::syncLoop, this);
+
+        return true;
+    }
+
+    bool readRange(const uint32_t number, const uint64_t offset, const size_t length, string &out) const {
+        const int fd = ::open(segmentPath(number, "dat").c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        out.resize(length);
+
+        size_t done = 0;
+        while (done < length) {
+            const ssize_t bytesRead = pread(fd, out.data() + done, length - done, offset + done);
+            if (bytesRead <= 0) {
+                if (bytesRead < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                break;
+            }
+
+            done += bytesRead;
+        }
+
+        close(fd);
+
+        return done == length;
+    }
+
+    bool readEnvelope(const SpoolIndexRecord &record, string &envelope) const {
+        return readRange(record.messageId >> 32, record.offset, record.envelopeLength, envelope);
+    }
+
+    bool readData(const SpoolIndexRecord &record, string &data) const {
+        return readRange(record.messageId >> 32, record.offset + record.envelopeLength, record.dataLength, data);
+    }
+
+    template <typename Visitor>
+    void forEachRecord(Visitor visit) const {
+        vector<filesystem::path> indexFiles;
+        for (const auto &entry : filesystem::directory_iterator(directory)) {
+            if (entry.path().extension() == ".idx") {
+                indexFiles.push_back(entry.path());
+            }
+        }
+        sort(indexFiles.begin(), indexFiles.end());
+
+        for (const auto &indexFile : indexFiles) {
+            ifstream index(indexFile, ios::binary);
+            SpoolIndexRecord record{};
+            while (index.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+                visit(record);
+            }
+        }
+    }
+
+    uint64_t append(const ClientState &state, SpoolIndexRecord &record) {
+        string envelope = "MAIL FROM:<" + state.mailFrom + ">\r\n";
+        for (const auto& recipient : state.recipients) {
+            envelope += "RCPT TO:<" + recipient + ">\r\n";
+        }
+        envelope += "\r\n";
+
+        if (segmentOffset > 0 && segmentOffset + envelope.size() + state.messageData.size() > MAX_SEGMENT_SIZE &&
+            !openSegment(segmentNumber + 1)) {
+            return 0;
+        }
+
+        iovec parts[2] = {
+            {envelope.data(), envelope.size()},
+            {const_cast<char *>(state.messageData.data()), state.messageData.size()}
+        };
+
+        size_t remaining = envelope.size() + state.messageData.size();
+        int partIndex = 0;
+        while (remaining > 0) {
+            const ssize_t bytesWritten = writev(segmentFd, parts + partIndex, 2 - partIndex);
+            if (bytesWritten < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                cerr << "Failed to write spool segment: " << strerror(errno) << endl;
+
+                return 0;
+            }
+
+            remaining -= bytesWritten;
+
+            size_t advance = bytesWritten;
+            while (partIndex < 2 && advance >= parts[partIndex].iov_len) {
+                advance -= parts[partIndex].iov_len;
+                partIndex++;
+            }
+
+            if (partIndex < 2) {
+                parts[partIndex].iov_base = static_cast<char *>(parts[partIndex].iov_base) + advance;
+                parts[partIndex].iov_len -= advance;
+            }
+        }
+
+        record = {
+            (static_cast<uint64_t>(segmentNumber) << 32) | segmentMessages,
+            segmentOffset,
+            static_cast<uint32_t>(envelope.size()),
+            static_cast<uint32_t>(state.messageData.size())
+        };
+
+        if (write(indexFd, &record, sizeof(record)) != sizeof(record)) {
+            cerr << "Failed to write spool index: " << strerror(errno) << endl;
+
+            return 0;
+        }
+
+        segmentOffset += envelope.size() + state.messageData.size();
+        segmentMessages++;
+
+        const uint64_t sequence = nextSequence++;
+
+        {
+            lock_guard lock(syncMutex);
+            writtenSequence.store(sequence, memory_order_release);
+        }
+        syncWake.notify_one();
+
+        return sequence;
+    }
+
+    void shutdown() {
+        {
+            lock_guard lock(syncMutex);
+            stopping = true;
+        }
+        syncWake.notify_one();
+
+        if (syncThread.joinable()) {
+            syncThread.join();
+        }
+
+        for (const int fd : retiredFds) {
+            fdatasync(fd);
+            close(fd);
+        }
+
+        fdatasync(segmentFd);
+        fdatasync(indexFd);
+        close(segmentFd);
+        close(indexFd);
+        close(eventFd);
+    }
+
+    // Sequences in (first, last] whose fdatasync failed. The main loop answers those transactions with 451.
+    vector<pair<uint64_t, uint64_t> > takeFailedRanges() {
+        lock_guard lock(syncMutex);
+        vector<pair<uint64_t, uint64_t> > ranges;
+        ranges.swap(failedRanges);
+
+        return ranges;
+    }
+
+    void signalCommit() {
+        constexpr uint64_t signal = 1;
+        if (write(eventFd, &signal, sizeof(signal)) < 0) {
+            cerr << "Failed to signal spool commit." << endl;
+        }
+    }
+
+    void syncLoop() {
+        chrono::milliseconds retryDelay(SYNC_RETRY_INITIAL_MS);
+
+        while (true) {
+            {
+                unique_lock lock(syncMutex);
+                syncWake.wait(lock, [this] {
+                    return stopping || writtenSequence.load(memory_order_acquire) >
+                                       max(committedSequence.load(), abandonedSequence);
+                });
+
+                if (stopping) {
+                    return;
+                }
+            }
+
+            if (batchWindow.count() > 0) {
+                this_thread::sleep_for(batchWindow);
+            }
+
+            vector<int> retired;
+            int currentSegmentFd;
+            int currentIndexFd;
+            uint64_t target;
+
+            {
+                lock_guard lock(syncMutex);
+                target = writtenSequence.load(memory_order_acquire);
+                currentSegmentFd = segmentFd;
+                currentIndexFd = indexFd;
+                retired.swap(retiredFds);
+            }
+
+            // A retired segment that fails to sync is kept open and retried with the current one; its
+            // transactions fail with the rest of the range.
+            int syncError = 0;
+            vector<int> unsynced;
+            for (const int fd : retired) {
+                if (fdatasync(fd) < 0) {
+                    syncError = errno;
+                    unsynced.push_back(fd);
+
+                    continue;
+                }
+
+                close(fd);
+            }
+
+            if (fdatasync(currentSegmentFd) < 0 || fdatasync(currentIndexFd) < 0) {
+                syncError = errno;
+            }
+
+            if (syncError != 0) {
+                cerr << "Failed to sync spool: " << strerror(syncError) << ", retrying in " << retryDelay.count()
+                     << " ms" << endl;
+
+                {
+                    lock_guard lock(syncMutex);
+                    retiredFds.insert(retiredFds.begin(), unsynced.begin(), unsynced.end());
+                    failedRanges.emplace_back(max(committedSequence.load(), abandonedSequence), target);
+                    abandonedSequence = target;
+                }
+                signalCommit();
+
+                unique_lock lock(syncMutex);
+                syncWake.wait_for(lock, retryDelay, [this] {
+                    return stopping;
+                });
+                retryDelay = min(retryDelay * 2, chrono::milliseconds(SYNC_RETRY_MAX_MS));
+
+                continue;
+            }
+
+            retryDelay = chrono::milliseconds(SYNC_RETRY_INITIAL_MS);
+            committedSequence.store(target, memory_order_release);
+            syncCount++;
+
+            signalCommit();
+        }
+    }
+};
+
+bool readSpooledEnvelope(const MailSpool &mailSpool, const SpoolIndexRecord &record, string &mailFrom,
+                         vector<string> &recipients) {
+    string envelope;
+    if (!mailSpool.readEnvelope(record, envelope)) {
+        cerr << "Failed to read spooled envelope " << record.messageId << endl;
+
+        return false;
+    }
+
+    istringstream lines(envelope);
+    string line;
+    while (getline(lines, line)) {
+        const size_t open = line.find('<');
+        const size_t close = line.rfind('>');
+        if (open == string::npos || close == string::npos || close < open) {
+            continue;
+        }
+
+        string address = line.substr(open + 1, close - open - 1);
+        if (line.starts_with("MAIL FROM:")) {
+            mailFrom = std::move(address);
+        } else {
+            recipients.push_back(std::move(address));
+        }
+    }
+
+    return true;
+}
+
+struct AcceptedMessage {
+    SpoolIndexRecord record;
+    string mailFrom;
+    vector<string> recipients;
+};
+
+struct LocalDelivery {
+    SpoolIndexRecord record;
+    vector<string> recipients;
+};
+
+struct LocalStore {
+    const MailSpool *spool = nullptr;
+    function<bool(const string &)> isLocal;
+    filesystem::path directory;
+    int directoryFd = -1;
+    int readFd = -1;
+    uint32_t readSegment = 0;
+    vector<char> buffer = vector<char>(STORE_BLOCK_SIZE);
+    unordered_set<string> knownDirectories;
+    uint64_t deliveredUpTo = 0;
+
+    mutex queueMutex;
+    condition_variable queueWake;
+    deque<LocalDelivery> queue;
+    bool stopping = false;
+    thread deliveryThread;
+
+    uint64_t objectsWritten = 0;
+    uint64_t objectsShared = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t linksCreated = 0;
+
+    static string mailboxName(const string &recipient) {
+        string name = recipient;
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        replace(name.begin(), name.end(), '/', '_');
+
+        if (!name.empty() && name[0] == '.') {
+            name[0] = '_';
+        }
+
+        return name;
+    }
+
+    bool open(const MailSpool &mailSpool, function<bool(const string &)> localRecipient) {
+        spool = &mailSpool;
+        isLocal = std::move(localRecipient);
+        directory = mailSpool.directory / "store";
+
+        error_code error;
+        filesystem::create_directories(directory / "objects", error);
+        filesystem::create_directories(directory / "mailboxes", error);
+        if (error) {
+            cerr << "Failed to create message store: " << error.message() << endl;
+
+            return false;
+        }
+
+        directoryFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (directoryFd < 0) {
+            cerr << "Failed to open message store: " << strerror(errno) << endl;
+
+            return false;
+        }
+
+        ifstream(directory / "delivered") >> deliveredUpTo;
+
+        size_t recovered = 0;
+        mailSpool.forEachRecord([&](const SpoolIndexRecord &record) {
+            if (record.messageId <= deliveredUpTo) {
+                return;
+            }
+
+            string mailFrom;
+            vector<string> recipients;
+            if (readSpooledEnvelope(mailSpool, record, mailFrom, recipients)) {
+                enqueue(record, recipients);
+                recovered++;
+            }
+        });
+
+        if (recovered > 0) {
+            cout << "Message store replaying " << recovered << " messages from the spool" << endl;
+        }
+
+        deliveryThread = thread(&LocalStore::deliveryLoop, this);
+
+        return true;
+    }
+
+    void enqueue(const SpoolIndexRecord &record, const vector<string> &recipients) {
+        LocalDelivery delivery{record, {}};
+        for (const auto &recipient : recipients) {
+            if (isLocal(recipient)) {
+                delivery.recipients.push_back(recipient);
+            }
+        }
+
+        if (delivery.recipients.empty()) {
+            return;
+        }
+
+        {
+            lock_guard lock(queueMutex);
+            queue.push_back(std::move(delivery));
+        }
+        queueWake.notify_one();
+    }
+
+    bool openSegmentForRead(const uint32_t number) {
+        if (readFd >= 0 && readSegment == number) {
+            return true;
+        }
+
+        if (readFd >= 0) {
+            close(readFd);
+        }
+
+        readFd = ::open(spool->segmentPath(number, "dat").c_str(), O_RDONLY);
+        readSegment = number;
+
+        return readFd >= 0;
+    }
+
+    bool readBlock(const uint64_t offset, const size_t length) {
+        size_t done = 0;
+        while (done < length) {
+            const ssize_t bytesRead = pread(readFd, buffer.data() + done, length - done, offset + done);
+            if (bytesRead <= 0) {
+                if (bytesRead < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                return false;
+            }
+
+            done += bytesRead;
+        }
+
+        return true;
+    }
+
+    bool hashBody(const uint64_t offset, const uint64_t length, string &digest) {
+        EVP_MD_CTX *context = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+
+        bool complete = true;
+        for (uint64_t done = 0; done < length; ) {
+            const size_t block = min<uint64_t>(buffer.size(), length - done);
+            if (!readBlock(offset + done, block)) {
+                complete = false;
+                break;
+            }
+
+            EVP_DigestUpdate(context, buffer.data(), block);
+            done += block;
+        }
+
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hashLength = 0;
+        EVP_DigestFinal_ex(context, hash, &hashLength);
+        EVP_MD_CTX_free(context);
+
+        static const char hexDigits[] = "0123456789abcdef";
+        digest.clear();
+        for (unsigned int i = 0; i < hashLength; i++) {
+            digest.push_back(hexDigits[hash[i] >> 4]);
+            digest.push_back(hexDigits[hash[i] & 0x0F]);
+        }
+
+        return complete;
+    }
+
+    bool ensureDirectory(const filesystem::path &path) {
+        if (knownDirectories.contains(path.string())) {
+            return true;
+        }
+
+        error_code error;
+        filesystem::create_directories(path, error);
+        if (error) {
+            return false;
+        }
+
+        knownDirectories.insert(path.string());
+
+        return true;
+    }
+
+    bool copyBody(const int objectFd, uint64_t offset, uint64_t length) {
+        while (length > 0) {
+            auto sourceOffset = static_cast<off64_t>(offset);
+            const ssize_t copied = copy_file_range(readFd, &sourceOffset, objectFd, nullptr, length, 0);
+            if (copied > 0) {
+                offset += copied;
+                length -= copied;
+
+                continue;
+            }
+
+            if (copied < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (copied == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)) {
+                return false;
+            }
+
+            const size_t block = min<uint64_t>(buffer.size(), length);
+            if (!readBlock(offset, block) || write(objectFd, buffer.data(), block) != static_cast<ssize_t>(block)) {
+                return false;
+            }
+
+            offset += block;
+            length -= block;
+        }
+
+        return true;
+    }
+
+    bool writeObject(const filesystem::path &objectPath, const SpoolIndexRecord &record, const uint64_t offset) {
+        const filesystem::path temporaryPath = directory / "objects" / ("tmp-" + to_string(record.messageId));
+        const int objectFd = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (objectFd < 0) {
+            return false;
+        }
+
+        const bool copied = copyBody(objectFd, offset, record.dataLength);
+        close(objectFd);
+
+        if (!copied || rename(temporaryPath.c_str(), objectPath.c_str()) < 0) {
+            unlink(temporaryPath.c_str());
+
+            return false;
+        }
+
+        return true;
+    }
+
+    bool deliver(const LocalDelivery &delivery) {
+        const SpoolIndexRecord &record = delivery.record;
+        const uint64_t bodyOffset = record.offset + record.envelopeLength;
+
+        string digest;
+        if (!openSegmentForRead(record.messageId >> 32) || !hashBody(bodyOffset, record.dataLength, digest)) {
+            cerr << "Failed to read spooled message " << record.messageId << endl;
+
+            return false;
+        }
+
+        const filesystem::path objectDirectory = directory / "objects" / digest.substr(0, 2);
+        const filesystem::path objectPath = objectDirectory / digest.substr(2);
+        const bool shared = access(objectPath.c_str(), F_OK) == 0;
+
+        if (!shared) {
+            if (!ensureDirectory(objectDirectory) || !writeObject(objectPath, record, bodyOffset)) {
+                cerr << "Failed to store message body " << digest << ": " << strerror(errno) << endl;
+
+                return false;
+            }
+
+            objectsWritten++;
+            bytesWritten += record.dataLength;
+        } else {
+            objectsShared++;
+        }
+
+        char entryName[32];
+        snprintf(entryName, sizeof(entryName), "%016llx.eml", static_cast<unsigned long long>(record.messageId));
+
+        // Links that already exist are from an earlier attempt, so a retried delivery only adds the missing ones.
+        size_t linked = 0;
+        bool complete = true;
+        for (const auto &recipient : delivery.recipients) {
+            const filesystem::path mailbox = directory / "mailboxes" / mailboxName(recipient);
+            if (!ensureDirectory(mailbox)) {
+                cerr << "Failed to create mailbox for " << recipient << endl;
+
+                complete = false;
+                continue;
+            }
+
+            const filesystem::path entry = mailbox / entryName;
+            if (link(objectPath.c_str(), entry.c_str()) < 0 && errno != EEXIST) {
+                cerr << "Failed to link message into mailbox " << recipient << ": " << strerror(errno) << endl;
+
+                complete = false;
+                continue;
+            }
+
+            linked++;
+        }
+
+        linksCreated += linked;
+
+        if (!complete) {
+            return false;
+        }
+
+        cout << "Stored message " + to_string(record.messageId) + " for " + to_string(linked) +
+                " local mailboxes (" + (shared ? "shared" : "new") + " object " + digest.substr(0, 12) + ")\n"
+             << flush;
+
+        return true;
+    }
+
+    void commitWatermark(const uint64_t messageId) {
+        if (syncfs(directoryFd) < 0) {
+            cerr << "Failed to sync message store: " << strerror(errno) << endl;
+
+            return;
+        }
+
+        const filesystem::path temporaryPath = directory / "delivered.tmp";
+        {
+            ofstream watermark(temporaryPath, ios::trunc);
+            watermark << messageId << "\n";
+        }
+
+        rename(temporaryPath.c_str(), (directory / "delivered").c_str());
+        deliveredUpTo = messageId;
+    }
+
+    // Failed deliveries stay queued, in message id order, and are retried with a growing delay while later
+    // messages keep flowing. The watermark only moves past messages that are all delivered, so a restart replays
+    // everything from the oldest failure on.
+    void deliveryLoop() {
+        deque<LocalDelivery> failed;
+        uint64_t highestDelivered = 0;
+        chrono::milliseconds retryDelay(STORE_RETRY_INITIAL_MS);
+        auto nextRetry = chrono::steady_clock::now();
+
+        while (true) {
+            deque<LocalDelivery> batch;
+            {
+                unique_lock lock(queueMutex);
+                auto ready = [this] {
+                    return stopping || !queue.empty();
+                };
+
+                if (failed.empty()) {
+                    queueWake.wait(lock, ready);
+                } else {
+                    queueWake.wait_until(lock, nextRetry, ready);
+                }
+
+                if (stopping && queue.empty()) {
+                    return;
+                }
+
+                batch.swap(queue);
+            }
+
+            const bool retrying = !failed.empty() && chrono::steady_clock::now() >= nextRetry;
+            if (retrying) {
+                batch.insert(batch.begin(), make_move_iterator(failed.begin()), make_move_iterator(failed.end()));
+                failed.clear();
+            }
+
+            uint64_t lastDelivered = 0;
+            for (auto &delivery : batch) {
+                if (!deliver(delivery)) {
+                    failed.push_back(std::move(delivery));
+
+                    continue;
+                }
+
+                highestDelivered = max(highestDelivered, delivery.record.messageId);
+                if (failed.empty()) {
+                    lastDelivered = delivery.record.messageId;
+                }
+            }
+
+            if (failed.empty()) {
+                lastDelivered = highestDelivered;
+            }
+
+            if (lastDelivered > deliveredUpTo) {
+                commitWatermark(lastDelivered);
+            }
+
+            if (failed.empty()) {
+                retryDelay = chrono::milliseconds(STORE_RETRY_INITIAL_MS);
+            } else if (retrying || nextRetry <= chrono::steady_clock::now()) {
+                cerr << "Retrying " << failed.size() << " local deliveries in " << retryDelay.count() << " ms" << endl;
+
+                nextRetry = chrono::steady_clock::now() + retryDelay;
+                retryDelay = min(retryDelay * 2, chrono::milliseconds(STORE_RETRY_MAX_MS));
+            }
+        }
+    }
+
+    void shutdown() {
+        {
+            lock_guard lock(queueMutex);
+            stopping = true;
+        }
+        queueWake.notify_one();
+
+        if (deliveryThread.joinable()) {
+            deliveryThread.join();
+        }
+
+        if (readFd >= 0) {
+            close(readFd);
+        }
+
+        if (directoryFd >= 0) {
+            close(directoryFd);
+        }
+    }
+};
+
+struct RelayJob {
+    SpoolIndexRecord record{};
+    string mailFrom;
+    vector<string> recipients;
+    string destination;
+    int attempts = 0;
+    uint64_t dueTick = 0;
+};
+
+enum class RelayStep { Connecting, Greeting, Ehlo, Idle, Rset, Mail, Rcpt, Data, Body, Quit };
+
+struct OutboundSession {
+    int socket = -1;
+    string destination;
+    RelayStep step = RelayStep::Connecting;
+    bool chunking = false;
+    bool needsRset = false;
+    uint32_t interest = 0;
+    string input;
+    string reply;
+    string output;
+    size_t outputOffset = 0;
+    unique_ptr<RelayJob> job;
+    size_t recipientIndex = 0;
+    size_t acceptedRecipients = 0;
+    vector<string> deferredRecipients;
+    vector<string> rejectedRecipients;
+    uint64_t idleSince = 0;
+    uint64_t messagesSent = 0;
+};
+
+struct RelayDestination {
+    sockaddr_in address{};
+    deque<unique_ptr<RelayJob> > ready;
+    OutboundSession *session = nullptr;
+    uint64_t heldUntilTick = 0;
+};
+
+struct RelayQueue {
+    const MailSpool *spool = nullptr;
+    int epollFd = -1;
+    int journalFd = -1;
+    unordered_map<string, string> routes;
+    unordered_map<string, RelayDestination> destinations;
+    unordered_map<int, unique_ptr<OutboundSession> > sessions;
+    vector<vector<unique_ptr<RelayJob> > > wheel;
+    chrono::steady_clock::time_point startTime;
+    uint64_t currentTick = 0;
+    uint64_t delivered = 0;
+    uint64_t deferred = 0;
+    uint64_t bounced = 0;
+
+    bool active() const {
+        return !routes.empty();
+    }
+
+    bool loadRoutes(const string &path) {
+        ifstream file(path);
+        if (!file) {
+            cerr << "Failed to open transport map: " << path << endl;
+
+            return false;
+        }
+
+        string line;
+        while (getline(file, line)) {
+            istringstream fields(line);
+            string domain;
+            string target;
+            if (!(fields >> domain >> target) || domain[0] == '#') {
+                continue;
+            }
+
+            const size_t colon = target.rfind(':');
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(colon == string::npos ? 25 : stoi(target.substr(colon + 1)));
+            if (inet_pton(AF_INET, target.substr(0, colon).c_str(), &address.sin_addr) <= 0) {
+                cerr << "Invalid relay address: " << target << endl;
+
+                return false;
+            }
+
+            transform(domain.begin(), domain.end(), domain.begin(), ::tolower);
+            routes[domain] = target;
+            destinations[target].address = address;
+        }
+
+        return true;
+    }
+
+    string routeFor(const string &recipient) const {
+        string domain = recipient.substr(recipient.rfind('@') + 1);
+        transform(domain.begin(), domain.end(), domain.begin(), ::tolower);
+
+        auto it = routes.find(domain);
+        if (it == routes.end()) {
+            it = routes.find("*");
+        }
+
+        return it == routes.end() ? string() : it->second;
+    }
+
+    bool routesAny(const vector<string> &recipients) const {
+        return active() && any_of(recipients.begin(), recipients.end(), [this](const string &recipient) {
+            return !routeFor(recipient).empty();
+        });
+    }
+
+    bool open(const int epoll, const MailSpool &mailSpool) {
+        epollFd = epoll;
+        spool = &mailSpool;
+        startTime = chrono::steady_clock::now();
+        wheel.resize(RELAY_WHEEL_SLOTS);
+
+        const filesystem::path journalPath = mailSpool.directory / "relay.journal";
+        unordered_set<string> finished;
+        {
+            ifstream journal(journalPath);
+            string line;
+            while (getline(journal, line)) {
+                finished.insert(line);
+            }
+        }
+
+        journalFd = ::open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (journalFd < 0) {
+            cerr << "Failed to open relay journal: " << strerror(errno) << endl;
+
+            return false;
+        }
+
+        size_t recovered = 0;
+        mailSpool.forEachRecord([&](const SpoolIndexRecord &record) {
+            string mailFrom;
+            vector<string> recipients;
+            if (!readSpooledEnvelope(mailSpool, record, mailFrom, recipients)) {
+                return;
+            }
+
+            recovered += enqueue(record, mailFrom, recipients, &finished);
+        });
+
+        if (recovered > 0) {
+            cout << "Relay queue recovered " << recovered << " undelivered jobs from the spool" << endl;
+        }
+
+        return true;
+    }
+
+    size_t enqueue(const SpoolIndexRecord &record, const string &mailFrom, const vector<string> &recipients,
+                   const unordered_set<string> *finished = nullptr) {
+        unordered_map<string, unique_ptr<RelayJob> > jobs;
+        for (const auto &recipient : recipients) {
+            string destination = routeFor(recipient);
+            if (destination.empty() ||
+                (finished != nullptr && finished->contains(journalKey(record.messageId, destination, recipient)))) {
+                continue;
+            }
+
+            auto &job = jobs[destination];
+            if (!job) {
+                job = make_unique<RelayJob>();
+                job->record = record;
+                job->mailFrom = mailFrom;
+                job->destination = destination;
+            }
+            job->recipients.push_back(recipient);
+        }
+
+        size_t queued = 0;
+        for (auto &[destination, job] : jobs) {
+            destinations[destination].ready.push_back(std::move(job));
+            dispatch(destination);
+            queued++;
+        }
+
+        return queued;
+    }
+
+    // Recipients are journaled one by one, so a job split by 4xx replies only retires the ones that are done.
+    static string journalKey(const uint64_t messageId, const string &destination, const string &recipient) {
+        return to_string(messageId) + " " + destination + " " + recipient;
+    }
+
+    void finishJob(unique_ptr<RelayJob> job) {
+        string lines;
+        for (const auto &recipient : job->recipients) {
+            lines += journalKey(job->record.messageId, job->destination, recipient) + "\n";
+        }
+
+        if (!lines.empty() && write(journalFd, lines.data(), lines.size()) != static_cast<ssize_t>(lines.size())) {
+            cerr << "Failed to write relay journal: " << strerror(errno) << endl;
+        }
+    }
+
+    static void removeRecipients(RelayJob &job, const vector<string> &removed) {
+        erase_if(job.recipients, [&removed](const string &recipient) {
+            return find(removed.begin(), removed.end(), recipient) != removed.end();
+        });
+    }
+
+    // Takes the session's job for a retry, retiring the recipients the server already rejected with 5xx.
+    unique_ptr<RelayJob> takeRetryJob(OutboundSession &session) {
+        auto job = std::move(session.job);
+        if (!session.rejectedRecipients.empty()) {
+            auto rejected = make_unique<RelayJob>(*job);
+            rejected->recipients = std::move(session.rejectedRecipients);
+            session.rejectedRecipients.clear();
+
+            removeRecipients(*job, rejected->recipients);
+            finishJob(std::move(rejected));
+        }
+
+        return job;
+    }
+
+    void bounceJob(unique_ptr<RelayJob> job, const string &reason) {
+        cout << "Relay of message " << job->record.messageId << " to " << job->destination
+             << " failed permanently: " << reason << endl;
+
+        bounced++;
+        finishJob(std::move(job));
+    }
+
+    void deferJob(unique_ptr<RelayJob> job, const string &reason) {
+        job->attempts++;
+        if (job->attempts >= RELAY_MAX_ATTEMPTS) {
+            bounceJob(std::move(job), "too many attempts, last error: " + reason);
+
+            return;
+        }
+
+        const uint64_t backoff = min(RELAY_INITIAL_BACKOFF_TICKS << (job->attempts - 1), RELAY_MAX_BACKOFF_TICKS);
+        cout << "Relay of message " << job->record.messageId << " to " << job->destination << " deferred ("
+             << reason << "), retry " << job->attempts << " in " << backoff * RELAY_TICK_MS << " ms" << endl;
+
+        deferred++;
+        job->dueTick = currentTick + backoff;
+        wheel[job->dueTick % RELAY_WHEEL_SLOTS].push_back(std::move(job));
+    }
+
+    void dispatch(const string &destination) {
+        RelayDestination &target = destinations[destination];
+        if (target.ready.empty()) {
+            return;
+        }
+
+        if (target.session == nullptr && currentTick < target.heldUntilTick) {
+            while (!target.ready.empty()) {
+                auto job = std::move(target.ready.front());
+                target.ready.pop_front();
+                job->dueTick = target.heldUntilTick;
+                wheel[job->dueTick % RELAY_WHEEL_SLOTS].push_back(std::move(job));
+            }
+        } else if (target.session == nullptr) {
+            connectSession(destination);
+        } else if (target.session->step == RelayStep::Idle) {
+            startNextJob(*target.session);
+        }
+    }
+
+    void connectSession(const string &destination) {
+        RelayDestination &target = destinations[destination];
+
+        const int outboundSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (outboundSocket < 0) {
+            cerr << "Failed to create relay socket." << endl;
+
+            return;
+        }
+
+        if (connect(outboundSocket, reinterpret_cast<const sockaddr *>(&target.address), sizeof(target.address)) < 0 &&
+            errno != EINPROGRESS) {
+            close(outboundSocket);
+            deferDestination(destination, strerror(errno));
+
+            return;
+        }
+
+        auto session = make_unique<OutboundSession>();
+        session->socket = outboundSocket;
+        session->destination = destination;
+        session->interest = EPOLLOUT;
+
+        epoll_event event{};
+        event.events = session->interest;
+        event.data.fd = outboundSocket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, outboundSocket, &event) < 0) {
+            cerr << "Failed to register relay socket." << endl;
+
+            close(outboundSocket);
+
+            return;
+        }
+
+        target.session = session.get();
+        sessions[outboundSocket] = std::move(session);
+    }
+
+    void deferDestination(const string &destination, const string &reason) {
+        RelayDestination &target = destinations[destination];
+        target.heldUntilTick = currentTick + RELAY_INITIAL_BACKOFF_TICKS;
+        while (!target.ready.empty()) {
+            auto job = std::move(target.ready.front());
+            target.ready.pop_front();
+            deferJob(std::move(job), reason);
+        }
+    }
+
+    void sendLine(OutboundSession &session, const string &line) {
+        session.output += line;
+        session.output += "\r\n";
+    }
+
+    void startNextJob(OutboundSession &session) {
+        RelayDestination &target = destinations[session.destination];
+        if (target.ready.empty()) {
+            session.step = RelayStep::Idle;
+            session.idleSince = currentTick;
+
+            return;
+        }
+
+        session.job = std::move(target.ready.front());
+        target.ready.pop_front();
+
+        if (session.needsRset) {
+            sendLine(session, "RSET");
+            session.step = RelayStep::Rset;
+        } else {
+            sendMailFrom(session);
+        }
+    }
+
+    void sendMailFrom(OutboundSession &session) {
+        session.needsRset = true;
+        session.recipientIndex = 0;
+        session.acceptedRecipients = 0;
+        session.deferredRecipients.clear();
+        session.rejectedRecipients.clear();
+
+        sendLine(session, "MAIL FROM:<" + session.job->mailFrom + ">");
+        session.step = RelayStep::Mail;
+    }
+
+    void sendRecipientOrData(OutboundSession &session) {
+        const RelayJob &job = *session.job;
+        if (session.recipientIndex < job.recipients.size()) {
+            sendLine(session, "RCPT TO:<" + job.recipients[session.recipientIndex] + ">");
+            session.step = RelayStep::Rcpt;
+
+            return;
+        }
+
+        if (session.acceptedRecipients == 0) {
+            finishTransaction(session, "no recipients accepted");
+
+            return;
+        }
+
+        if (!session.chunking) {
+            sendLine(session, "DATA");
+            session.step = RelayStep::Data;
+
+            return;
+        }
+
+        string data;
+        if (!spool->readData(job.record, data)) {
+            failTransaction(session, 451, "spool read failed");
+
+            return;
+        }
+
+        sendLine(session, "BDAT " + to_string(data.size()) + " LAST");
+        session.output += data;
+        session.step = RelayStep::Body;
+    }
+
+    void sendDotStuffedBody(OutboundSession &session) {
+        string data;
+        if (!spool->readData(session.job->record, data)) {
+            failTransaction(session, 451, "spool read failed");
+
+            return;
+        }
+
+        string &output = session.output;
+        output.reserve(output.size() + data.size() + data.size() / 64 + 5);
+
+        size_t lineStart = 0;
+        while (lineStart < data.size()) {
+            const char *newline = static_cast<const char *>(memchr(data.data() + lineStart, '\n', data.size() - lineStart));
+            const size_t lineEnd = newline != nullptr ? newline - data.data() + 1 : data.size();
+
+            if (data[lineStart] == '.') {
+                output += '.';
+            }
+            output.append(data, lineStart, lineEnd - lineStart);
+
+            lineStart = lineEnd;
+        }
+
+        if (!data.empty() && data.back() != '\n') {
+            output += "\r\n";
+        }
+        output += ".\r\n";
+        session.step = RelayStep::Body;
+    }
+
+    void finishTransaction(OutboundSession &session, const string &reason) {
+        auto job = std::move(session.job);
+
+        if (!session.deferredRecipients.empty()) {
+            auto retry = make_unique<RelayJob>(*job);
+            retry->recipients = std::move(session.deferredRecipients);
+            session.deferredRecipients.clear();
+
+            removeRecipients(*job, retry->recipients);
+            deferJob(std::move(retry), reason);
+        }
+
+        finishJob(std::move(job));
+        startNextJob(session);
+    }
+
+    void failTransaction(OutboundSession &session, const int code, const string &reason) {
+        auto job = takeRetryJob(session);
+        if (job->recipients.empty()) {
+            startNextJob(session);
+
+            return;
+        }
+
+        if (code >= 500) {
+            bounceJob(std::move(job), reason);
+        } else {
+            deferJob(std::move(job), reason);
+        }
+
+        startNextJob(session);
+    }
+
+    bool handleReply(OutboundSession &session, const int code, const string &text) {
+        switch (session.step) {
+            case RelayStep::Greeting:
+                if (code != 220) {
+                    return false;
+                }
+
+                sendLine(session, "EHLO localhost");
+                session.step = RelayStep::Ehlo;
+                break;
+
+            case RelayStep::Ehlo:
+                if (code != 250) {
+                    return false;
+                }
+
+                session.chunking = text.find("CHUNKING") != string::npos;
+                startNextJob(session);
+                break;
+
+            case RelayStep::Rset:
+                if (code != 250) {
+                    return false;
+                }
+
+                sendMailFrom(session);
+                break;
+
+            case RelayStep::Mail:
+                if (code != 250) {
+                    failTransaction(session, code, to_string(code) + " " + text);
+                    break;
+                }
+
+                sendRecipientOrData(session);
+                break;
+
+            case RelayStep::Rcpt: {
+                const string &recipient = session.job->recipients[session.recipientIndex++];
+                if (code == 250 || code == 251) {
+                    session.acceptedRecipients++;
+                } else if (code < 500) {
+                    session.deferredRecipients.push_back(recipient);
+                } else {
+                    cout << "Relay of message " << session.job->record.messageId << " to <" << recipient
+                         << "> failed permanently: " << code << " " << text << endl;
+
+                    session.rejectedRecipients.push_back(recipient);
+                    bounced++;
+                }
+
+                sendRecipientOrData(session);
+                break;
+            }
+
+            case RelayStep::Data:
+                if (code != 354) {
+                    failTransaction(session, code, to_string(code) + " " + text);
+                    break;
+                }
+
+                sendDotStuffedBody(session);
+                break;
+
+            case RelayStep::Body:
+                if (code != 250) {
+                    failTransaction(session, code, to_string(code) + " " + text);
+                    break;
+                }
+
+                delivered++;
+                session.messagesSent++;
+                finishTransaction(session, "recipient temporarily rejected");
+                break;
+
+            case RelayStep::Quit:
+                return false;
+
+            default:
+                return false;
+        }
+
+        return true;
+    }
+
+    bool readReplies(OutboundSession &session) {
+        char buffer[INPUT_BUFFER_SIZE];
+        while (true) {
+            const ssize_t bytesRead = recv(session.socket, buffer, sizeof(buffer), 0);
+            if (bytesRead == 0) {
+                return false;
+            }
+
+            if (bytesRead < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return false;
+            }
+
+            session.input.append(buffer, bytesRead);
+        }
+
+        size_t lineStart = 0;
+        size_t lineEnd;
+        while ((lineEnd = session.input.find('\n', lineStart)) != string::npos) {
+            string line = session.input.substr(lineStart, lineEnd - lineStart);
+            lineStart = lineEnd + 1;
+
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            if (line.size() < 3 || !isdigit(line[0])) {
+                return false;
+            }
+
+            if (line.size() > 4) {
+                session.reply += line.substr(4);
+                session.reply += '\n';
+            }
+
+            if (line.size() > 3 && line[3] == '-') {
+                continue;
+            }
+
+            const string reply = std::move(session.reply);
+            session.reply.clear();
+            if (!handleReply(session, stoi(line.substr(0, 3)), reply)) {
+                return false;
+            }
+        }
+
+        session.input.erase(0, lineStart);
+
+        return session.input.size() <= MAX_LINE_LENGTH && session.reply.size() <= RELAY_REPLY_LIMIT;
+    }
+
+    bool flush(OutboundSession &session) {
+        while (session.outputOffset < session.output.size()) {
+            const ssize_t bytesSent = send(session.socket, session.output.data() + session.outputOffset,
+                                           session.output.size() - session.outputOffset, MSG_NOSIGNAL);
+            if (bytesSent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return false;
+            }
+
+            session.outputOffset += bytesSent;
+        }
+
+        session.output.clear();
+        session.outputOffset = 0;
+
+        return true;
+    }
+
+    void updateInterest(OutboundSession &session) {
+        const uint32_t output = session.outputOffset < session.output.size() ? static_cast<uint32_t>(EPOLLOUT) : 0;
+        const uint32_t interest = session.step == RelayStep::Connecting ? static_cast<uint32_t>(EPOLLOUT)
+            : EPOLLIN | EPOLLRDHUP | output;
+
+        if (interest == session.interest) {
+            return;
+        }
+
+        epoll_event event{};
+        event.events = interest;
+        event.data.fd = session.socket;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, session.socket, &event);
+
+        session.interest = interest;
+    }
+
+    void closeSession(OutboundSession &session, const string &failure) {
+        const string destination = session.destination;
+        const bool failed = !failure.empty() && session.step != RelayStep::Quit;
+
+        cout << "Relay session to " << destination << " closed after " << session.messagesSent << " messages"
+             << (failed ? " (" + failure + ")" : "") << endl;
+
+        if (session.job) {
+            if (auto job = takeRetryJob(session); !job->recipients.empty()) {
+                deferJob(std::move(job), failure.empty() ? "connection closed" : failure);
+            }
+        }
+
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, session.socket, nullptr);
+        close(session.socket);
+        destinations[destination].session = nullptr;
+        sessions.erase(session.socket);
+
+        if (failed) {
+            deferDestination(destination, failure);
+        } else {
+            dispatch(destination);
+        }
+    }
+
+    void handleEvent(const int outboundSocket, const uint32_t events) {
+        OutboundSession &session = *sessions.at(outboundSocket);
+
+        if (session.step == RelayStep::Connecting) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(outboundSocket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+                closeSession(session, strerror(error != 0 ? error : errno));
+
+                return;
+            }
+
+            session.step = RelayStep::Greeting;
+        } else if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0) {
+            if (!readReplies(session)) {
+                closeSession(session, session.step == RelayStep::Quit ? "" : "connection lost");
+
+                return;
+            }
+        }
+
+        if (!flush(session)) {
+            closeSession(session, "connection lost");
+
+            return;
+        }
+
+        updateInterest(session);
+    }
+
+    void advance() {
+        const uint64_t targetTick = chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - startTime).count() / RELAY_TICK_MS;
+
+        if (targetTick == currentTick) {
+            return;
+        }
+
+        vector<string> touched;
+        while (currentTick < targetTick) {
+            currentTick++;
+
+            auto &slot = wheel[currentTick % RELAY_WHEEL_SLOTS];
+            size_t kept = 0;
+            for (auto &job : slot) {
+                if (job->dueTick > currentTick) {
+                    slot[kept++] = std::move(job);
+                    continue;
+                }
+
+                touched.push_back(job->destination);
+                destinations[job->destination].ready.push_back(std::move(job));
+            }
+            slot.resize(kept);
+        }
+
+        for (const auto &destination : touched) {
+            dispatch(destination);
+        }
+
+        for (auto &[outboundSocket, session] : sessions) {
+            if (session->step == RelayStep::Idle && currentTick - session->idleSince >= RELAY_IDLE_TICKS) {
+                sendLine(*session, "QUIT");
+                session->step = RelayStep::Quit;
+            }
+        }
+
+        vector<int> stalled;
+        for (auto &[outboundSocket, session] : sessions) {
+            if (!flush(*session)) {
+                stalled.push_back(outboundSocket);
+                continue;
+            }
+
+            updateInterest(*session);
+        }
+
+        for (const int outboundSocket : stalled) {
+            closeSession(*sessions.at(outboundSocket), "connection lost");
+        }
+    }
+};
+
+unordered_map<int, unique_ptr<Connection> > connections;
+MailSpool spool;
+deque<pair<uint64_t, int> > pendingCommits;
+SSL_CTX *tlsContext = nullptr;
+bool startTlsEnabled = false;
+TlsStatistics tlsStatistics;
+RelayQueue relay;
+LocalStore store;
+deque<pair<uint64_t, AcceptedMessage> > pendingDeliveries;
+
+void sendResponse(Connection &connection, const string& responseCode, const string& message) {
+    const string response = responseCode + (responseCode.ends_with('-') ? "" : " ") + message + "\r\n";
+    connection.outputBuffer += response;
+
+    cout << "S: " << response;
+}
+
+void handleEHLO(Connection &connection, const string& domain) {
+    connection.state.greeted = true;
+
+    sendResponse(connection, "250-", "Hello " + domain);
+    if ((!startTlsEnabled || tlsContext != nullptr) && connection.ssl == nullptr) {
+        sendResponse(connection, "250-", "STARTTLS");
+    }
+    sendResponse(connection, "250-", "AUTH LOGIN PLAIN");
+    sendResponse(connection, "250-", "HELP");
+    sendResponse(connection, "250-", "SIZE " + to_string(MAX_MESSAGE_SIZE));
+    sendResponse(connection, "250-", "8BITMIME");
+    sendResponse(connection, "250-", "PIPELINING");
+    sendResponse(connection, "250-", "CHUNKING");
+    sendResponse(connection, "250-", "BINARYMIME");
+    sendResponse(connection, "250", "OK");
+}
+
+void handleHELO(Connection &connection, const string& domain) {
+    connection.state.greeted = true;
+    sendResponse(connection, "250", "Hello " + domain);
+}
+
+void handleMAIL(Connection &connection, const string& command) {
+    auto& state = connection.state;
+
+    if (!state.greeted) {
+        sendResponse(connection, "503", "Error: send HELO/EHLO first");
+        return;
+    }
+
+    if (state.inBdat) {
+        sendResponse(connection, "503", "Error: BDAT transaction in progress");
+        return;
+    }
+
+    const size_t start = command.find('<');
+    const size_t end = command.find('>');
+    if (start == string::npos || end == string::npos || start >= end) {
+        sendResponse(connection, "501", "Syntax error in parameters");
+        return;
+    }
+
+    string parameters = command.substr(end + 1);
+    ranges::transform(parameters, parameters.begin(), ::toupper);
+
+    state.mailFrom = command.substr(start + 1, end - start - 1);
+    state.hasMailFrom = true;
+    state.binaryMime = parameters.find("BODY=BINARYMIME") != string::npos;
+    state.recipients.clear();
+    state.messageData.clear();
+
+    sendResponse(connection, "250", "OK");
+}
+
+void handleRCPT(Connection &connection, const string& command) {
+    auto& state = connection.state;
+
+    if (!state.hasMailFrom) {
+        sendResponse(connection, "503", "Error: need MAIL command");
+        return;
+    }
+
+    const size_t start = command.find('<');
+    const size_t end = command.find('>');
+    if (start == string::npos || end == string::npos || start >= end) {
+        sendResponse(connection, "501", "Syntax error in parameters");
+        return;
+    }
+
+    const string recipient = command.substr(start + 1, end - start - 1);
+    state.recipients.push_back(recipient);
+
+    sendResponse(connection, "250", "OK");
+}
+
+void handleDATA(Connection &connection) {
+    auto& state = connection.state;
+
+    if (state.recipients.empty()) {
+        sendResponse(connection, "503", "Error: need RCPT command");
+        return;
+    }
+
+    if (state.binaryMime || state.inBdat) {
+        sendResponse(connection, "503", "Error: BINARYMIME and BDAT transactions must use BDAT");
+        return;
+    }
+
+    state.inData = true;
+    state.dataLineStart = true;
+    state.lastDataByte = '\n';
+    state.messageData.clear();
+    sendResponse(connection, "354", "End data with <CR><LF>.<CR><LF>");
+}
+
+void handleAUTH(Connection &connection, const string& command) {
+    string authType;
+    if (const size_t pos = command.find(' '); pos != string::npos && pos + 1 < command.length()) {
+        authType = command.substr(pos + 1);
+    }
+
+    if (authType == "LOGIN") {
+        sendResponse(connection, "334", "VXNlcm5hbWU6");
+    } else {
+        connection.state.authenticated = true;
+        sendResponse(connection, "235", "2.7.0 Authentication successful");
+    }
+}
+
+void finishMessage(Connection &connection) {
+    auto& state = connection.state;
+
+    state.inData = false;
+
+    if (state.messageTooLarge) {
+        sendResponse(connection, "552", "Message size exceeds fixed maximum message size");
+
+        state.reset();
+
+        return;
+    }
+
+    cout << "Received mail from: " << state.mailFrom << endl;
+    cout << "Recipients: ";
+    for (const auto& recipient : state.recipients) {
+        cout << recipient << " ";
+    }
+    cout << endl;
+    cout << "Message size: " << state.messageData.length() << " bytes" << endl;
+
+    SpoolIndexRecord record{};
+    const uint64_t sequence = spool.append(state, record);
+
+    if (sequence == 0) {
+        state.reset();
+
+        sendResponse(connection, "451", "Requested action aborted: local error in processing");
+
+        return;
+    }
+
+    pendingDeliveries.emplace_back(sequence, AcceptedMessage{record, std::move(state.mailFrom),
+                                                             std::move(state.recipients)});
+
+    state.reset();
+
+    connection.awaitingCommit = sequence;
+    pendingCommits.emplace_back(sequence, connection.socket);
+}
+
+void appendMessageData(ClientState &state, const char *data, const size_t length) {
+    if (state.messageTooLarge) {
+        return;
+    }
+
+    if (state.messageData.size() + length > MAX_MESSAGE_SIZE) {
+        state.messageTooLarge = true;
+        state.messageData.clear();
+        state.messageData.shrink_to_fit();
+
+        return;
+    }
+
+    state.messageData.append(data, length);
+}
+
+bool handleDataContent(Connection &connection) {
+    auto& state = connection.state;
+    InputBuffer &input = connection.input;
+
+    const char *position = input.begin();
+    const char *end = input.end();
+
+    while (position < end) {
+        if (state.dataLineStart) {
+            if (*position == '.') {
+                if (end - position < 3) {
+                    break;
+                }
+
+                if (position[1] == '\r' && position[2] == '\n') {
+                    input.consume(position + 3 - input.begin());
+                    finishMessage(connection);
+
+                    return true;
+                }
+
+                state.lastDataByte = '.';
+                position++;
+            }
+
+            state.dataLineStart = false;
+        }
+
+        const auto *newline = static_cast<const char *>(memchr(position, '\n', end - position));
+        const char *spanEnd = newline != nullptr ? newline + 1 : end;
+
+        appendMessageData(state, position, spanEnd - position);
+
+        if (newline != nullptr) {
+            state.dataLineStart = (newline > position ? newline[-1] : state.lastDataByte) == '\r';
+        }
+
+        state.lastDataByte = spanEnd[-1];
+        position = spanEnd;
+    }
+
+    input.consume(position - input.begin());
+
+    return false;
+}
+
+void completeChunk(Connection &connection) {
+    auto& state = connection.state;
+
+    if (state.chunkRejected) {
+        state.chunkRejected = false;
+        sendResponse(connection, "503", "Error: need RCPT command");
+        return;
+    }
+
+    if (state.chunkLast) {
+        finishMessage(connection);
+        return;
+    }
+
+    sendResponse(connection, "250", "OK: " + to_string(state.chunkSize) + " octets received");
+}
+
+void handleBDAT(Connection &connection, const string& args) {
+    auto& state = connection.state;
+
+    char *sizeEnd = nullptr;
+    const unsigned long long chunkSize = strtoull(args.c_str(), &sizeEnd, 10);
+    if (sizeEnd == args.c_str() || !isdigit(static_cast<unsigned char>(args[0]))) {
+        sendResponse(connection, "501", "Syntax error in parameters");
+        return;
+    }
+
+    string option(sizeEnd);
+    option.erase(0, option.find_first_not_of(' '));
+    ranges::transform(option, option.begin(), ::toupper);
+
+    if (!option.empty() && option != "LAST") {
+        sendResponse(connection, "501", "Syntax error in parameters");
+        return;
+    }
+
+    state.chunkSize = chunkSize;
+    state.chunkRemaining = chunkSize;
+    state.chunkLast = option == "LAST";
+    state.chunkRejected = state.recipients.empty();
+
+    if (!state.chunkRejected) {
+        state.inBdat = true;
+
+        if (state.messageData.size() + chunkSize <= MAX_MESSAGE_SIZE) {
+            state.messageData.reserve(state.messageData.size() + chunkSize);
+        }
+    }
+
+    if (chunkSize == 0) {
+        completeChunk(connection);
+    }
+}
+
+bool handleChunkContent(Connection &connection) {
+    auto& state = connection.state;
+    InputBuffer &input = connection.input;
+
+    const size_t length = min<uint64_t>(state.chunkRemaining, input.size());
+    if (!state.chunkRejected) {
+        appendMessageData(state, input.begin(), length);
+    }
+
+    input.consume(length);
+    state.chunkRemaining -= length;
+
+    if (state.chunkRemaining > 0) {
+        return false;
+    }
+
+    completeChunk(connection);
+
+    return true;
+}
+
+void handleSTARTTLS(Connection &connection) {
+    if (connection.ssl != nullptr) {
+        sendResponse(connection, "503", "Error: TLS already active");
+        return;
+    }
+
+    // Without --starttls the session stays in plaintext after the 220, which is what the plaintext lab clients
+    // expect.
+    if (!startTlsEnabled) {
+        sendResponse(connection, "220", "Ready to start TLS");
+        return;
+    }
+
+    if (tlsContext == nullptr) {
+        sendResponse(connection, "454", "TLS not available due to temporary reason");
+        return;
+    }
+
+    sendResponse(connection, "220", "Ready to start TLS");
+
+    connection.startTlsPending = true;
+}
+
+void handleQUIT(Connection &connection) {
+    sendResponse(connection, "221", "Bye");
+
+    connection.closing = true;
+}
+
+void handleRSET(Connection &connection) {
+    connection.state.reset();
+    sendResponse(connection, "250", "OK");
+}
+
+void handleNOOP(Connection &connection) {
+    sendResponse(connection, "250", "OK");
+}
+
+void handleCommand(Connection &connection, const string& command) {
+    cout << "C: " << command << endl;
+
+    if (connection.closing || connection.startTlsPending) {
+        return;
+    }
+
+    string cmd;
+    string args;
+
+    if (const size_t spacePos = command.find(' '); spacePos != string::npos) {
+        cmd = command.substr(0, spacePos);
+        args = command.substr(spacePos + 1);
+    } else {
+        cmd = command;
+    }
+
+    ranges::transform(cmd, cmd.begin(), ::toupper);
+
+    if (cmd == "EHLO" || cmd == "HELO") {
+        if (cmd == "EHLO") {
+            handleEHLO(connection, args);
+        } else {
+            handleHELO(connection, args);
+        }
+    } else if (cmd == "MAIL") {
+        handleMAIL(connection, args);
+    } else if (cmd == "RCPT") {
+        handleRCPT(connection, args);
+    } else if (cmd == "DATA") {
+        handleDATA(connection);
+    } else if (cmd == "BDAT") {
+        handleBDAT(connection, args);
+    } else if (cmd == "AUTH") {
+        handleAUTH(connection, command);
+    } else if (cmd == "STARTTLS") {
+        handleSTARTTLS(connection);
+    } else if (cmd == "QUIT") {
+        handleQUIT(connection);
+    } else if (cmd == "RSET") {
+        handleRSET(connection);
+    } else if (cmd == "NOOP") {
+        handleNOOP(connection);
+    } else {
+        sendResponse(connection, "502", "Command not implemented");
+    }
+}
+
+bool generateSelfSignedCertificate(const string &certFile, const string &keyFile) {
+    EVP_PKEY *pkey = nullptr;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+
+        return false;
+    }
+
+    if (EVP_PKEY_keygen_init(ctx) <= 0) {
+        EVP_PKEY_CTX_free(ctx);
+        ERR_print_errors_fp(stderr);
+
+        return false;
+    }
+
+    if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0) {
+        EVP_PKEY_CTX_free(ctx);
+        ERR_print_errors_fp(stderr);
+
+        return false;
+    }
+
+    if (EVP_PKEY_keygen(ctx, &pkey) <= 0) {
+        EVP_PKEY_CTX_free(ctx);
+        ERR_print_errors_fp(stderr);
+
+        return false;
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+
+    X509 *x509 = X509_new();
+
+    X509_set_version(x509, 2);
+
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+
+    X509_gmtime_adj(X509_get_notBefore(x509), 0);
+    X509_gmtime_adj(X509_get_notAfter(x509), 60 * 60 * 24 * 365);
+
+    X509_set_pubkey(x509, pkey);
+
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "C", MBSTRING_ASC, (unsigned char *)"PL", -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "ST", MBSTRING_ASC, (unsigned char *)"Poland", -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "L", MBSTRING_ASC, (unsigned char *)"Lublin", -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC, (unsigned char *)"SMTP Server", -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char *)"localhost", -1, -1, 0);
+
+    X509_set_issuer_name(x509, name);
+
+    if (X509_sign(x509, pkey, EVP_sha256()) <= 0) {
+        X509_free(x509);
+        EVP_PKEY_free(pkey);
+        ERR_print_errors_fp(stderr);
+
+        return false;
+    }
+
+    FILE *certFilePtr = fopen(certFile.c_str(), "wb");
+    if (!certFilePtr) {
+        cerr << "Unable to open certificate file for writing" << endl;
+
+        X509_free(x509);
+        EVP_PKEY_free(pkey);
+
+        return false;
+    }
+
+    PEM_write_X509(certFilePtr, x509);
+    fclose(certFilePtr);
+
+    FILE *keyFilePtr = fopen(keyFile.c_str(), "wb");
+    if (!keyFilePtr) {
+        cerr << "Unable to open key file for writing" << endl;
+
+        X509_free(x509);
+        EVP_PKEY_free(pkey);
+
+        return false;
+    }
+
+    PEM_write_PrivateKey(keyFilePtr, pkey, nullptr, nullptr, 0, nullptr, nullptr);
+    fclose(keyFilePtr);
+
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+
+    cout << "Self-signed certificate and private key generated successfully" << endl;
+
+    return true;
+}
+
+SSL_CTX* initServerContext(const string &certFile, const string &keyFile) {
+    SSL_load_error_strings();
+    OpenSSL_add_ssl_algorithms();
+
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+
+        return nullptr;
+    }
+
+    if (SSL_CTX_use_certificate_file(ctx, certFile.c_str(), SSL_FILETYPE_PEM) <= 0) {
+        SSL_CTX_free(ctx);
+        ERR_print_errors_fp(stderr);
+
+        return nullptr;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) <= 0) {
+        SSL_CTX_free(ctx);
+        ERR_print_errors_fp(stderr);
+
+        return nullptr;
+    }
+
+    if (!SSL_CTX_check_private_key(ctx)) {
+        cerr << "Private key does not match the certificate" << endl;
+
+        SSL_CTX_free(ctx);
+        ERR_print_errors_fp(stderr);
+
+        return nullptr;
+    }
+
+    static constexpr unsigned char sessionIdContext[] = "smtp-server";
+    SSL_CTX_set_session_id_context(ctx, sessionIdContext, sizeof(sessionIdContext) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+
+    return ctx;
+}
+
+double threadCpuMicros() {
+    timespec now{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+void reportTlsStatistics() {
+    const TlsStatistics &stats = tlsStatistics;
+    const uint64_t total = stats.fullHandshakes + stats.resumedHandshakes;
+
+    cout << "TLS handshakes: " << total << " (" << stats.resumedHandshakes << " resumed, "
+         << (total > 0 ? 100.0 * stats.resumedHandshakes / total : 0.0) << "%), " << stats.failedHandshakes
+         << " failed; average CPU: full "
+         << (stats.fullHandshakes > 0 ? stats.fullCpuMicros / stats.fullHandshakes : 0.0) << " us, resumed "
+         << (stats.resumedHandshakes > 0 ? stats.resumedCpuMicros / stats.resumedHandshakes : 0.0) << " us"
+         << endl;
+}
+
+bool setNonBlocking(const int socket) {
+    const int flags = fcntl(socket, F_GETFL, 0);
+
+    return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+void updateInterest(const int epollFd, Connection &connection) {
+    uint32_t interest = 0;
+    if (connection.tlsHandshaking) {
+        interest = connection.tlsWantsWrite ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+    } else {
+        // A ClientHello sent right after STARTTLS must stay in the socket until the 220 is flushed and the
+        // handshake starts; readInput leaves it there, so keeping EPOLLIN armed would only spin the loop.
+        if (!connection.startTlsPending &&
+            ((connection.awaitingCommit == 0 && connection.input.writable() > 0) || connection.tlsWantsRead)) {
+            interest |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (connection.outputOffset < connection.outputBuffer.size() || connection.tlsWantsWrite) {
+            interest |= EPOLLOUT;
+        }
+    }
+
+    if (interest == connection.interest) {
+        return;
+    }
+
+    epoll_event event{};
+    event.events = interest;
+    event.data.fd = connection.socket;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.socket, &event);
+
+    connection.interest = interest;
+}
+
+void closeConnection(const int epollFd, const int clientSocket) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, clientSocket, nullptr);
+    close(clientSocket);
+    connections.erase(clientSocket);
+
+    cout << "Client disconnected" << endl;
+}
+
+ssize_t tlsFailure(const int sslError) {
+    if (sslError == SSL_ERROR_WANT_READ || sslError == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (sslError == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
 
-    cout << "S: " << response;
+    errno = EIO;
+    return -1;
 }
 
-void handleEHLO(const int clientSocket, const string& domain) {
-    clientStates[clientSocket].greeted = true;
+ssize_t receiveData(Connection &connection, char *buffer, const size_t length) {
+    if (connection.ssl == nullptr) {
+        return recv(connection.socket, buffer, length, 0);
+    }
 
-    sendResponse(clientSocket, "250", "Hello " + domain);
-    sendResponse(clientSocket, "250", "STARTTLS");
-    sendResponse(clientSocket, "250", "AUTH LOGIN PLAIN");
-    sendResponse(clientSocket, "250", "HELP");
-    sendResponse(clientSocket, "250", "SIZE 35882577");
-    sendResponse(clientSocket, "250", "OK");
-}
+    ERR_clear_error();
 
-void handleHELO(const int clientSocket, const string& domain) {
-    clientStates[clientSocket].greeted = true;
-    sendResponse(clientSocket, "250", "Hello " + domain);
-}
+    const int bytesRead = SSL_read(connection.ssl, buffer, static_cast<int>(min<size_t>(length, INT_MAX)));
+    if (bytesRead > 0) {
+        connection.tlsWantsWrite = false;
+        return bytesRead;
+    }
 
-void handleMAIL(const int clientSocket, const string& command) {
-    auto& state = clientStates[clientSocket];
+    const int sslError = SSL_get_error(connection.ssl, bytesRead);
+    connection.tlsWantsWrite = sslError == SSL_ERROR_WANT_WRITE;
 
-    if (!state.greeted) {
-        sendResponse(clientSocket, "503", "Error: send HELO/EHLO first");
-        return;
+    return tlsFailure(sslError);
+}
+
+ssize_t sendData(Connection &connection, const char *buffer, const size_t length) {
+    if (connection.ssl == nullptr) {
+        return send(connection.socket, buffer, length, MSG_NOSIGNAL);
     }
 
-    const size_t start = command.find('<');
-    const size_t end = command.find('>');
-    if (start == string::npos || end == string::npos || start >= end) {
-        sendResponse(clientSocket, "501", "Syntax error in parameters");
-        return;
+    ERR_clear_error();
+
+    const int bytesSent = SSL_write(connection.ssl, buffer, static_cast<int>(min<size_t>(length, INT_MAX)));
+    if (bytesSent > 0) {
+        connection.tlsWantsRead = false;
+        return bytesSent;
     }
 
-    state.mailFrom = command.substr(start + 1, end - start - 1);
-    state.hasMailFrom = true;
-    state.recipients.clear();
+    const int sslError = SSL_get_error(connection.ssl, bytesSent);
+    connection.tlsWantsRead = sslError == SSL_ERROR_WANT_READ;
 
-    sendResponse(clientSocket, "250", "OK");
+    return tlsFailure(sslError);
 }
 
-void handleRCPT(const int clientSocket, const string& command) {
-    auto& state = clientStates[clientSocket];
+bool flushOutput(Connection &connection) {
+    while (connection.outputOffset < connection.outputBuffer.size()) {
+        const ssize_t bytesSent = sendData(connection, connection.outputBuffer.data() + connection.outputOffset,
+                                           connection.outputBuffer.size() - connection.outputOffset);
+        if (bytesSent <= 0) {
+            if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
 
-    if (!state.hasMailFrom) {
-        sendResponse(clientSocket, "503", "Error: need MAIL command");
-        return;
-    }
+            if (bytesSent == 0) {
+                return false;
+            }
 
-    const size_t start = command.find('<');
-    const size_t end = command.find('>');
-    if (start == string::npos || end == string::npos || start >= end) {
-        sendResponse(clientSocket, "501", "Syntax error in parameters");
-        return;
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        connection.outputOffset += bytesSent;
     }
 
-    const string recipient = command.substr(start + 1, end - start - 1);
-    state.recipients.push_back(recipient);
+    connection.outputBuffer.clear();
+    connection.outputOffset = 0;
 
-    sendResponse(clientSocket, "250", "OK");
+    return true;
 }
 
-void handleDATA(const int clientSocket) {
-    auto& state = clientStates[clientSocket];
+void processInput(Connection &connection) {
+    InputBuffer &input = connection.input;
 
-    if (state.recipients.empty()) {
-        sendResponse(clientSocket, "503", "Error: need RCPT command");
-        return;
+    while (!connection.closing && !connection.startTlsPending && connection.awaitingCommit == 0 && input.size() > 0) {
+        if (connection.state.chunkRemaining > 0) {
+            if (!handleChunkContent(connection)) {
+                break;
+            }
+
+            continue;
+        }
+
+        if (connection.state.inData) {
+            if (!handleDataContent(connection)) {
+                break;
+            }
+
+            continue;
+        }
+
+        string_view line;
+        if (!input.nextLine(line)) {
+            if (input.size() > MAX_LINE_LENGTH) {
+                input.clear();
+                sendResponse(connection, "500", "Line too long");
+            }
+
+            break;
+        }
+
+        if (!line.empty()) {
+            handleCommand(connection, string(line));
+        }
     }
 
-    state.inData = true;
-    sendResponse(clientSocket, "354", "End data with <CR><LF>.<CR><LF>");
+    input.compact();
 }
 
-void handleAUTH(const int clientSocket, const string& command) {
-    string authType;
-    if (const size_t pos = command.find(' '); pos != string::npos && pos + 1 < command.length()) {
-        authType = command.substr(pos + 1);
+int receiveChunk(Connection &connection) {
+    auto& state = connection.state;
+
+    const size_t offset = state.messageData.size();
+    const size_t length = min<uint64_t>(state.chunkRemaining, CHUNK_RECEIVE_SIZE);
+    state.messageData.resize(offset + length);
+
+    const ssize_t bytesRead = receiveData(connection, state.messageData.data() + offset, length);
+    state.messageData.resize(offset + max<ssize_t>(bytesRead, 0));
+
+    if (bytesRead == 0) {
+        return -1;
     }
 
-    if (authType == "LOGIN") {
-        sendResponse(clientSocket, "334", "VXNlcm5hbWU6");
-    } else {
-        clientStates[clientSocket].authenticated = true;
-        sendResponse(clientSocket, "235", "2.7.0 Authentication successful");
+    if (bytesRead < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+
+        return errno == EINTR ? 1 : -1;
+    }
+
+    state.chunkRemaining -= bytesRead;
+    if (state.chunkRemaining == 0) {
+        completeChunk(connection);
     }
+
+    return 1;
 }
 
-void handleDataContent(int clientSocket, const string& line) {
-    auto& state = clientStates[clientSocket];
+bool canReceiveChunkDirectly(const Connection &connection) {
+    const auto& state = connection.state;
 
-    if (line == ".") {
-        state.inData = false;
+    return state.chunkRemaining > 0 && connection.input.size() == 0 && !state.chunkRejected &&
+           !state.messageTooLarge && state.messageData.size() + state.chunkRemaining <= MAX_MESSAGE_SIZE;
+}
 
-        cout << "Received mail from: " << state.mailFrom << endl;
-        cout << "Recipients: ";
-        for (const auto& recipient : state.recipients) {
-            cout << recipient << " ";
+bool readInput(Connection &connection) {
+    while (!connection.closing && !connection.startTlsPending && !connection.tlsHandshaking &&
+           connection.awaitingCommit == 0 && connection.input.writable() > 0) {
+        if (canReceiveChunkDirectly(connection)) {
+            const int result = receiveChunk(connection);
+            if (result < 0) {
+                return false;
+            }
+
+            if (result == 0) {
+                break;
+            }
+
+            processInput(connection);
+
+            continue;
         }
-        cout << endl;
-        cout << "Message size: " << state.messageData.length() << " bytes" << endl;
 
-        sendResponse(clientSocket, "250", "OK: message queued");
+        const ssize_t bytesRead = receiveData(connection, connection.input.writePtr(), connection.input.writable());
+        if (bytesRead == 0) {
+            return false;
+        }
 
-        state.reset();
-    } else {
-        if (!line.empty() && line[0] == '.') {
-            state.messageData += line.substr(1);
-        } else {
-            state.messageData += line;
+        if (bytesRead < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
         }
-        state.messageData += "\n";
+
+        connection.input.commit(bytesRead);
+        processInput(connection);
     }
+
+    return true;
 }
 
-void handleSTARTTLS(const int clientSocket) {
-    sendResponse(clientSocket, "220", "Ready to start TLS");
+void acceptConnections(const int epollFd, const int serverSocket) {
+    while (true) {
+        sockaddr_in clientAddr = {};
+        socklen_t addrLen = sizeof(clientAddr);
+
+        const int clientSocket = accept(serverSocket, reinterpret_cast<sockaddr*>(&clientAddr), &addrLen);
+        if (clientSocket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                cerr << "Failed to accept connection: " << strerror(errno) << endl;
+            }
+
+            return;
+        }
+
+        if (!setNonBlocking(clientSocket)) {
+            cerr << "Failed to make client socket non-blocking." << endl;
+
+            close(clientSocket);
+
+            continue;
+        }
+
+        constexpr int noDelay = 1;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        char clientIp[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIp, INET_ADDRSTRLEN);
+        cout << "Client connected: " << clientIp << endl;
+
+        auto connection = make_unique<Connection>();
+        connection->socket = clientSocket;
+        connection->interest = EPOLLIN | EPOLLRDHUP;
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = clientSocket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+            cerr << "Failed to register client socket." << endl;
+
+            close(clientSocket);
+
+            continue;
+        }
+
+        sendResponse(*connection, "220", "SMTP Server Ready");
+
+        Connection &registered = *connection;
+        connections[clientSocket] = std::move(connection);
+
+        if (!flushOutput(registered)) {
+            closeConnection(epollFd, clientSocket);
+
+            continue;
+        }
+
+        updateInterest(epollFd, registered);
+    }
 }
 
-void handleQUIT(const int clientSocket) {
-    sendResponse(clientSocket, "221", "Bye");
+bool continueHandshake(Connection &connection) {
+    ERR_clear_error();
+
+    const double cpuStart = threadCpuMicros();
+    const int result = SSL_do_handshake(connection.ssl);
+    connection.handshakeCpuMicros += threadCpuMicros() - cpuStart;
+
+    if (result == 1) {
+        connection.tlsHandshaking = false;
+        connection.tlsWantsWrite = false;
+        connection.state = ClientState();
+
+        if (SSL_session_reused(connection.ssl)) {
+            tlsStatistics.resumedHandshakes++;
+            tlsStatistics.resumedCpuMicros += connection.handshakeCpuMicros;
+        } else {
+            tlsStatistics.fullHandshakes++;
+            tlsStatistics.fullCpuMicros += connection.handshakeCpuMicros;
+        }
+
+        cout << "TLS established using " << SSL_get_version(connection.ssl) << " " << SSL_get_cipher(connection.ssl)
+             << (SSL_session_reused(connection.ssl) ? " (resumed)" : " (full handshake)") << endl;
+        reportTlsStatistics();
+
+        return true;
+    }
+
+    const int sslError = SSL_get_error(connection.ssl, result);
+    connection.tlsWantsWrite = sslError == SSL_ERROR_WANT_WRITE;
 
-    clientStates.erase(clientSocket);
+    if (sslError == SSL_ERROR_WANT_READ || sslError == SSL_ERROR_WANT_WRITE) {
+        return true;
+    }
+
+    tlsStatistics.failedHandshakes++;
+    cerr << "TLS handshake failed" << endl;
+    ERR_print_errors_fp(stderr);
+
+    return false;
 }
 
-void handleRSET(const int clientSocket) {
-    clientStates[clientSocket].reset();
-    sendResponse(clientSocket, "250", "OK");
+bool startTls(Connection &connection) {
+    connection.startTlsPending = false;
+    connection.input.clear();
+
+    connection.ssl = SSL_new(tlsContext);
+    if (connection.ssl == nullptr) {
+        cerr << "Failed to create SSL structure" << endl;
+
+        return false;
+    }
+
+    SSL_set_fd(connection.ssl, connection.socket);
+    SSL_set_accept_state(connection.ssl);
+
+    connection.tlsHandshaking = true;
+    connection.handshakeCpuMicros = 0;
+
+    return continueHandshake(connection);
 }
 
-void handleNOOP(const int clientSocket) {
-    sendResponse(clientSocket, "250", "OK");
+bool serviceConnection(Connection &connection) {
+    if (connection.tlsHandshaking) {
+        if (!continueHandshake(connection)) {
+            return false;
+        }
+
+        if (connection.tlsHandshaking) {
+            return true;
+        }
+    }
+
+    if (!readInput(connection) || !flushOutput(connection)) {
+        return false;
+    }
+
+    if (connection.closing && connection.outputBuffer.empty()) {
+        return false;
+    }
+
+    if (connection.startTlsPending && connection.outputBuffer.empty()) {
+        if (!startTls(connection)) {
+            return false;
+        }
+
+        if (!connection.tlsHandshaking) {
+            return serviceConnection(connection);
+        }
+    }
+
+    return true;
 }
 
-void handleCommand(const int clientSocket, const string& command) {
-    cout << "C: " << command << endl;
+void handleConnectionEvent(const int epollFd, const int clientSocket, const uint32_t events) {
+    const auto it = connections.find(clientSocket);
+    if (it == connections.end()) {
+        return;
+    }
+
+    Connection &connection = *it->second;
+
+    if (events & (EPOLLERR | EPOLLHUP) || !serviceConnection(connection)) {
+        closeConnection(epollFd, clientSocket);
 
-    if (const auto& state = clientStates[clientSocket]; state.inData) {
-        handleDataContent(clientSocket, command);
         return;
     }
 
-    string cmd;
-    string args;
+    updateInterest(epollFd, connection);
+}
 
-    if (const size_t spacePos = command.find(' '); spacePos != string::npos) {
-        cmd = command.substr(0, spacePos);
-        args = command.substr(spacePos + 1);
-    } else {
-        cmd = command;
+void handleSpoolCommits(const int epollFd) {
+    uint64_t signals;
+    while (read(spool.eventFd, &signals, sizeof(signals)) > 0) {
     }
 
-    ranges::transform(cmd, cmd.begin(), ::toupper);
+    // The failed ranges are taken after the commit point: a range recorded later only covers later sequences.
+    const uint64_t committed = spool.committedSequence.load(memory_order_acquire);
+    const vector<pair<uint64_t, uint64_t> > failedRanges = spool.takeFailedRanges();
+    const uint64_t settled = failedRanges.empty() ? committed : max(committed, failedRanges.back().second);
+
+    auto failed = [&failedRanges](const uint64_t sequence) {
+        return any_of(failedRanges.begin(), failedRanges.end(), [sequence](const pair<uint64_t, uint64_t> &range) {
+            return sequence > range.first && sequence <= range.second;
+        });
+    };
+
+    while (!pendingDeliveries.empty() && pendingDeliveries.front().first <= settled) {
+        const auto &[sequence, message] = pendingDeliveries.front();
+        if (!failed(sequence)) {
+            if (relay.routesAny(message.recipients)) {
+                relay.enqueue(message.record, message.mailFrom, message.recipients);
+            }
+            store.enqueue(message.record, message.recipients);
+        }
+        pendingDeliveries.pop_front();
+    }
 
-    if (cmd == "EHLO" || cmd == "HELO") {
-        if (cmd == "EHLO") {
-            handleEHLO(clientSocket, args);
+    while (!pendingCommits.empty() && pendingCommits.front().first <= settled) {
+        const auto [sequence, clientSocket] = pendingCommits.front();
+        pendingCommits.pop_front();
+
+        const auto it = connections.find(clientSocket);
+        if (it == connections.end() || it->second->awaitingCommit != sequence) {
+            continue;
+        }
+
+        Connection &connection = *it->second;
+        connection.awaitingCommit = 0;
+
+        if (failed(sequence)) {
+            sendResponse(connection, "451", "Requested action aborted: local error in processing");
         } else {
-            handleHELO(clientSocket, args);
+            sendResponse(connection, "250", "OK: message queued");
         }
-    } else if (cmd == "MAIL") {
-        handleMAIL(clientSocket, args);
-    } else if (cmd == "RCPT") {
-        handleRCPT(clientSocket, args);
-    } else if (cmd == "DATA") {
-        handleDATA(clientSocket);
-    } else if (cmd == "AUTH") {
-        handleAUTH(clientSocket, command);
-    } else if (cmd == "STARTTLS") {
-        handleSTARTTLS(clientSocket);
-    } else if (cmd == "QUIT") {
-        handleQUIT(clientSocket);
-    } else if (cmd == "RSET") {
-        handleRSET(clientSocket);
-    } else if (cmd == "NOOP") {
-        handleNOOP(clientSocket);
-    } else {
-        sendResponse(clientSocket, "502", "Command not implemented");
+        processInput(connection);
+
+        if (!serviceConnection(connection)) {
+            closeConnection(epollFd, clientSocket);
+
+            continue;
+        }
+
+        updateInterest(epollFd, connection);
     }
 }
 
-int main() {
+int main(const int argc, char *argv[]) {
     int port = DEFAULT_PORT;
+    string spoolDirectory = "spool";
+    int batchWindowMicros = DEFAULT_BATCH_WINDOW_US;
+    string transportMap;
+
+    vector<string> arguments;
+    for (int i = 1; i < argc; i++) {
+        if (const string argument = argv[i]; argument == "--starttls") {
+            startTlsEnabled = true;
+        } else {
+            arguments.push_back(argument);
+        }
+    }
 
-    if (argc > 1) {
-        port = stoi(argv[1]);
+    if (arguments.size() > 0) {
+        port = stoi(arguments[0]);
+    }
+
+    if (arguments.size() > 1) {
+        spoolDirectory = arguments[1];
+    }
+
+    if (arguments.size() > 2) {
+        batchWindowMicros = stoi(arguments[2]);
+    }
+
+    if (arguments.size() > 3) {
+        transportMap = arguments[3];
+    }
+
+    if (!spool.open(spoolDirectory, chrono::microseconds(batchWindowMicros))) {
+        return 1;
+    }
+
+    if (!transportMap.empty() && !relay.loadRoutes(transportMap)) {
+        spool.shutdown();
+
+        return 1;
+    }
+
+    if (!store.open(spool, [](const string &recipient) { return relay.routeFor(recipient).empty(); })) {
+        store.shutdown();
+        spool.shutdown();
+
+        return 1;
+    }
+
+    if (startTlsEnabled) {
+        const string certFile = "server.crt";
+        const string keyFile = "server.key";
+
+        if ((filesystem::exists(certFile) && filesystem::exists(keyFile)) ||
+            generateSelfSignedCertificate(certFile, keyFile)) {
+            tlsContext = initServerContext(certFile, keyFile);
+        }
+
+        if (tlsContext == nullptr) {
+            cerr << "Failed to initialize SSL context, STARTTLS disabled" << endl;
+        }
     }
 
     const int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket < 0) {
         cerr << "Failed to create socket." << endl;
 
+        store.shutdown();
+        spool.shutdown();
+
         return 1;
     }
 
@@ -237,6 +2832,8 @@ int main() {
         cerr << "Failed to set socket options." << endl;
 
         close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
 
         return 1;
     }
@@ -249,6 +2846,8 @@ int main() {
         cerr << "Invalid address." << endl;
 
         close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
 
         return 1;
     }
@@ -257,71 +2856,121 @@ int main() {
         cerr << "Failed to bind socket." << endl;
 
         close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
 
         return 1;
     }
 
-    if (listen(serverSocket, 10) < 0) {
+    if (listen(serverSocket, SOMAXCONN) < 0) {
         cerr << "Failed to listen." << endl;
 
         close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
 
         return 1;
     }
 
-    cout << "SMTP server started on 127.0.0.1:" << port << endl;
+    if (!setNonBlocking(serverSocket)) {
+        cerr << "Failed to make server socket non-blocking." << endl;
 
-    while (true) {
-        sockaddr_in clientAddr = {};
-        socklen_t addrLen = sizeof(clientAddr);
+        close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
 
-        const int clientSocket = accept(serverSocket, reinterpret_cast<sockaddr*>(&clientAddr), &addrLen);
-        if (clientSocket < 0) {
-            cerr << "Failed to accept connection." << endl;
-            continue;
-        }
+        return 1;
+    }
 
-        char clientIp[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIp, INET_ADDRSTRLEN);
-        cout << "Client connected: " << clientIp << endl;
+    const int epollFd = epoll_create1(0);
+    if (epollFd < 0) {
+        cerr << "Failed to create epoll instance." << endl;
+
+        close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
 
-        clientStates[clientSocket] = ClientState();
+        return 1;
+    }
 
-        sendResponse(clientSocket, "220", "SMTP Server Ready");
+    epoll_event serverEvent{};
+    serverEvent.events = EPOLLIN;
+    serverEvent.data.fd = serverSocket;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &serverEvent) < 0) {
+        cerr << "Failed to register server socket." << endl;
 
-        char buffer[BUFFER_SIZE];
-        string command;
-        bool clientConnected = true;
+        close(epollFd);
+        close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
 
-        while (clientConnected) {
-            memset(buffer, 0, BUFFER_SIZE);
+        return 1;
+    }
 
-            if (const ssize_t bytesRead = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0); bytesRead <= 0) {
-                cout << "Client disconnected" << endl;
-                clientConnected = false;
-                break;
-            }
+    epoll_event spoolEvent{};
+    spoolEvent.events = EPOLLIN;
+    spoolEvent.data.fd = spool.eventFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, spool.eventFd, &spoolEvent) < 0) {
+        cerr << "Failed to register spool event descriptor." << endl;
 
-            string data(buffer);
+        close(epollFd);
+        close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
 
-            size_t pos = 0;
-            while ((pos = data.find("\r\n", pos)) != string::npos) {
-                if (string cmd = data.substr(0, pos); !cmd.empty()) {
-                    handleCommand(clientSocket, cmd);
-                }
+        return 1;
+    }
+
+    if (relay.active() && !relay.open(epollFd, spool)) {
+        close(epollFd);
+        close(serverSocket);
+        store.shutdown();
+        spool.shutdown();
+
+        return 1;
+    }
+
+    cout << "SMTP server started on 127.0.0.1:" << port << ", spooling to " << spoolDirectory
+         << " with a " << batchWindowMicros << " us commit window" << endl;
 
-                data = data.substr(pos + 2);
-                pos = 0;
+    epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        const int readyCount = epoll_wait(epollFd, events, MAX_EVENTS, relay.active() ? RELAY_TICK_MS : -1);
+        if (readyCount < 0) {
+            if (errno == EINTR) {
+                continue;
             }
 
-            if (!clientStates.contains(clientSocket)) {
-                clientConnected = false;
+            cerr << "epoll_wait failed: " << strerror(errno) << endl;
+            break;
+        }
+
+        for (int i = 0; i < readyCount; i++) {
+            if (events[i].data.fd == serverSocket) {
+                acceptConnections(epollFd, serverSocket);
+            } else if (events[i].data.fd == spool.eventFd) {
+                handleSpoolCommits(epollFd);
+            } else if (relay.sessions.contains(events[i].data.fd)) {
+                relay.handleEvent(events[i].data.fd, events[i].events);
+            } else {
+                handleConnectionEvent(epollFd, events[i].data.fd, events[i].events);
             }
         }
 
-        close(clientSocket);
+        if (relay.active()) {
+            relay.advance();
+        }
+    }
+
+    store.shutdown();
+    spool.shutdown();
+
+    if (tlsContext != nullptr) {
+        SSL_CTX_free(tlsContext);
     }
 
+    close(epollFd);
     close(serverSocket);
 
     return 0;
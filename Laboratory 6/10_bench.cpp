@@ -0,0 +1,419 @@
+#include <iostream>
+#include <cstring>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+using namespace std;
+using namespace std::chrono;
+
+constexpr size_t CHUNK_SIZE = 1 << 20;
+constexpr size_t LINE_LENGTH = 76;
+
+struct ReplyReader {
+    int socket;
+    SSL *ssl = nullptr;
+    string buffer;
+
+    bool readLine(string &line) {
+        while (true) {
+            if (const size_t pos = buffer.find("\r\n"); pos != string::npos) {
+                line = buffer.substr(0, pos);
+                buffer.erase(0, pos + 2);
+
+                return true;
+            }
+
+            char chunk[4096];
+            const ssize_t bytesRead = ssl != nullptr ? SSL_read(ssl, chunk, sizeof(chunk))
+                                                     : recv(socket, chunk, sizeof(chunk), 0);
+            if (bytesRead <= 0) {
+                return false;
+            }
+
+            buffer.append(chunk, bytesRead);
+        }
+    }
+
+    bool expect(const string &code) {
+        string line;
+        do {
+            if (!readLine(line)) {
+                cerr << "Connection closed while waiting for " << code << endl;
+
+                return false;
+            }
+        } while (line.size() > 3 && line[3] == '-');
+
+        if (line.compare(0, code.size(), code) != 0) {
+            cerr << "Unexpected reply: " << line << endl;
+
+            return false;
+        }
+
+        return true;
+    }
+};
+
+bool sendAll(const int socket, const char *data, size_t length) {
+    while (length > 0) {
+        const ssize_t bytesSent = send(socket, data, length, MSG_NOSIGNAL);
+        if (bytesSent <= 0) {
+            cerr << "Failed to send data." << endl;
+
+            return false;
+        }
+
+        data += bytesSent;
+        length -= bytesSent;
+    }
+
+    return true;
+}
+
+bool sendCommand(const int socket, ReplyReader &reader, const string &command, const string &code) {
+    if (reader.ssl != nullptr) {
+        return SSL_write(reader.ssl, command.c_str(), static_cast<int>(command.length())) ==
+               static_cast<int>(command.length()) && reader.expect(code);
+    }
+
+    return sendAll(socket, command.c_str(), command.length()) && reader.expect(code);
+}
+
+string buildBodyChunk() {
+    string chunk;
+    chunk.reserve(CHUNK_SIZE + LINE_LENGTH + 2);
+
+    size_t lineNumber = 0;
+    while (chunk.size() < CHUNK_SIZE) {
+        string line(LINE_LENGTH, static_cast<char>('A' + lineNumber % 26));
+        if (lineNumber % 16 == 0) {
+            line[0] = '.';
+            line.insert(0, ".");
+        }
+
+        chunk += line + "\r\n";
+        lineNumber++;
+    }
+
+    return chunk;
+}
+
+int connectToServer(const string &serverIp, const int port) {
+    const int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (clientSocket < 0) {
+        cerr << "Failed to create socket." << endl;
+
+        return -1;
+    }
+
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, serverIp.c_str(), &serverAddr.sin_addr) <= 0) {
+        cerr << "Invalid address." << endl;
+
+        close(clientSocket);
+
+        return -1;
+    }
+
+    if (connect(clientSocket, reinterpret_cast<const sockaddr *>(&serverAddr), sizeof(serverAddr)) < 0) {
+        cerr << "Failed to connect to server." << endl;
+
+        close(clientSocket);
+
+        return -1;
+    }
+
+    return clientSocket;
+}
+
+int runDataBenchmark(const string &serverIp, const int port, const size_t messageMegabytes, const int runs,
+                     const bool useBdat) {
+    const string chunk = buildBodyChunk();
+
+    for (int run = 1; run <= runs; run++) {
+        const int clientSocket = connectToServer(serverIp, port);
+        if (clientSocket < 0) {
+            return 1;
+        }
+
+        ReplyReader reader{clientSocket, nullptr, ""};
+
+        if (!reader.expect("220") ||
+            !sendCommand(clientSocket, reader, "HELO bench.example.com\r\n", "250") ||
+            !sendCommand(clientSocket, reader, "MAIL FROM:<bench@example.com>\r\n", "250") ||
+            !sendCommand(clientSocket, reader, "RCPT TO:<sink@example.com>\r\n", "250") ||
+            (!useBdat && !sendCommand(clientSocket, reader, "DATA\r\n", "354"))) {
+            close(clientSocket);
+
+            return 1;
+        }
+
+        const string chunkCommand = "BDAT " + to_string(chunk.size()) + "\r\n";
+        const auto startTime = steady_clock::now();
+
+        size_t bytesSent = 0;
+        for (size_t i = 0; i < messageMegabytes; i++) {
+            if ((useBdat && !sendAll(clientSocket, chunkCommand.data(), chunkCommand.size())) ||
+                !sendAll(clientSocket, chunk.data(), chunk.size())) {
+                close(clientSocket);
+
+                return 1;
+            }
+
+            bytesSent += chunk.size();
+        }
+
+        if (useBdat) {
+            for (size_t i = 0; i < messageMegabytes; i++) {
+                if (!reader.expect("250")) {
+                    close(clientSocket);
+
+                    return 1;
+                }
+            }
+        }
+
+        if (!sendCommand(clientSocket, reader, useBdat ? "BDAT 0 LAST\r\n" : ".\r\n", "250")) {
+            close(clientSocket);
+
+            return 1;
+        }
+
+        const auto duration = duration_cast<microseconds>(steady_clock::now() - startTime);
+        const double megabytes = static_cast<double>(bytesSent) / (1024 * 1024);
+
+        cout << "Run " << run << ": " << megabytes << " MB in " << duration.count() / 1000.0 << " ms, "
+             << megabytes / (duration.count() / 1e6) << " MB/s" << endl;
+
+        sendCommand(clientSocket, reader, "QUIT\r\n", "221");
+        close(clientSocket);
+    }
+
+    return 0;
+}
+
+bool sendMessages(const string &serverIp, const int port, const int messages, const string &body,
+                  atomic<int> &delivered) {
+    const int clientSocket = connectToServer(serverIp, port);
+    if (clientSocket < 0) {
+        return false;
+    }
+
+    ReplyReader reader{clientSocket, nullptr, ""};
+
+    if (!reader.expect("220") || !sendCommand(clientSocket, reader, "HELO bench.example.com\r\n", "250")) {
+        close(clientSocket);
+
+        return false;
+    }
+
+    for (int i = 0; i < messages; i++) {
+        if (!sendCommand(clientSocket, reader, "MAIL FROM:<bench@example.com>\r\n", "250") ||
+            !sendCommand(clientSocket, reader, "RCPT TO:<sink@example.com>\r\n", "250") ||
+            !sendCommand(clientSocket, reader, "DATA\r\n", "354") ||
+            !sendCommand(clientSocket, reader, body, "250")) {
+            close(clientSocket);
+
+            return false;
+        }
+
+        delivered++;
+    }
+
+    sendCommand(clientSocket, reader, "QUIT\r\n", "221");
+    close(clientSocket);
+
+    return true;
+}
+
+int runSpoolBenchmark(const string &serverIp, const int port, const int sessions, const int messagesPerSession,
+                      const size_t messageBytes) {
+    string body = "Subject: spool benchmark\r\n\r\n";
+    while (body.size() < messageBytes) {
+        body += string(LINE_LENGTH, 'x') + "\r\n";
+    }
+    body += ".\r\n";
+
+    atomic<int> delivered{0};
+    atomic<int> failedSessions{0};
+    vector<thread> workers;
+
+    const auto startTime = steady_clock::now();
+
+    for (int i = 0; i < sessions; i++) {
+        workers.emplace_back([&] {
+            if (!sendMessages(serverIp, port, messagesPerSession, body, delivered)) {
+                failedSessions++;
+            }
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    const auto duration = duration_cast<microseconds>(steady_clock::now() - startTime);
+
+    cout << sessions << " sessions, " << delivered << " messages of " << body.size() << " bytes in "
+         << duration.count() / 1000.0 << " ms: " << delivered / (duration.count() / 1e6) << " messages/s" << endl;
+
+    if (failedSessions > 0) {
+        cerr << failedSessions << " session(s) failed." << endl;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+int runTlsBenchmark(const string &serverIp, const int port, const int connections) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == nullptr) {
+        ERR_print_errors_fp(stderr);
+
+        return 1;
+    }
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+    SSL_SESSION *session = nullptr;
+    int resumed = 0;
+    double handshakeMicros = 0;
+
+    const auto startTime = steady_clock::now();
+
+    for (int i = 0; i < connections; i++) {
+        const int clientSocket = connectToServer(serverIp, port);
+        if (clientSocket < 0) {
+            SSL_CTX_free(ctx);
+
+            return 1;
+        }
+
+        ReplyReader reader{clientSocket, nullptr, ""};
+
+        if (!reader.expect("220") ||
+            !sendCommand(clientSocket, reader, "HELO bench.example.com\r\n", "250") ||
+            !sendCommand(clientSocket, reader, "STARTTLS\r\n", "220")) {
+            close(clientSocket);
+            SSL_CTX_free(ctx);
+
+            return 1;
+        }
+
+        SSL *ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, clientSocket);
+        if (session != nullptr) {
+            SSL_set_session(ssl, session);
+        }
+
+        const auto handshakeStart = steady_clock::now();
+        if (SSL_connect(ssl) <= 0) {
+            cerr << "TLS handshake failed." << endl;
+            ERR_print_errors_fp(stderr);
+
+            SSL_free(ssl);
+            close(clientSocket);
+            SSL_CTX_free(ctx);
+
+            return 1;
+        }
+        handshakeMicros += duration_cast<microseconds>(steady_clock::now() - handshakeStart).count();
+
+        if (SSL_session_reused(ssl)) {
+            resumed++;
+        }
+
+        reader.ssl = ssl;
+        reader.buffer.clear();
+
+        const string message = "Subject: tls\r\n\r\nover TLS\r\n";
+        const bool delivered =
+                sendCommand(clientSocket, reader, "HELO bench.example.com\r\n", "250") &&
+                sendCommand(clientSocket, reader, "MAIL FROM:<bench@example.com>\r\n", "250") &&
+                sendCommand(clientSocket, reader, "RCPT TO:<sink@example.com>\r\n", "250") &&
+                sendCommand(clientSocket, reader, "BDAT " + to_string(message.size()) + " LAST\r\n" + message, "250") &&
+                sendCommand(clientSocket, reader, "QUIT\r\n", "221");
+
+        if (SSL_SESSION *latest = SSL_get1_session(ssl); latest != nullptr) {
+            if (session != nullptr) {
+                SSL_SESSION_free(session);
+            }
+            session = latest;
+        }
+
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(clientSocket);
+
+        if (!delivered) {
+            cerr << "Session over TLS failed." << endl;
+
+            SSL_CTX_free(ctx);
+
+            return 1;
+        }
+    }
+
+    const auto duration = duration_cast<microseconds>(steady_clock::now() - startTime);
+
+    cout << connections << " STARTTLS sessions in " << duration.count() / 1000.0 << " ms: "
+         << connections / (duration.count() / 1e6) << " sessions/s, " << resumed << " resumed ("
+         << 100.0 * resumed / connections << "%), average handshake " << handshakeMicros / connections << " us"
+         << endl;
+
+    if (session != nullptr) {
+        SSL_SESSION_free(session);
+    }
+    SSL_CTX_free(ctx);
+
+    return 0;
+}
+
+int main(const int argc, char *argv[]) {
+    const string mode = argc > 1 ? argv[1] : "data";
+    const string serverIp = argc > 2 ? argv[2] : "127.0.0.1";
+    const int port = argc > 3 ? stoi(argv[3]) : 2525;
+
+    if (mode == "data" || mode == "bdat") {
+        const size_t messageMegabytes = argc > 4 ? stoul(argv[4]) : 50;
+        const int runs = argc > 5 ? stoi(argv[5]) : 3;
+
+        cout << "Sending " << runs << " x " << messageMegabytes << " MB messages with " << (mode == "bdat" ? "BDAT" : "DATA")
+             << " to " << serverIp << ":" << port << endl;
+
+        return runDataBenchmark(serverIp, port, messageMegabytes, runs, mode == "bdat");
+    }
+
+    if (mode == "spool") {
+        const int sessions = argc > 4 ? stoi(argv[4]) : 64;
+        const int messagesPerSession = argc > 5 ? stoi(argv[5]) : 100;
+        const size_t messageBytes = argc > 6 ? stoul(argv[6]) : 2048;
+
+        return runSpoolBenchmark(serverIp, port, sessions, messagesPerSession, messageBytes);
+    }
+
+    if (mode == "tls") {
+        const int connections = argc > 4 ? stoi(argv[4]) : 200;
+
+        return runTlsBenchmark(serverIp, port, connections);
+    }
+
+    cerr << "Usage: " << argv[0] << " data|bdat [ip] [port] [megabytes] [runs]" << endl;
+    cerr << "       " << argv[0] << " spool [ip] [port] [sessions] [messages] [bytes]" << endl;
+    cerr << "       " << argv[0] << " tls [ip] [port] [connections]" << endl;
+
+    return 1;
+}
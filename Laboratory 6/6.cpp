@@ -7,49 +7,58 @@
 #include <cstring>
 #include <vector>
 #include <sstream>
+#include "../Common/base64.h"
 
 using namespace std;
 
 constexpr size_t BUFFER_SIZE = 1024;
 
-string base64Encode(const vector<unsigned char> &input) {
-    static const string base64Chars =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    string output;
+string encodeString(const string &str) {
+    return base64Encode(str);
+}
 
-    int val = 0, valb = -6;
-    for (const unsigned char c: input) {
-        val = (val << 8) + c;
-        valb += 8;
+struct ReplyReader {
+    string pending;
+
+    bool readLine(const int sock, string &line) {
+        size_t lineEnd;
+        while ((lineEnd = pending.find("\r\n")) == string::npos) {
+            char chunk[BUFFER_SIZE];
+            const ssize_t bytesReceived = recv(sock, chunk, sizeof(chunk), 0);
+            if (bytesReceived <= 0) {
+                return false;
+            }
 
-        while (valb >= 0) {
-            output.push_back(base64Chars[(val >> valb) & 0x3F]);
-            valb -= 6;
+            pending.append(chunk, bytesReceived);
         }
-    }
 
-    if (valb > -6) {
-        output.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    }
+        line = pending.substr(0, lineEnd + 2);
+        pending.erase(0, lineEnd + 2);
 
-    while (output.size() % 4) {
-        output.push_back('=');
+        return true;
     }
 
-    return output;
-}
+    int readReply(const int sock, string &reply) {
+        reply.clear();
 
-string encodeString(const string &str) {
-    vector<unsigned char> data;
+        string line;
+        do {
+            if (!readLine(sock, line) || line.size() < 5) {
+                cerr << "Failed to receive response." << endl;
 
-    for (const char c: str) {
-        data.push_back(static_cast<unsigned char>(c));
-    }
+                return -1;
+            }
 
-    return base64Encode(data);
-}
+            reply += line;
+        } while (line[3] == '-');
+
+        cout << "S: " << reply;
+
+        return stoi(line.substr(0, 3));
+    }
+};
 
-bool sendCommand(const int sock, const string &command, char *buffer, const size_t bufferSize) {
+bool sendCommand(const int sock, const string &command, ReplyReader &reader, string &reply) {
     cout << "C: " << command;
 
     if (send(sock, command.c_str(), command.length(), 0) < 0) {
@@ -58,18 +67,48 @@ bool sendCommand(const int sock, const string &command, char *buffer, const size
         return false;
     }
 
-    memset(buffer, 0, bufferSize);
-    if (const ssize_t bytesReceived = recv(sock, buffer, bufferSize - 1, 0); bytesReceived < 0) {
-        cerr << "Failed to receive response." << endl;
+    const int responseCode = reader.readReply(sock, reply);
+
+    return (responseCode >= 200 && responseCode < 400);
+}
+
+bool sendEnvelope(const int sock, const vector<string> &commands, const bool pipelining, ReplyReader &reader,
+                  string &reply) {
+    if (!pipelining) {
+        for (const auto &command : commands) {
+            if (!sendCommand(sock, command, reader, reply)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    string batch;
+    for (const auto &command : commands) {
+        cout << "C: " << command;
+        batch += command;
+    }
+
+    if (send(sock, batch.c_str(), batch.length(), 0) < 0) {
+        cerr << "Failed to send command." << endl;
 
         return false;
     }
 
-    cout << "S: " << buffer;
+    bool accepted = true;
+    for (size_t i = 0; i < commands.size(); i++) {
+        const int responseCode = reader.readReply(sock, reply);
+        if (responseCode < 0) {
+            return false;
+        }
 
-    const int responseCode = stoi(string(buffer, 3));
+        if (responseCode >= 400) {
+            accepted = false;
+        }
+    }
 
-    return (responseCode >= 200 && responseCode < 400);
+    return accepted;
 }
 
 string getInput(const string &prompt) {
@@ -172,71 +211,52 @@ int main() {
 
     cout << "Connected to " << server << ":" << port << endl;
 
-    char buffer[BUFFER_SIZE] = {};
+    ReplyReader reader;
+    string reply;
 
-    if (const ssize_t bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0); bytesReceived < 0) {
+    if (reader.readReply(clientSocket, reply) < 0) {
         cerr << "Failed to receive greeting." << endl;
 
         close(clientSocket);
 
         return 1;
     }
-    cout << "S: " << buffer;
-
-    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
-
-        return 1;
-    }
 
-    if (!sendCommand(clientSocket, "STARTTLS\r\n", buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, "STARTTLS\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    if (!sendCommand(clientSocket, "AUTH LOGIN\r\n", buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    if (!sendCommand(clientSocket, encodedUsername + "\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
-
-        return 1;
-    }
+    const bool chunkingSupported = reply.find("CHUNKING") != string::npos;
+    const bool pipeliningSupported = reply.find("PIPELINING") != string::npos;
 
-    if (!sendCommand(clientSocket, encodedPassword + "\r\n", buffer, BUFFER_SIZE)) {
-        cerr << "Authentication failed. Check your email and password." << endl;
+    if (!sendCommand(clientSocket, "AUTH LOGIN\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    if (const string mailFrom = "MAIL FROM:<" + sender + ">\r\n"; !sendCommand(
-        clientSocket, mailFrom, buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, encodedUsername + "\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    for (const auto &recipient: recipients) {
-        if (const string rcptTo = "RCPT TO:<" + recipient + ">\r\n"; !
-            sendCommand(clientSocket, rcptTo, buffer, BUFFER_SIZE)) {
-            close(clientSocket);
-
-            return 1;
-        }
-    }
-
-    if (!sendCommand(clientSocket, "DATA\r\n", buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, encodedPassword + "\r\n", reader, reply)) {
+        cerr << "Authentication failed. Check your email and password." << endl;
         close(clientSocket);
 
         return 1;
@@ -256,15 +276,27 @@ int main() {
     message += "Subject: " + subject + "\r\n";
     message += "\r\n";
     message += body;
-    message += "\r\n.\r\n";
+    message += "\r\n";
+
+    vector<string> envelope = {"MAIL FROM:<" + sender + ">\r\n"};
+    for (const auto &recipient: recipients) {
+        envelope.push_back("RCPT TO:<" + recipient + ">\r\n");
+    }
+    envelope.push_back(chunkingSupported ? "BDAT " + to_string(message.length()) + " LAST\r\n" + message : "DATA\r\n");
+
+    if (!sendEnvelope(clientSocket, envelope, pipeliningSupported, reader, reply)) {
+        close(clientSocket);
+
+        return 1;
+    }
 
-    if (!sendCommand(clientSocket, message, buffer, BUFFER_SIZE)) {
+    if (!chunkingSupported && !sendCommand(clientSocket, message + ".\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    sendCommand(clientSocket, "QUIT\r\n", buffer, BUFFER_SIZE);
+    sendCommand(clientSocket, "QUIT\r\n", reader, reply);
 
     close(clientSocket);
 
@@ -8,73 +8,133 @@
 #include <netinet/in.h>
 #include <string>
 #include <fstream>
+#include <filesystem>
 #include <sstream>
+#include "../Common/base64.h"
 
 using namespace std;
 
 constexpr size_t BUFFER_SIZE = 1024;
+constexpr size_t ATTACHMENT_BLOCK_SIZE = 57 * 4096;
 
-string base64Encode(const vector<unsigned char> &input) {
-    static const string base64Chars =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    string output;
+string encodeString(const string &str) {
+    return base64Encode(str);
+}
 
-    int val = 0, valb = -6;
-    for (const unsigned char c : input) {
-        val = (val << 8) + c;
-        valb += 8;
+bool getFileSize(const string &filePath, uint64_t &fileSize) {
+    error_code error;
+    fileSize = filesystem::file_size(filePath, error);
+    if (error) {
+        cerr << "Failed to open file: " << filePath << endl;
 
-        while (valb >= 0) {
-            output.push_back(base64Chars[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
+        return false;
     }
 
-    if (valb > -6) {
-        output.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    }
+    return true;
+}
 
-    while (output.size() % 4) {
-        output.push_back('=');
-    }
+bool sendAll(const int sock, const char *data, size_t length) {
+    while (length > 0) {
+        const ssize_t bytesSent = send(sock, data, length, MSG_NOSIGNAL);
+        if (bytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-    return output;
-}
+            cerr << "Failed to send data." << endl;
 
-string encodeString(const string &str) {
-    vector<unsigned char> data;
+            return false;
+        }
 
-    for (const char c : str) {
-        data.push_back(static_cast<unsigned char>(c));
+        data += bytesSent;
+        length -= bytesSent;
     }
 
-    return base64Encode(data);
+    return true;
 }
 
-string readFileToBase64(const string &filePath) {
+bool streamAttachmentBase64(const int sock, const string &filePath, const uint64_t fileSize) {
     ifstream file(filePath, ios::binary);
     if (!file) {
         cerr << "Failed to open file: " << filePath << endl;
 
-        return "";
+        return false;
     }
 
-    vector<unsigned char> fileData;
-    char byte;
-    while (file.get(byte)) {
-        fileData.push_back(static_cast<unsigned char>(byte));
+    vector<unsigned char> input(ATTACHMENT_BLOCK_SIZE);
+    vector<char> output(base64MimeEncodedLength(ATTACHMENT_BLOCK_SIZE));
+    uint64_t bytesEncoded = 0;
+
+    while (file) {
+        file.read(reinterpret_cast<char *>(input.data()), static_cast<streamsize>(input.size()));
+        const size_t bytesRead = file.gcount();
+
+        const size_t encodedLength = base64EncodeMimeInto(input.data(), bytesRead, output.data());
+
+        if (!sendAll(sock, output.data(), encodedLength)) {
+            return false;
+        }
+
+        bytesEncoded += bytesRead;
     }
 
-    file.close();
+    if (bytesEncoded != fileSize) {
+        cerr << "Attachment changed while it was being sent: " << filePath << endl;
 
-    return base64Encode(fileData);
+        return false;
+    }
+
+    cout << "C: [" << base64MimeEncodedLength(fileSize) << " bytes of base64 attachment data]" << endl;
+
+    return true;
 }
 
 string generateBoundary() {
     return "------------BOUNDARY_STRING_" + to_string(time(nullptr));
 }
 
-bool sendCommand(const int sock, const string &command, char *buffer, const size_t bufferSize) {
+struct ReplyReader {
+    string pending;
+
+    bool readLine(const int sock, string &line) {
+        size_t lineEnd;
+        while ((lineEnd = pending.find("\r\n")) == string::npos) {
+            char chunk[BUFFER_SIZE];
+            const ssize_t bytesReceived = recv(sock, chunk, sizeof(chunk), 0);
+            if (bytesReceived <= 0) {
+                return false;
+            }
+
+            pending.append(chunk, bytesReceived);
+        }
+
+        line = pending.substr(0, lineEnd + 2);
+        pending.erase(0, lineEnd + 2);
+
+        return true;
+    }
+
+    int readReply(const int sock, string &reply) {
+        reply.clear();
+
+        string line;
+        do {
+            if (!readLine(sock, line) || line.size() < 5) {
+                cerr << "Failed to receive response." << endl;
+
+                return -1;
+            }
+
+            reply += line;
+        } while (line[3] == '-');
+
+        cout << "S: " << reply;
+
+        return stoi(line.substr(0, 3));
+    }
+};
+
+bool sendCommand(const int sock, const string &command, ReplyReader &reader, string &reply) {
     cout << "C: " << command;
 
     if (send(sock, command.c_str(), command.length(), 0) < 0) {
@@ -83,18 +143,48 @@ bool sendCommand(const int sock, const string &command, char *buffer, const size
         return false;
     }
 
-    memset(buffer, 0, bufferSize);
-    if (const ssize_t bytesReceived = recv(sock, buffer, bufferSize - 1, 0); bytesReceived < 0) {
-        cerr << "Failed to receive response." << endl;
+    const int responseCode = reader.readReply(sock, reply);
+
+    return (responseCode >= 200 && responseCode < 400);
+}
+
+bool sendEnvelope(const int sock, const vector<string> &commands, const bool pipelining, ReplyReader &reader,
+                  string &reply) {
+    if (!pipelining) {
+        for (const auto &command : commands) {
+            if (!sendCommand(sock, command, reader, reply)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    string batch;
+    for (const auto &command : commands) {
+        cout << "C: " << command;
+        batch += command;
+    }
+
+    if (send(sock, batch.c_str(), batch.length(), 0) < 0) {
+        cerr << "Failed to send command." << endl;
 
         return false;
     }
 
-    cout << "S: " << buffer;
+    bool accepted = true;
+    for (size_t i = 0; i < commands.size(); i++) {
+        const int responseCode = reader.readReply(sock, reply);
+        if (responseCode < 0) {
+            return false;
+        }
 
-    const int responseCode = stoi(string(buffer, 3));
+        if (responseCode >= 400) {
+            accepted = false;
+        }
+    }
 
-    return (responseCode >= 200 && responseCode < 400);
+    return accepted;
 }
 
 string getInput(const string &prompt) {
@@ -175,8 +265,8 @@ int main() {
     string attachmentName = getFilename(attachmentPath);
 
     cout << "Reading attachment file..." << endl;
-    const string base64Attachment = readFileToBase64(attachmentPath);
-    if (base64Attachment.empty()) {
+    uint64_t attachmentSize = 0;
+    if (!getFileSize(attachmentPath, attachmentSize)) {
         cerr << "Failed to read attachment file. Aborting." << endl;
 
         return 1;
@@ -221,72 +311,53 @@ int main() {
 
     cout << "Connected to " << server << ":" << port << endl;
 
-    char buffer[BUFFER_SIZE] = {};
+    ReplyReader reader;
+    string reply;
 
-    if (const ssize_t bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0); bytesReceived < 0) {
+    if (reader.readReply(clientSocket, reply) < 0) {
         cerr << "Failed to receive greeting." << endl;
 
         close(clientSocket);
 
         return 1;
     }
-    cout << "S: " << buffer;
 
-    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    if (!sendCommand(clientSocket, "STARTTLS\r\n", buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, "STARTTLS\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    if (!sendCommand(clientSocket, "AUTH LOGIN\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    const bool chunkingSupported = reply.find("CHUNKING") != string::npos;
+    const bool pipeliningSupported = reply.find("PIPELINING") != string::npos;
 
-        return 1;
-    }
-
-    if (!sendCommand(clientSocket, encodedUsername + "\r\n", buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, "AUTH LOGIN\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    if (!sendCommand(clientSocket, encodedPassword + "\r\n", buffer, BUFFER_SIZE)) {
-        cerr << "Authentication failed. Check your email and password." << endl;
-
-        close(clientSocket);
-
-        return 1;
-    }
-
-    if (const string mailFrom = "MAIL FROM:<" + sender + ">\r\n"; !sendCommand(
-        clientSocket, mailFrom, buffer, BUFFER_SIZE)) {
+    if (!sendCommand(clientSocket, encodedUsername + "\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    for (const auto &recipient : recipients) {
-        if (const string rcptTo = "RCPT TO:<" + recipient + ">\r\n"; !
-            sendCommand(clientSocket, rcptTo, buffer, BUFFER_SIZE)) {
-            close(clientSocket);
-
-            return 1;
-        }
-    }
+    if (!sendCommand(clientSocket, encodedPassword + "\r\n", reader, reply)) {
+        cerr << "Authentication failed. Check your email and password." << endl;
 
-    if (!sendCommand(clientSocket, "DATA\r\n", buffer, BUFFER_SIZE)) {
         close(clientSocket);
 
         return 1;
@@ -321,21 +392,37 @@ int main() {
     message += "Content-Disposition: attachment; filename=\"" + attachmentName + "\"\r\n";
     message += "\r\n";
 
-    for (size_t i = 0; i < base64Attachment.length(); i += 76) {
-        message += base64Attachment.substr(i, 76) + "\r\n";
+    string messageEnd = "\r\n";
+    messageEnd += "--" + boundary + "--\r\n";
+
+    const uint64_t messageLength = message.length() + base64MimeEncodedLength(attachmentSize) + messageEnd.length();
+
+    vector<string> envelope = {"MAIL FROM:<" + sender + ">\r\n"};
+    for (const auto &recipient: recipients) {
+        envelope.push_back("RCPT TO:<" + recipient + ">\r\n");
+    }
+    if (!chunkingSupported) {
+        envelope.push_back("DATA\r\n");
     }
 
-    message += "\r\n";
-    message += "--" + boundary + "--\r\n";
-    message += ".\r\n";
+    if (!sendEnvelope(clientSocket, envelope, pipeliningSupported, reader, reply)) {
+        close(clientSocket);
+
+        return 1;
+    }
+
+    const string head = chunkingSupported ? "BDAT " + to_string(messageLength) + " LAST\r\n" + message : message;
+    cout << "C: " << head;
 
-    if (!sendCommand(clientSocket, message, buffer, BUFFER_SIZE)) {
+    if (!sendAll(clientSocket, head.c_str(), head.length()) ||
+        !streamAttachmentBase64(clientSocket, attachmentPath, attachmentSize) ||
+        !sendCommand(clientSocket, chunkingSupported ? messageEnd : messageEnd + ".\r\n", reader, reply)) {
         close(clientSocket);
 
         return 1;
     }
 
-    sendCommand(clientSocket, "QUIT\r\n", buffer, BUFFER_SIZE);
+    sendCommand(clientSocket, "QUIT\r\n", reader, reply);
 
     close(clientSocket);
 
@@ -8,66 +8,85 @@
 #include <netinet/in.h>
 #include <string>
 #include <fstream>
+#include <filesystem>
 #include <sstream>
+#include "../Common/base64.h"
 
 using namespace std;
 
 constexpr size_t BUFFER_SIZE = 1024;
+constexpr size_t ATTACHMENT_BLOCK_SIZE = 57 * 4096;
 
-string base64Encode(const vector<unsigned char> &input) {
-    static const string base64Chars =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    string output;
+string encodeString(const string &str) {
+    return base64Encode(str);
+}
 
-    int val = 0, valb = -6;
-    for (const unsigned char c : input) {
-        val = (val << 8) + c;
-        valb += 8;
+bool getFileSize(const string &filePath, uint64_t &fileSize) {
+    error_code error;
+    fileSize = filesystem::file_size(filePath, error);
+    if (error) {
+        cerr << "Failed to open file: " << filePath << endl;
 
-        while (valb >= 0) {
-            output.push_back(base64Chars[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
+        return false;
     }
 
-    if (valb > -6) {
-        output.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    }
+    return true;
+}
 
-    while (output.size() % 4) {
-        output.push_back('=');
-    }
+bool sendAll(const int sock, const char *data, size_t length) {
+    while (length > 0) {
+        const ssize_t bytesSent = send(sock, data, length, MSG_NOSIGNAL);
+        if (bytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-    return output;
-}
+            cerr << "Failed to send data." << endl;
 
-string encodeString(const string &str) {
-    vector<unsigned char> data;
+            return false;
+        }
 
-    for (const char c : str) {
-        data.push_back(static_cast<unsigned char>(c));
+        data += bytesSent;
+        length -= bytesSent;
     }
 
-    return base64Encode(data);
+    return true;
 }
 
-string readFileToBase64(const string &filePath) {
+bool streamAttachmentBase64(const int sock, const string &filePath, const uint64_t fileSize) {
     ifstream file(filePath, ios::binary);
     if (!file) {
         cerr << "Failed to open file: " << filePath << endl;
 
-        return "";
+        return false;
     }
 
-    vector<unsigned char> fileData;
-    char byte;
-    while (file.get(byte)) {
-        fileData.push_back(static_cast<unsigned char>(byte));
+    vector<unsigned char> input(ATTACHMENT_BLOCK_SIZE);
+    vector<char> output(base64MimeEncodedLength(ATTACHMENT_BLOCK_SIZE));
+    uint64_t bytesEncoded = 0;
+
+    while (file) {
+        file.read(reinterpret_cast<char *>(input.data()), static_cast<streamsize>(input.size()));
+        const size_t bytesRead = file.gcount();
+
+        const size_t encodedLength = base64EncodeMimeInto(input.data(), bytesRead, output.data());
+
+        if (!sendAll(sock, output.data(), encodedLength)) {
+            return false;
+        }
+
+        bytesEncoded += bytesRead;
     }
 
-    file.close();
+    if (bytesEncoded != fileSize) {
+        cerr << "Attachment changed while it was being sent: " << filePath << endl;
 
-    return base64Encode(fileData);
+        return false;
+    }
+
+    cout << "C: [" << base64MimeEncodedLength(fileSize) << " bytes of base64 attachment data]" << endl;
+
+    return true;
 }
 
 string getFileExtension(const string &filename) {
@@ -214,8 +233,8 @@ int main() {
     }
 
     cout << "Reading image file..." << endl;
-    const string base64Attachment = readFileToBase64(attachmentPath);
-    if (base64Attachment.empty()) {
+    uint64_t attachmentSize = 0;
+    if (!getFileSize(attachmentPath, attachmentSize)) {
         cerr << "Failed to read image file. Aborting." << endl;
 
         return 1;
@@ -289,6 +308,8 @@ int main() {
         return 1;
     }
 
+    const bool chunkingSupported = strstr(buffer, "CHUNKING") != nullptr;
+
     if (!sendCommand(clientSocket, "AUTH LOGIN\r\n", buffer, BUFFER_SIZE)) {
         close(clientSocket);
 
@@ -325,12 +346,6 @@ int main() {
         }
     }
 
-    if (!sendCommand(clientSocket, "DATA\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
-
-        return 1;
-    }
-
     string message = "From: " + sender + "\r\n";
     message += "To: ";
 
@@ -361,18 +376,38 @@ int main() {
     message += "Content-Disposition: attachment; filename=\"" + attachmentName + "\"\r\n";
     message += "\r\n";
 
-    for (size_t i = 0; i < base64Attachment.length(); i += 76) {
-        message += base64Attachment.substr(i, 76) + "\r\n";
-    }
+    string messageEnd = "\r\n";
+    messageEnd += "--" + boundary + "--\r\n";
 
-    message += "\r\n";
-    message += "--" + boundary + "--\r\n";
-    message += ".\r\n";
+    const uint64_t messageLength = message.length() + base64MimeEncodedLength(attachmentSize) + messageEnd.length();
 
-    if (!sendCommand(clientSocket, message, buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    if (chunkingSupported) {
+        const string bdat = "BDAT " + to_string(messageLength) + " LAST\r\n";
+        cout << "C: " << bdat << message;
 
-        return 1;
+        if (!sendAll(clientSocket, (bdat + message).c_str(), bdat.length() + message.length()) ||
+            !streamAttachmentBase64(clientSocket, attachmentPath, attachmentSize) ||
+            !sendCommand(clientSocket, messageEnd, buffer, BUFFER_SIZE)) {
+            close(clientSocket);
+
+            return 1;
+        }
+    } else {
+        if (!sendCommand(clientSocket, "DATA\r\n", buffer, BUFFER_SIZE)) {
+            close(clientSocket);
+
+            return 1;
+        }
+
+        cout << "C: " << message;
+
+        if (!sendAll(clientSocket, message.c_str(), message.length()) ||
+            !streamAttachmentBase64(clientSocket, attachmentPath, attachmentSize) ||
+            !sendCommand(clientSocket, messageEnd + ".\r\n", buffer, BUFFER_SIZE)) {
+            close(clientSocket);
+
+            return 1;
+        }
     }
 
     sendCommand(clientSocket, "QUIT\r\n", buffer, BUFFER_SIZE);
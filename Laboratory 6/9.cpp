@@ -7,69 +7,186 @@
 #include <cstring>
 #include <vector>
 #include <sstream>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <algorithm>
+#include <sys/uio.h>
+#include "../Common/base64.h"
 
 using namespace std;
 
 constexpr size_t BUFFER_SIZE = 1024;
+constexpr int BULK_SESSIONS = 4;
+
+struct ReplyReader {
+    string pending;
+
+    bool readLine(const int sock, string &line) {
+        size_t lineEnd;
+        while ((lineEnd = pending.find("\r\n")) == string::npos) {
+            char chunk[BUFFER_SIZE];
+            const ssize_t bytesReceived = recv(sock, chunk, sizeof(chunk), 0);
+            if (bytesReceived <= 0) {
+                return false;
+            }
 
-string base64Encode(const vector<unsigned char> &input) {
-    static const string base64Chars =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    string output;
+            pending.append(chunk, bytesReceived);
+        }
 
-    int val = 0, valb = -6;
-    for (const unsigned char c: input) {
-        val = (val << 8) + c;
-        valb += 8;
+        line = pending.substr(0, lineEnd + 2);
+        pending.erase(0, lineEnd + 2);
 
-        while (valb >= 0) {
-            output.push_back(base64Chars[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
+        return true;
     }
 
-    if (valb > -6) {
-        output.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    }
+    int readReply(const int sock, string &reply) {
+        reply.clear();
 
-    while (output.size() % 4) {
-        output.push_back('=');
-    }
+        string line;
+        do {
+            if (!readLine(sock, line) || line.size() < 5) {
+                cerr << "Failed to receive response." << endl;
 
-    return output;
-}
+                return -1;
+            }
 
-string encodeString(const string &str) {
-    vector<unsigned char> data;
+            reply += line;
+        } while (line[3] == '-');
 
-    for (const char c: str) {
-        data.push_back(static_cast<unsigned char>(c));
+        cout << "S: " << reply;
+
+        return stoi(line.substr(0, 3));
     }
+};
+
+struct SmtpSession {
+    int socket = -1;
+    ReplyReader reader;
+    string reply;
+    bool chunking = false;
+    bool pipelining = false;
+};
+
+struct MailMerge {
+    string sender;
+    string boundary;
+    vector<string> columns;
+    vector<vector<string> > rows;
+    size_t emailColumn = 0;
+
+    vector<string> subjectLiterals;
+    vector<int> subjectFields;
+    vector<string> bodyLiterals;
+    vector<string> stuffedBodyLiterals;
+    vector<int> bodyFields;
+
+    string sharedHead;
+    string sharedTail;
+};
 
-    return base64Encode(data);
+string encodeString(const string &str) {
+    return base64Encode(str);
 }
 
-bool sendCommand(const int sock, const string &command, char *buffer, const size_t bufferSize) {
+bool sendCommand(SmtpSession &session, const string &command) {
     cout << "C: " << command;
 
-    if (send(sock, command.c_str(), command.length(), 0) < 0) {
+    if (send(session.socket, command.c_str(), command.length(), 0) < 0) {
         cerr << "Failed to send command." << endl;
 
         return false;
     }
 
-    memset(buffer, 0, bufferSize);
-    if (const ssize_t bytesReceived = recv(sock, buffer, bufferSize - 1, 0); bytesReceived < 0) {
-        cerr << "Failed to receive response." << endl;
+    const int responseCode = session.reader.readReply(session.socket, session.reply);
+
+    return (responseCode >= 200 && responseCode < 400);
+}
+
+bool openSession(SmtpSession &session, const string &server, const int port, const string &encodedUsername,
+                 const string &encodedPassword) {
+    session.socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (session.socket < 0) {
+        cerr << "Failed to create socket." << endl;
+
+        return false;
+    }
+
+    const hostent *host = gethostbyname(server.c_str());
+    if (!host) {
+        cerr << "Failed to resolve hostname." << endl;
+
+        close(session.socket);
 
         return false;
     }
 
-    cout << "S: " << buffer;
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
+    memcpy(&serverAddr.sin_addr, host->h_addr, host->h_length);
 
-    const int responseCode = stoi(string(buffer, 3));
+    if (connect(session.socket, reinterpret_cast<const sockaddr *>(&serverAddr), sizeof(serverAddr)) < 0) {
+        cerr << "Failed to connect to server." << endl;
 
-    return (responseCode >= 200 && responseCode < 400);
+        close(session.socket);
+
+        return false;
+    }
+
+    cout << "Connected to " << server << ":" << port << endl;
+
+    if (session.reader.readReply(session.socket, session.reply) < 0) {
+        cerr << "Failed to receive greeting." << endl;
+
+        close(session.socket);
+
+        return false;
+    }
+
+    if (!sendCommand(session, "EHLO client.example.com\r\n")) {
+        close(session.socket);
+
+        return false;
+    }
+
+    if (!sendCommand(session, "STARTTLS\r\n")) {
+        close(session.socket);
+
+        return false;
+    }
+
+    if (!sendCommand(session, "EHLO client.example.com\r\n")) {
+        close(session.socket);
+
+        return false;
+    }
+
+    session.chunking = session.reply.find("CHUNKING") != string::npos;
+    session.pipelining = session.reply.find("PIPELINING") != string::npos;
+
+    if (!sendCommand(session, "AUTH LOGIN\r\n")) {
+        close(session.socket);
+
+        return false;
+    }
+
+    if (!sendCommand(session, encodedUsername + "\r\n")) {
+        close(session.socket);
+
+        return false;
+    }
+
+    if (!sendCommand(session, encodedPassword + "\r\n")) {
+        cerr << "Authentication failed. Check your email and password." << endl;
+        close(session.socket);
+
+        return false;
+    }
+
+    return true;
 }
 
 string getInput(const string &prompt) {
@@ -151,135 +268,463 @@ string getSampleHTMLMessage() {
     return exampleHTML;
 }
 
-int main() {
-    const string server = "smtp.interia.pl";
-    constexpr int port = 587;
-
-    const string sender = getInput("Enter sender email: ");
-    const string password = getInput("Enter password: ");
-
-    const vector<string> recipients = getRecipients();
-    if (recipients.empty()) {
-        cerr << "No valid recipients provided." << endl;
-        return 1;
-    }
-
-    const string subject = getInput("Enter subject: ");
-
+string chooseHTMLBody() {
     cout << "Do you want to use a sample HTML message? (y/n): ";
     string useSample;
     getline(cin, useSample);
 
-    string htmlBody;
     if (useSample == "y" || useSample == "Y") {
-        htmlBody = getSampleHTMLMessage();
         cout << "Using sample HTML message." << endl;
-    } else {
-        htmlBody = getHTMLMessageBody();
+
+        return getSampleHTMLMessage();
     }
 
-    const string encodedUsername = encodeString(sender);
-    const string encodedPassword = encodeString(password);
+    return getHTMLMessageBody();
+}
 
-    cout << "Connecting to " << server << ":" << port << "..." << endl;
+string generateBoundary() {
+    return "------------BOUNDARY_STRING_" + to_string(time(nullptr));
+}
 
-    const int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (clientSocket < 0) {
-        cerr << "Failed to create socket." << endl;
+vector<string> parseCsvLine(const string &line) {
+    vector<string> fields(1);
+    bool quoted = false;
+
+    for (size_t i = 0; i < line.length(); i++) {
+        const char c = line[i];
+
+        if (quoted) {
+            if (c == '"' && i + 1 < line.length() && line[i + 1] == '"') {
+                fields.back() += '"';
+                i++;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                fields.back() += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.emplace_back();
+        } else if (c != '\r' && c != '\n') {
+            fields.back() += c;
+        }
+    }
 
-        return 1;
+    for (auto &field : fields) {
+        const size_t start = field.find_first_not_of(" \t");
+        field = start == string::npos ? "" : field.substr(start, field.find_last_not_of(" \t") - start + 1);
     }
 
-    const hostent *host = gethostbyname(server.c_str());
-    if (!host) {
-        cerr << "Failed to resolve hostname." << endl;
+    return fields;
+}
 
-        close(clientSocket);
+bool loadRecipients(const string &path, MailMerge &merge) {
+    ifstream file(path);
+    if (!file) {
+        cerr << "Failed to open recipient list: " << path << endl;
 
-        return 1;
+        return false;
     }
 
-    sockaddr_in serverAddr = {};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(port);
-    memcpy(&serverAddr.sin_addr, host->h_addr, host->h_length);
+    string line;
+    if (!getline(file, line)) {
+        cerr << "Recipient list is empty." << endl;
 
-    if (connect(clientSocket, reinterpret_cast<const sockaddr *>(&serverAddr), sizeof(serverAddr)) < 0) {
-        cerr << "Failed to connect to server." << endl;
+        return false;
+    }
 
-        close(clientSocket);
+    merge.columns = parseCsvLine(line);
 
-        return 1;
+    const auto emailColumn = find(merge.columns.begin(), merge.columns.end(), "email");
+    if (emailColumn == merge.columns.end()) {
+        cerr << "Recipient list needs an \"email\" column." << endl;
+
+        return false;
     }
+    merge.emailColumn = emailColumn - merge.columns.begin();
 
-    cout << "Connected to " << server << ":" << port << endl;
+    while (getline(file, line)) {
+        vector<string> row = parseCsvLine(line);
+        row.resize(merge.columns.size());
 
-    char buffer[BUFFER_SIZE] = {};
+        if (!row[merge.emailColumn].empty()) {
+            merge.rows.push_back(std::move(row));
+        }
+    }
 
-    if (const ssize_t bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0); bytesReceived < 0) {
-        cerr << "Failed to receive greeting." << endl;
+    return !merge.rows.empty();
+}
 
-        close(clientSocket);
+string toCrlf(const string &text) {
+    string converted;
+    converted.reserve(text.length() + text.length() / 32);
 
-        return 1;
+    for (size_t i = 0; i < text.length(); i++) {
+        if (text[i] == '\n' && (i == 0 || text[i - 1] != '\r')) {
+            converted += '\r';
+        }
+        converted += text[i];
     }
-    cout << "S: " << buffer;
 
-    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    return converted;
+}
 
-        return 1;
+void splitTemplate(const string &text, const vector<string> &columns, vector<string> &literals, vector<int> &fields) {
+    size_t position = 0;
+    literals.emplace_back();
+
+    while (true) {
+        const size_t open = text.find("{{", position);
+        const size_t closeBraces = open == string::npos ? string::npos : text.find("}}", open + 2);
+        if (closeBraces == string::npos) {
+            literals.back() += text.substr(position);
+
+            return;
+        }
+
+        literals.back() += text.substr(position, open - position);
+
+        const string name = text.substr(open + 2, closeBraces - open - 2);
+        const auto column = find(columns.begin(), columns.end(), name);
+        fields.push_back(column == columns.end() ? -1 : static_cast<int>(column - columns.begin()));
+        literals.emplace_back();
+
+        position = closeBraces + 2;
     }
+}
 
-    if (!sendCommand(clientSocket, "STARTTLS\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+bool buildMailMerge(MailMerge &merge, const string &subject, const string &htmlBody,
+                    const vector<string> &attachmentPaths) {
+    splitTemplate(subject, merge.columns, merge.subjectLiterals, merge.subjectFields);
+    splitTemplate(toCrlf(htmlBody), merge.columns, merge.bodyLiterals, merge.bodyFields);
+
+    for (const auto &literal : merge.bodyLiterals) {
+        string stuffed;
+        for (size_t i = 0; i < literal.length(); i++) {
+            stuffed += literal[i];
+            if (literal[i] == '\n' && i + 1 < literal.length() && literal[i + 1] == '.') {
+                stuffed += '.';
+            }
+        }
+        merge.stuffedBodyLiterals.push_back(std::move(stuffed));
+    }
 
-        return 1;
+    merge.sharedHead = "MIME-Version: 1.0\r\n";
+    if (attachmentPaths.empty()) {
+        merge.sharedHead += "Content-Type: text/html; charset=utf-8\r\n\r\n";
+        merge.sharedTail = "\r\n";
+
+        return true;
+    }
+
+    merge.boundary = generateBoundary();
+    merge.sharedHead += "Content-Type: multipart/mixed; boundary=\"" + merge.boundary + "\"\r\n\r\n";
+    merge.sharedHead += "--" + merge.boundary + "\r\n";
+    merge.sharedHead += "Content-Type: text/html; charset=utf-8\r\n\r\n";
+
+    merge.sharedTail = "\r\n";
+    for (const auto &path : attachmentPaths) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            cerr << "Failed to open file: " << path << endl;
+
+            return false;
+        }
+
+        const string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        const string name = path.substr(path.find_last_of("/\\") + 1);
+
+        merge.sharedTail += "--" + merge.boundary + "\r\n";
+        merge.sharedTail += "Content-Type: application/octet-stream; name=\"" + name + "\"\r\n";
+        merge.sharedTail += "Content-Transfer-Encoding: base64\r\n";
+        merge.sharedTail += "Content-Disposition: attachment; filename=\"" + name + "\"\r\n\r\n";
+        merge.sharedTail += base64EncodeMime(data);
+    }
+    merge.sharedTail += "--" + merge.boundary + "--\r\n";
+
+    return true;
+}
+
+string fillTemplate(const vector<string> &literals, const vector<int> &fields, const vector<string> &row) {
+    string filled = literals[0];
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i] >= 0) {
+            filled += row[fields[i]];
+        }
+        filled += literals[i + 1];
+    }
+
+    return filled;
+}
+
+bool writeGathered(const int sock, vector<iovec> &pieces) {
+    size_t first = 0;
+    while (first < pieces.size()) {
+        const int count = static_cast<int>(min<size_t>(pieces.size() - first, IOV_MAX));
+        ssize_t bytesWritten = writev(sock, pieces.data() + first, count);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            cerr << "Failed to send message." << endl;
+
+            return false;
+        }
+
+        while (first < pieces.size() && static_cast<size_t>(bytesWritten) >= pieces[first].iov_len) {
+            bytesWritten -= pieces[first].iov_len;
+            first++;
+        }
+
+        if (first < pieces.size()) {
+            pieces[first].iov_base = static_cast<char *>(pieces[first].iov_base) + bytesWritten;
+            pieces[first].iov_len -= bytesWritten;
+        }
+    }
+
+    return true;
+}
+
+bool readReplies(SmtpSession &session, const size_t count) {
+    bool accepted = true;
+    for (size_t i = 0; i < count; i++) {
+        const int responseCode = session.reader.readReply(session.socket, session.reply);
+        if (responseCode < 0) {
+            return false;
+        }
+
+        if (responseCode >= 400) {
+            accepted = false;
+        }
+    }
+
+    return accepted;
+}
+
+bool sendMergedMessage(SmtpSession &session, const MailMerge &merge, const vector<string> &row) {
+    static const string dot = ".";
+    static const string terminator = ".\r\n";
+
+    const string &email = row[merge.emailColumn];
+    const string header = "From: " + merge.sender + "\r\nTo: " + email + "\r\nSubject: " +
+                          fillTemplate(merge.subjectLiterals, merge.subjectFields, row) + "\r\n";
+    const vector<string> &literals = session.chunking ? merge.bodyLiterals : merge.stuffedBodyLiterals;
+
+    vector<iovec> body;
+    size_t bodyLength = 0;
+    bool atLineStart = true;
+
+    const auto addPiece = [&](const string &piece) {
+        if (piece.empty()) {
+            return;
+        }
+
+        if (!session.chunking && atLineStart && piece[0] == '.') {
+            body.push_back({const_cast<char *>(dot.data()), dot.length()});
+            bodyLength += dot.length();
+        }
+
+        body.push_back({const_cast<char *>(piece.data()), piece.length()});
+        bodyLength += piece.length();
+        atLineStart = piece.back() == '\n';
+    };
+
+    addPiece(header);
+    addPiece(merge.sharedHead);
+    addPiece(literals[0]);
+    for (size_t i = 0; i < merge.bodyFields.size(); i++) {
+        if (merge.bodyFields[i] >= 0) {
+            addPiece(row[merge.bodyFields[i]]);
+        }
+        addPiece(literals[i + 1]);
+    }
+    addPiece(merge.sharedTail);
+
+    if (!session.chunking) {
+        body.push_back({const_cast<char *>(terminator.data()), terminator.length()});
+    }
+
+    const vector<string> envelope = {
+        "MAIL FROM:<" + merge.sender + ">\r\n",
+        "RCPT TO:<" + email + ">\r\n",
+        session.chunking ? "BDAT " + to_string(bodyLength) + " LAST\r\n" : "DATA\r\n"
+    };
+
+    if (session.pipelining) {
+        vector<iovec> commands;
+        for (const auto &command : envelope) {
+            cout << "C: " << command;
+            commands.push_back({const_cast<char *>(command.data()), command.length()});
+        }
+
+        if (session.chunking) {
+            commands.insert(commands.end(), body.begin(), body.end());
+
+            return writeGathered(session.socket, commands) && readReplies(session, envelope.size());
+        }
+
+        if (!writeGathered(session.socket, commands) || !readReplies(session, envelope.size())) {
+            return false;
+        }
+    } else {
+        const size_t serialCommands = session.chunking ? envelope.size() - 1 : envelope.size();
+        for (size_t i = 0; i < serialCommands; i++) {
+            if (!sendCommand(session, envelope[i])) {
+                return false;
+            }
+        }
+
+        if (session.chunking) {
+            cout << "C: " << envelope.back();
+            body.insert(body.begin(), {const_cast<char *>(envelope.back().data()), envelope.back().length()});
+        }
+    }
+
+    return writeGathered(session.socket, body) && readReplies(session, 1);
+}
+
+struct BulkProgress {
+    atomic<size_t> next{0};
+    atomic<size_t> sent{0};
+    atomic<size_t> failed{0};
+};
+
+void runBulkSession(const MailMerge &merge, const string &server, const int port, const string &encodedUsername,
+                    const string &encodedPassword, BulkProgress &progress) {
+    SmtpSession session;
+    if (!openSession(session, server, port, encodedUsername, encodedPassword)) {
+        return;
+    }
+
+    bool needsReset = false;
+    while (true) {
+        const size_t index = progress.next++;
+        if (index >= merge.rows.size()) {
+            break;
+        }
+
+        if (needsReset && !sendCommand(session, "RSET\r\n")) {
+            progress.failed++;
+            break;
+        }
+
+        needsReset = !sendMergedMessage(session, merge, merge.rows[index]);
+        if (needsReset) {
+            cerr << "Failed to send message to " << merge.rows[index][merge.emailColumn] << endl;
+            progress.failed++;
+        } else {
+            progress.sent++;
+        }
     }
 
-    if (!sendCommand(clientSocket, "EHLO client.example.com\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    sendCommand(session, "QUIT\r\n");
+
+    close(session.socket);
+}
+
+int sendBulk(const string &server, const int port, const string &sender, const string &password,
+             const string &recipientList, const vector<string> &attachmentPaths) {
+    MailMerge merge;
+    merge.sender = sender;
+
+    if (!loadRecipients(recipientList, merge)) {
+        cerr << "No valid recipients provided." << endl;
 
         return 1;
     }
 
-    if (!sendCommand(clientSocket, "AUTH LOGIN\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    cout << "Loaded " << merge.rows.size() << " recipients with columns:";
+    for (const auto &column : merge.columns) {
+        cout << " {{" << column << "}}";
+    }
+    cout << endl;
+
+    const string subject = getInput("Enter subject: ");
+    const string htmlBody = chooseHTMLBody();
 
+    if (!buildMailMerge(merge, subject, htmlBody, attachmentPaths)) {
         return 1;
     }
 
-    if (!sendCommand(clientSocket, encodedUsername + "\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    const string encodedUsername = encodeString(sender);
+    const string encodedPassword = encodeString(password);
+
+    const int sessionCount = static_cast<int>(min<size_t>(BULK_SESSIONS, merge.rows.size()));
+    cout << "Sending to " << merge.rows.size() << " recipients over " << sessionCount << " sessions to " << server
+         << ":" << port << "..." << endl;
+
+    BulkProgress progress;
+    const auto start = chrono::steady_clock::now();
+
+    vector<thread> sessions;
+    for (int i = 0; i < sessionCount; i++) {
+        sessions.emplace_back(runBulkSession, cref(merge), cref(server), port, cref(encodedUsername),
+                              cref(encodedPassword), ref(progress));
+    }
+
+    for (auto &session : sessions) {
+        session.join();
+    }
+
+    const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    const size_t unsent = merge.rows.size() - progress.sent - progress.failed;
+
+    cout << "Bulk send finished: " << progress.sent << " sent, " << progress.failed << " failed, " << unsent
+         << " not attempted in " << elapsed.count() << " s (" << progress.sent / elapsed.count()
+         << " messages/s)" << endl;
+
+    return progress.sent == merge.rows.size() ? 0 : 1;
+}
+
+int main(const int argc, char *argv[]) {
+    const string server = "smtp.interia.pl";
+    constexpr int port = 587;
 
+    const string sender = getInput("Enter sender email: ");
+    const string password = getInput("Enter password: ");
+
+    if (argc > 1) {
+        return sendBulk(server, port, sender, password, argv[1], vector<string>(argv + 2, argv + argc));
+    }
+
+    const vector<string> recipients = getRecipients();
+    if (recipients.empty()) {
+        cerr << "No valid recipients provided." << endl;
         return 1;
     }
 
-    if (!sendCommand(clientSocket, encodedPassword + "\r\n", buffer, BUFFER_SIZE)) {
-        cerr << "Authentication failed. Check your email and password." << endl;
-        close(clientSocket);
+    const string subject = getInput("Enter subject: ");
+    const string htmlBody = chooseHTMLBody();
+
+    const string encodedUsername = encodeString(sender);
+    const string encodedPassword = encodeString(password);
+
+    cout << "Connecting to " << server << ":" << port << "..." << endl;
 
+    SmtpSession session;
+    if (!openSession(session, server, port, encodedUsername, encodedPassword)) {
         return 1;
     }
 
-    if (const string mailFrom = "MAIL FROM:<" + sender + ">\r\n"; !sendCommand(
-        clientSocket, mailFrom, buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    if (const string mailFrom = "MAIL FROM:<" + sender + ">\r\n"; !sendCommand(session, mailFrom)) {
+        close(session.socket);
 
         return 1;
     }
 
     for (const auto &recipient: recipients) {
         if (const string rcptTo = "RCPT TO:<" + recipient + ">\r\n"; !
-            sendCommand(clientSocket, rcptTo, buffer, BUFFER_SIZE)) {
-            close(clientSocket);
+            sendCommand(session, rcptTo)) {
+            close(session.socket);
 
             return 1;
         }
     }
 
-    if (!sendCommand(clientSocket, "DATA\r\n", buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    if (!sendCommand(session, "DATA\r\n")) {
+        close(session.socket);
 
         return 1;
     }
@@ -303,15 +748,15 @@ int main() {
     message += htmlBody;
     message += "\r\n.\r\n";
 
-    if (!sendCommand(clientSocket, message, buffer, BUFFER_SIZE)) {
-        close(clientSocket);
+    if (!sendCommand(session, message)) {
+        close(session.socket);
 
         return 1;
     }
 
-    sendCommand(clientSocket, "QUIT\r\n", buffer, BUFFER_SIZE);
+    sendCommand(session, "QUIT\r\n");
 
-    close(clientSocket);
+    close(session.socket);
 
     cout << "HTML email sent successfully to " << recipients.size() << " recipient(s)!" << endl;
 
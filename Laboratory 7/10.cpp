@@ -4,12 +4,19 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <sstream>
+#include <vector>
+#include <chrono>
+#include "../Common/pop3_client.h"
 
 using namespace std;
 
-int main() {
+constexpr int RETR_WINDOW = 32;
+
+int main(const int argc, char *argv[]) {
     const string hostname = "interia.pl";
     constexpr int port = 110;
+    const bool syncMode = argc > 1 && string(argv[1]) == "--sync";
+    const string indexPath = argc > 2 ? argv[2] : "uidl.index";
 
     const hostent *hostent = gethostbyname(hostname.c_str());
     if (hostent == nullptr) {
@@ -161,26 +168,125 @@ int main() {
         return 0;
     }
 
-    cout << "\nRetrieving all messages in the mailbox..." << endl;
+    ResponseReader reader;
+    const bool pipelining = supportsPipelining(clientSocket, reader);
+    const int window = pipelining ? RETR_WINDOW : 1;
+
+    vector<int> messageNumbers;
+    vector<string> messageUids(numMessages + 1);
+    vector<char> synced(numMessages + 1, 0);
+    bool uidsKnown = false;
+
+    if (syncMode) {
+        UidIndex index;
+        if (!index.open(indexPath)) {
+            cerr << "Failed to open UID index: " << indexPath << endl;
+
+            close(clientSocket);
+
+            return 1;
+        }
+
+        uidsKnown = fetchUids(clientSocket, reader, messageUids);
+        if (!uidsKnown) {
+            cerr << "Server did not answer UIDL, retrieving every message." << endl;
+        }
+
+        for (int i = 1; i <= numMessages; ++i) {
+            if (uidsKnown && !messageUids[i].empty() && index.contains(messageUids[i])) {
+                synced[i] = 1;
+            } else {
+                messageNumbers.push_back(i);
+            }
+        }
+
+        cout << "UIDL: " << numMessages << " messages on the server, " << numMessages - messageNumbers.size()
+             << " already synced, " << messageNumbers.size() << " to retrieve." << endl;
+    } else {
+        for (int i = 1; i <= numMessages; ++i) {
+            messageNumbers.push_back(i);
+        }
+    }
+
+    cout << (syncMode ? "\nRetrieving new messages" : "\nRetrieving all messages in the mailbox");
+    if (pipelining) {
+        cout << " (pipelined, " << window << " commands in flight)";
+    }
+    cout << "..." << endl;
+
+    const auto retrievalStart = chrono::steady_clock::now();
+    size_t retrievedBytes = 0;
+    int retrieved = 0;
+    size_t nextToSend = 0;
+
+    for (size_t position = 0; position < messageNumbers.size(); ++position) {
+        const int i = messageNumbers[position];
 
-    for (int i = 1; i <= numMessages; ++i) {
-        string retrCmd = "RETR " + to_string(i) + "\r\n";
+        string retrCmds;
+        while (nextToSend < messageNumbers.size() && nextToSend - position < static_cast<size_t>(window)) {
+            retrCmds += "RETR " + to_string(messageNumbers[nextToSend++]) + "\r\n";
+        }
 
-        if (send(clientSocket, retrCmd.c_str(), retrCmd.length(), 0) < 0) {
+        if (!retrCmds.empty() && send(clientSocket, retrCmds.c_str(), retrCmds.length(), 0) < 0) {
             cerr << "Failed to send RETR command for message #" << i << endl;
-            continue;
+
+            close(clientSocket);
+
+            return 1;
         }
 
-        memset(buffer, 0, sizeof(buffer));
-        if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+        string status;
+        if (!reader.readLine(clientSocket, status)) {
             cerr << "Failed to receive response to RETR command for message #" << i << endl;
+
+            close(clientSocket);
+
+            return 1;
+        }
+
+        if (!status.starts_with("+OK")) {
+            cerr << "Failed to retrieve message #" << i << ": " << status;
             continue;
         }
 
         cout << "\n===================================================" << endl;
         cout << "Message #" << i << ":" << endl;
         cout << "===================================================" << endl;
-        cout << buffer << endl;
+
+        const bool complete = reader.streamBody(clientSocket, [&retrievedBytes](const char *data, const size_t length) {
+            cout.write(data, length);
+            retrievedBytes += length;
+        });
+
+        if (!complete) {
+            cerr << "Connection lost while receiving message #" << i << endl;
+
+            close(clientSocket);
+
+            return 1;
+        }
+
+        retrieved++;
+        synced[i] = 1;
+    }
+
+    const chrono::duration<double> retrievalTime = chrono::steady_clock::now() - retrievalStart;
+    cout << "\nRetrieved " << retrieved << " messages (" << retrievedBytes << " bytes) in "
+         << retrievalTime.count() << " s: " << retrieved / retrievalTime.count() << " messages/s" << endl;
+
+    if (syncMode && uidsKnown) {
+        vector<string> syncedUids;
+        for (int i = 1; i <= numMessages; ++i) {
+            if (synced[i] && !messageUids[i].empty()) {
+                syncedUids.push_back(messageUids[i]);
+            }
+        }
+
+        if (UidIndex::write(indexPath, syncedUids)) {
+            cout << "UID index " << indexPath << " now lists " << syncedUids.size() << " messages." << endl;
+        } else {
+            cerr << "Failed to update UID index: " << indexPath << endl;
+        }
     }
 
     const string quitCmd = "QUIT\r\n";
@@ -192,12 +298,12 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    string quitReply;
+    if (!reader.readLine(clientSocket, quitReply)) {
         cerr << "Failed to receive response to QUIT command." << endl;
     }
 
-    cout << "Server: " << buffer;
+    cout << "Server: " << quitReply;
     cout << "Session closed." << endl;
 
     close(clientSocket);
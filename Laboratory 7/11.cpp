@@ -4,114 +4,115 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <sstream>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <string_view>
 #include <vector>
 #include <fstream>
-#include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <set>
+#include "../Common/mime.h"
+#include "../Common/pop3_client.h"
 
 using namespace std;
 
-string base64Decode(const string &encoded_string) {
-    static const string base64_chars =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+constexpr int RETR_WINDOW = 32;
 
-    vector<unsigned char> decoded;
-    int val = 0;
-    int valb = -8;
+struct WorkerPool {
+    vector<thread> workers;
+    mutex queueMutex;
+    condition_variable queueWake;
+    condition_variable idleWake;
+    deque<function<void()>> jobs;
+    size_t running = 0;
+    bool stopping = false;
 
-    for (const char c: encoded_string) {
-        if (c == '=') {
-            break;
+    explicit WorkerPool(const unsigned count) {
+        for (unsigned i = 0; i < count; ++i) {
+            workers.emplace_back(&WorkerPool::workerLoop, this);
         }
+    }
 
-        if (const size_t pos = base64_chars.find(c); pos != string::npos) {
-            val = (val << 6) + static_cast<int>(pos);
-            valb += 6;
+    ~WorkerPool() {
+        {
+            lock_guard lock(queueMutex);
+            stopping = true;
+        }
+        queueWake.notify_all();
 
-            if (valb >= 0) {
-                decoded.push_back(static_cast<unsigned char>((val >> valb) & 0xFF));
-                valb -= 8;
-            }
+        for (auto &worker : workers) {
+            worker.join();
         }
     }
 
-    return string(decoded.begin(), decoded.end());
-}
-
-struct Attachment {
-    string filename;
-    string content_type;
-    string encoding;
-    string data;
-};
-
-vector<Attachment> parseEmail(const string &email) {
-    vector<Attachment> attachments;
-
-    regex boundary_regex("boundary=\"([^\"]+)\"");
+    void submit(function<void()> job) {
+        {
+            lock_guard lock(queueMutex);
+            jobs.push_back(std::move(job));
+        }
+        queueWake.notify_one();
+    }
 
-    if (smatch boundary_match; regex_search(email, boundary_match, boundary_regex) && boundary_match.size() > 1) {
-        string boundary = "--" + boundary_match[1].str();
+    void wait() {
+        unique_lock lock(queueMutex);
+        idleWake.wait(lock, [this] {
+            return jobs.empty() && running == 0;
+        });
+    }
 
-        size_t pos = 0;
-        size_t next_pos;
+    void workerLoop() {
+        unique_lock lock(queueMutex);
 
-        while ((next_pos = email.find(boundary, pos)) != string::npos) {
-            pos = next_pos + boundary.length();
+        while (true) {
+            queueWake.wait(lock, [this] {
+                return stopping || !jobs.empty();
+            });
 
-            size_t part_end = email.find(boundary, pos);
-            if (part_end == string::npos) {
-                break;
+            if (jobs.empty()) {
+                return;
             }
 
-            string part = email.substr(pos, part_end - pos);
+            const function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            running++;
 
-            regex content_disp_regex("Content-Disposition:\\s*attachment;\\s*filename=\"([^\"]+)\"", regex::icase);
+            lock.unlock();
+            job();
+            lock.lock();
 
-            if (smatch filename_match; regex_search(part, filename_match, content_disp_regex) && filename_match.size() >
-                                       1) {
-                Attachment att;
-                att.filename = filename_match[1].str();
-
-                regex content_type_regex("Content-Type:\\s*([^;\\r\\n]+)", regex::icase);
-
-                if (smatch content_type_match; regex_search(part, content_type_match, content_type_regex) &&
-                                               content_type_match.size() > 1) {
-                    att.content_type = content_type_match[1].str();
-                }
-
-                regex encoding_regex("Content-Transfer-Encoding:\\s*([^\\r\\n]+)", regex::icase);
-
-                if (smatch encoding_match; regex_search(part, encoding_match, encoding_regex) && encoding_match.size() >
-                                           1) {
-                    att.encoding = encoding_match[1].str();
-                }
-
-                if (size_t data_start = part.find("\r\n\r\n"); data_start != string::npos) {
-                    data_start += 4;
-                    att.data = part.substr(data_start);
-
-                    if (att.encoding == "base64") {
-                        string clean_data;
-                        for (char c: att.data) {
-                            if (c != '\r' && c != '\n') {
-                                clean_data += c;
-                            }
-                        }
-                        att.data = clean_data;
-                    }
-
-                    attachments.push_back(att);
-                }
+            if (--running == 0 && jobs.empty()) {
+                idleWake.notify_all();
             }
         }
     }
+};
+
+// Attachments of one message are saved in parallel, so a repeated filename gets a " (2)", " (3)", ... suffix
+// before the extension instead of two workers writing the same file.
+string uniqueSavePath(const string &filename, set<string> &taken) {
+    string path = filename;
+    const size_t dot = filename.find_last_of('.');
+    const size_t stemEnd = dot == string::npos || dot == 0 ? filename.size() : dot;
+
+    for (int copy = 2; !taken.insert(path).second; ++copy) {
+        path = filename.substr(0, stemEnd) + " (" + to_string(copy) + ")" + filename.substr(stemEnd);
+    }
 
-    return attachments;
+    return path;
 }
 
-int main() {
+int main(const int argc, char *argv[]) {
     const string hostname = "interia.pl";
     constexpr int port = 110;
+    const bool syncMode = argc > 1 && string(argv[1]) == "--sync";
+    const string indexPath = argc > 2 ? argv[2] : "uidl.index";
 
     const hostent *hostent = gethostbyname(hostname.c_str());
     if (hostent == nullptr) {
@@ -263,66 +264,215 @@ int main() {
         return 0;
     }
 
-    cout << "\nRetrieving all messages in the mailbox..." << endl;
+    ResponseReader reader;
+    const bool pipelining = supportsPipelining(clientSocket, reader);
+    const int window = pipelining ? RETR_WINDOW : 1;
+
+    vector<int> messageNumbers;
+    vector<string> messageUids(numMessages + 1);
+    vector<char> synced(numMessages + 1, 0);
+    bool uidsKnown = false;
+
+    if (syncMode) {
+        UidIndex index;
+        if (!index.open(indexPath)) {
+            cerr << "Failed to open UID index: " << indexPath << endl;
+
+            close(clientSocket);
+
+            return 1;
+        }
+
+        uidsKnown = fetchUids(clientSocket, reader, messageUids);
+        if (!uidsKnown) {
+            cerr << "Server did not answer UIDL, retrieving every message." << endl;
+        }
+
+        for (int i = 1; i <= numMessages; ++i) {
+            if (uidsKnown && !messageUids[i].empty() && index.contains(messageUids[i])) {
+                synced[i] = 1;
+            } else {
+                messageNumbers.push_back(i);
+            }
+        }
+
+        cout << "UIDL: " << numMessages << " messages on the server, " << numMessages - messageNumbers.size()
+             << " already synced, " << messageNumbers.size() << " to retrieve." << endl;
+    } else {
+        for (int i = 1; i <= numMessages; ++i) {
+            messageNumbers.push_back(i);
+        }
+    }
+
+    cout << (syncMode ? "\nRetrieving new messages" : "\nRetrieving all messages in the mailbox");
+    if (pipelining) {
+        cout << " (pipelined, " << window << " commands in flight)";
+    }
+    cout << "..." << endl;
+
+    WorkerPool savePool(max(1u, thread::hardware_concurrency()));
 
-    for (int i = 1; i <= numMessages; ++i) {
-        string retrCmd = "RETR " + to_string(i) + "\r\n";
+    const auto retrievalStart = chrono::steady_clock::now();
+    size_t retrievedBytes = 0;
+    int retrieved = 0;
+    size_t nextToSend = 0;
 
-        if (send(clientSocket, retrCmd.c_str(), retrCmd.length(), 0) < 0) {
+    for (size_t position = 0; position < messageNumbers.size(); ++position) {
+        const int i = messageNumbers[position];
+
+        string retrCmds;
+        while (nextToSend < messageNumbers.size() && nextToSend - position < static_cast<size_t>(window)) {
+            retrCmds += "RETR " + to_string(messageNumbers[nextToSend++]) + "\r\n";
+        }
+
+        if (!retrCmds.empty() && send(clientSocket, retrCmds.c_str(), retrCmds.length(), 0) < 0) {
             cerr << "Failed to send RETR command for message #" << i << endl;
-            continue;
+
+            close(clientSocket);
+
+            return 1;
         }
 
-        memset(buffer, 0, sizeof(buffer));
-        if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+        string status;
+        if (!reader.readLine(clientSocket, status)) {
             cerr << "Failed to receive response to RETR command for message #" << i << endl;
+
+            close(clientSocket);
+
+            return 1;
+        }
+
+        if (!status.starts_with("+OK")) {
+            cerr << "Failed to retrieve message #" << i << ": " << status;
+            continue;
+        }
+
+        string messageName = syncMode && !messageUids[i].empty() ? messageUids[i] : to_string(i);
+        replace(messageName.begin(), messageName.end(), '/', '_');
+
+        const string messageFile = "message_" + messageName + ".eml";
+        ofstream messageOut(messageFile, ios::binary);
+
+        const bool complete = reader.streamBody(clientSocket, [&](const char *data, const size_t length) {
+            messageOut.write(data, length);
+            retrievedBytes += length;
+        });
+
+        if (!complete) {
+            cerr << "Connection lost while receiving message #" << i << endl;
+
+            close(clientSocket);
+
+            return 1;
+        }
+
+        messageOut.close();
+        if (!messageOut) {
+            cerr << "Failed to save message #" << i << " to " << messageFile << endl;
             continue;
         }
 
+        retrieved++;
+        synced[i] = 1;
+
         cout << "\n===================================================" << endl;
         cout << "Message #" << i << ":" << endl;
         cout << "===================================================" << endl;
+        cout << "Saved message to: " << messageFile << endl;
+
+        const int messageFd = open(messageFile.c_str(), O_RDONLY);
+        struct stat messageInfo{};
+        if (messageFd < 0 || fstat(messageFd, &messageInfo) < 0) {
+            cerr << "Failed to open saved message: " << messageFile << endl;
+
+            if (messageFd >= 0) {
+                close(messageFd);
+            }
+
+            continue;
+        }
 
-        string emailContent(buffer);
+        void *messageMapping = messageInfo.st_size > 0
+                                   ? mmap(nullptr, messageInfo.st_size, PROT_READ, MAP_PRIVATE, messageFd, 0)
+                                   : MAP_FAILED;
+        close(messageFd);
 
-        if (vector<Attachment> attachments = parseEmail(emailContent); !attachments.empty()) {
+        const string_view emailContent = messageMapping != MAP_FAILED
+                                             ? string_view(static_cast<const char *>(messageMapping),
+                                                           messageInfo.st_size)
+                                             : string_view();
+
+        if (const vector<MimeAttachment> attachments = parseMimeAttachments(emailContent); !attachments.empty()) {
             cout << "Found " << attachments.size() << " attachment(s) in this message." << endl;
 
-            for (const auto &[filename, content_type, encoding, data]: attachments) {
-                cout << "Attachment: " << filename << " (" << content_type << ")" << endl;
+            vector<string> savePaths(attachments.size());
+            vector<char> saved(attachments.size(), 0);
+            set<string> takenPaths;
+
+            for (size_t a = 0; a < attachments.size(); ++a) {
+                const MimeAttachment &attachment = attachments[a];
+                cout << "Attachment: " << attachment.filename << " (" << attachment.contentType << ")" << endl;
 
-                if (content_type.find("image/") != string::npos) {
+                if (attachment.contentType.find("image/") != string::npos) {
                     cout << "Detected image attachment. Saving to disk..." << endl;
 
-                    string fileData;
-                    if (encoding == "base64") {
-                        fileData = base64Decode(data);
-                    } else {
-                        fileData = data;
-                    }
-
-                    if (ofstream outFile(filename, ios::binary); outFile.is_open()) {
-                        outFile.write(fileData.c_str(), fileData.size());
-                        outFile.close();
-                        cout << "Successfully saved image to: " << filename << endl;
-                    } else {
-                        cerr << "Failed to save attachment: " << filename << endl;
-                    }
+                    savePaths[a] = uniqueSavePath(
+                        attachment.filename.substr(attachment.filename.find_last_of("/\\") + 1), takenPaths);
+                    savePool.submit([&attachments, &savePaths, &saved, a] {
+                        saved[a] = saveMimeAttachment(attachments[a], savePaths[a]);
+                    });
                 } else {
                     cout << "Skipping non-image attachment." << endl;
                 }
             }
+
+            savePool.wait();
+
+            for (size_t a = 0; a < attachments.size(); ++a) {
+                if (savePaths[a].empty()) {
+                    continue;
+                }
+
+                if (saved[a]) {
+                    cout << "Successfully saved image to: " << savePaths[a] << endl;
+                } else {
+                    cerr << "Failed to save attachment: " << savePaths[a] << endl;
+                }
+            }
         } else {
             cout << "No attachments found in this message." << endl;
         }
 
         cout << "Email content summary:" << endl;
-        if (size_t headerEnd = emailContent.find("\r\n\r\n"); headerEnd != string::npos) {
+        if (size_t headerEnd = emailContent.find("\r\n\r\n"); headerEnd != string_view::npos) {
             cout << emailContent.substr(0, headerEnd) << endl;
             cout << "[...Content truncated...]" << endl;
         } else {
             cout << emailContent.substr(0, 200) << "..." << endl;
         }
+
+        if (messageMapping != MAP_FAILED) {
+            munmap(messageMapping, messageInfo.st_size);
+        }
+    }
+
+    const chrono::duration<double> retrievalTime = chrono::steady_clock::now() - retrievalStart;
+    cout << "\nRetrieved " << retrieved << " messages (" << retrievedBytes << " bytes) in "
+         << retrievalTime.count() << " s: " << retrieved / retrievalTime.count() << " messages/s" << endl;
+
+    if (syncMode && uidsKnown) {
+        vector<string> syncedUids;
+        for (int i = 1; i <= numMessages; ++i) {
+            if (synced[i] && !messageUids[i].empty()) {
+                syncedUids.push_back(messageUids[i]);
+            }
+        }
+
+        if (UidIndex::write(indexPath, syncedUids)) {
+            cout << "UID index " << indexPath << " now lists " << syncedUids.size() << " messages." << endl;
+        } else {
+            cerr << "Failed to update UID index: " << indexPath << endl;
+        }
     }
 
     const string quitCmd = "QUIT\r\n";
@@ -334,12 +484,12 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    string quitReply;
+    if (!reader.readLine(clientSocket, quitReply)) {
         cerr << "Failed to receive response to QUIT command." << endl;
     }
 
-    cout << "Server: " << buffer;
+    cout << "Server: " << quitReply;
     cout << "Session closed." << endl;
 
     close(clientSocket);
@@ -0,0 +1,304 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <sstream>
+#include <regex>
+#include "../Common/mime.h"
+
+using namespace std;
+
+constexpr int BENCH_RUNS = 3;
+
+struct Attachment {
+    string filename;
+    string content_type;
+    string encoding;
+    string data;
+};
+
+vector<Attachment> legacyParseEmail(const string &email) {
+    vector<Attachment> attachments;
+
+    regex boundary_regex("boundary=\"([^\"]+)\"");
+
+    if (smatch boundary_match; regex_search(email, boundary_match, boundary_regex) && boundary_match.size() > 1) {
+        string boundary = "--" + boundary_match[1].str();
+
+        size_t pos = 0;
+        size_t next_pos;
+
+        while ((next_pos = email.find(boundary, pos)) != string::npos) {
+            pos = next_pos + boundary.length();
+
+            size_t part_end = email.find(boundary, pos);
+            if (part_end == string::npos) {
+                break;
+            }
+
+            string part = email.substr(pos, part_end - pos);
+
+            regex content_disp_regex("Content-Disposition:\\s*attachment;\\s*filename=\"([^\"]+)\"", regex::icase);
+
+            if (smatch filename_match; regex_search(part, filename_match, content_disp_regex) && filename_match.size() >
+                                       1) {
+                Attachment att;
+                att.filename = filename_match[1].str();
+
+                regex content_type_regex("Content-Type:\\s*([^;\\r\\n]+)", regex::icase);
+
+                if (smatch content_type_match; regex_search(part, content_type_match, content_type_regex) &&
+                                               content_type_match.size() > 1) {
+                    att.content_type = content_type_match[1].str();
+                }
+
+                regex encoding_regex("Content-Transfer-Encoding:\\s*([^\\r\\n]+)", regex::icase);
+
+                if (smatch encoding_match; regex_search(part, encoding_match, encoding_regex) && encoding_match.size() >
+                                           1) {
+                    att.encoding = encoding_match[1].str();
+                }
+
+                if (size_t data_start = part.find("\r\n\r\n"); data_start != string::npos) {
+                    data_start += 4;
+                    att.data = part.substr(data_start);
+
+                    if (att.encoding == "base64") {
+                        string clean_data;
+                        for (char c: att.data) {
+                            if (c != '\r' && c != '\n') {
+                                clean_data += c;
+                            }
+                        }
+                        att.data = clean_data;
+                    }
+
+                    attachments.push_back(att);
+                }
+            }
+        }
+    }
+
+    return attachments;
+}
+
+struct SyntheticMessage {
+    string text;
+    vector<pair<string, string>> attachments;
+};
+
+string randomBytes(const size_t length, mt19937 &random) {
+    string bytes(length, '\0');
+    for (auto &byte : bytes) {
+        byte = static_cast<char>(random());
+    }
+
+    return bytes;
+}
+
+string attachmentPart(const string &filename, const string &content, const bool folded) {
+    string part = folded ? "Content-Type: image/png;\r\n\tname=\"" + filename + "\"\r\n"
+                         : "Content-Type: image/png; name=\"" + filename + "\"\r\n";
+    part += "Content-Transfer-Encoding: base64\r\n";
+    part += folded ? "Content-Disposition: attachment;\r\n filename=\"" + filename + "\"\r\n\r\n"
+                   : "Content-Disposition: attachment; filename=\"" + filename + "\"\r\n\r\n";
+    part += base64EncodeMime(content);
+
+    return part;
+}
+
+// Builds a multipart/mixed message with a text/html alternative up front. When `nested` is set, every other
+// attachment sits inside a forwarded multipart/mixed part with its own boundary.
+SyntheticMessage buildMessage(const int attachmentCount, const size_t attachmentBytes, const bool nested,
+                              const bool folded, mt19937 &random) {
+    SyntheticMessage message;
+    string &text = message.text;
+
+    text = "From: sender@example.com\r\nTo: pas2017@interia.pl\r\nSubject: Synthetic attachments\r\n";
+    text += "MIME-Version: 1.0\r\n";
+    text += folded ? "Content-Type: multipart/mixed;\r\n boundary=\"outer-boundary\"\r\n\r\n"
+                   : "Content-Type: multipart/mixed; boundary=\"outer-boundary\"\r\n\r\n";
+    text += "This is a multi-part message in MIME format.\r\n";
+    text += "--outer-boundary\r\nContent-Type: multipart/alternative; boundary=\"alt-boundary\"\r\n\r\n";
+    text += "--alt-boundary\r\nContent-Type: text/plain; charset=utf-8\r\n\r\nSee the attached images.\r\n";
+    text += "--alt-boundary\r\nContent-Type: text/html; charset=utf-8\r\n\r\n<p>See the attached images.</p>\r\n";
+    text += "--alt-boundary--\r\n";
+
+    string forwarded;
+    for (int i = 0; i < attachmentCount; i++) {
+        const string filename = "image_" + to_string(i) + ".png";
+        const string content = randomBytes(attachmentBytes + random() % 1024, random);
+        const string part = attachmentPart(filename, content, folded);
+        message.attachments.emplace_back(filename, content);
+
+        if (nested && i % 2 == 1) {
+            forwarded += "--forwarded-boundary\r\n" + part;
+        } else {
+            text += "--outer-boundary\r\n" + part;
+        }
+    }
+
+    if (!forwarded.empty()) {
+        text += "--outer-boundary\r\nContent-Type: multipart/mixed;\r\n\tboundary=\"forwarded-boundary\"\r\n\r\n";
+        text += forwarded + "--forwarded-boundary--\r\n";
+    }
+
+    text += "--outer-boundary--\r\n";
+
+    return message;
+}
+
+vector<pair<string, string>> decodeWithMime(const string_view text) {
+    vector<pair<string, string>> decoded;
+    for (const auto &attachment : parseMimeAttachments(text)) {
+        ostringstream out;
+        writeMimeAttachment(attachment, out);
+        decoded.emplace_back(attachment.filename, out.str());
+    }
+
+    return decoded;
+}
+
+vector<pair<string, string>> decodeWithLegacy(const string &text) {
+    vector<pair<string, string>> decoded;
+    for (const auto &[filename, content_type, encoding, data] : legacyParseEmail(text)) {
+        decoded.emplace_back(filename, encoding == "base64" ? base64Decode(data) : data);
+    }
+
+    return decoded;
+}
+
+string toLf(const string &text) {
+    string result;
+    result.reserve(text.size());
+    for (const char c : text) {
+        if (c != '\r') {
+            result += c;
+        }
+    }
+
+    return result;
+}
+
+// Sorting makes the comparison independent of where the nested parts end up in the message.
+bool sameAttachments(vector<pair<string, string>> actual, vector<pair<string, string>> expected) {
+    sort(actual.begin(), actual.end());
+    sort(expected.begin(), expected.end());
+
+    return actual == expected;
+}
+
+bool runCorrectnessTest() {
+    mt19937 random(2024);
+    int legacyFailures = 0;
+    int cases = 0;
+
+    for (const bool nested : {false, true}) {
+        for (const bool folded : {false, true}) {
+            for (const int count : {0, 1, 3, 8}) {
+                const SyntheticMessage message = buildMessage(count, 1 + random() % 20000, nested, folded, random);
+                cases++;
+
+                if (!sameAttachments(decodeWithMime(message.text), message.attachments) ||
+                    !sameAttachments(decodeWithMime(toLf(message.text)), message.attachments)) {
+                    cerr << "MIME parser mismatch: " << count << " attachments, nested " << nested << ", folded "
+                         << folded << endl;
+
+                    return false;
+                }
+
+                if (!sameAttachments(decodeWithLegacy(message.text), message.attachments)) {
+                    legacyFailures++;
+                }
+            }
+        }
+    }
+
+    cout << "MIME parser matched all " << cases << " synthetic messages (CRLF and bare LF); the regex parser got "
+         << legacyFailures << " of them wrong" << endl;
+
+    return true;
+}
+
+struct CountingBuffer : streambuf {
+    size_t count = 0;
+
+    streamsize xsputn(const char *, const streamsize length) override {
+        count += length;
+
+        return length;
+    }
+
+    int overflow(const int c) override {
+        count++;
+
+        return c;
+    }
+};
+
+template <typename Operation>
+double measureSeconds(Operation operation) {
+    double best = 1e300;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        const auto start = chrono::steady_clock::now();
+        operation();
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+        best = min(best, elapsed.count());
+    }
+
+    return best;
+}
+
+void runBenchmark(const int attachmentCount, const size_t attachmentBytes) {
+    mt19937 random(7);
+    const SyntheticMessage message = buildMessage(attachmentCount, attachmentBytes, false, true, random);
+    const double megabytes = message.text.size() / 1e6;
+    size_t sink = 0;
+
+    cout << "Message of " << megabytes << " MB with " << attachmentCount << " attachments (best of " << BENCH_RUNS
+         << ")" << endl;
+
+    const double legacySeconds = measureSeconds([&] {
+        for (const auto &[filename, content_type, encoding, data] : legacyParseEmail(message.text)) {
+            sink += base64Decode(data).size();
+        }
+    });
+
+    const double parseSeconds = measureSeconds([&] {
+        sink += parseMimeAttachments(message.text).size();
+    });
+
+    const double decodeSeconds = measureSeconds([&] {
+        CountingBuffer counter;
+        ostream out(&counter);
+        for (const auto &attachment : parseMimeAttachments(message.text)) {
+            writeMimeAttachment(attachment, out);
+        }
+        sink += counter.count;
+    });
+
+    cout << "  regex parser + decode  " << legacySeconds * 1000 << " ms, " << megabytes / legacySeconds << " MB/s"
+         << endl;
+    cout << "  MIME parser only       " << parseSeconds * 1000 << " ms, " << megabytes / parseSeconds << " MB/s" << endl;
+    cout << "  MIME parser + decode   " << decodeSeconds * 1000 << " ms, " << megabytes / decodeSeconds << " MB/s"
+         << endl;
+    cout << "  speedup " << legacySeconds / decodeSeconds << "x (" << sink % 10 << ")" << endl;
+}
+
+int main(const int argc, char *argv[]) {
+    const string mode = argc > 1 ? argv[1] : "all";
+    const int attachmentCount = argc > 2 ? stoi(argv[2]) : 16;
+    const size_t attachmentBytes = argc > 3 ? stoul(argv[3]) : 1024 * 1024;
+
+    if ((mode == "all" || mode == "test") && !runCorrectnessTest()) {
+        return 1;
+    }
+
+    if (mode == "all" || mode == "bench") {
+        runBenchmark(attachmentCount, attachmentBytes);
+    }
+
+    return 0;
+}
@@ -3,11 +3,26 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
-#include <sstream>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+#include <string_view>
+#include <charconv>
+#include <deque>
+#include <algorithm>
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "../Common/base64.h"
 
 using namespace std;
 
@@ -19,193 +34,1006 @@ struct Email {
     vector<pair<string, string> > attachments;
 };
 
-string base64Encode(const string &input) {
-    static const string base64Chars =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+struct StoredMessage {
+    string wire;
+    size_t size = 0;
+};
+
+constexpr char INDEX_MAGIC[8] = {'P', 'O', 'P', 'I', 'D', 'X', '0', '3'};
+constexpr size_t INDEX_BLOCK_RECORDS = 4096;
+constexpr size_t COMPACT_MIN_TOMBSTONES = 1024;
+constexpr size_t COPY_BUFFER_SIZE = 1024 * 1024;
+
+// nextId is written when the index is created or compacted, so ids are never reused even after every message up to
+// that point has been deleted and compacted away.
+struct IndexHeader {
+    char magic[8];
+    uint64_t generation;
+    uint64_t nextId;
+};
+
+struct MessageRecord {
+    uint64_t id;
+    uint64_t offset;
+    uint64_t wireLength;
+    uint64_t size;
+};
+
+using Tombstones = vector<uint64_t>;
+
+bool isTombstoned(const Tombstones &tombstones, const size_t position) {
+    return position / 64 < tombstones.size() && (tombstones[position / 64] >> position % 64 & 1) != 0;
+}
+
+void setTombstone(Tombstones &tombstones, const size_t position) {
+    if (position / 64 >= tombstones.size()) {
+        tombstones.resize(position / 64 + 1);
+    }
 
-    string encoded;
-    int val = 0;
-    int valb = -6;
+    tombstones[position / 64] |= uint64_t{1} << position % 64;
+}
+
+struct MailboxFiles {
+    uint64_t generation = 0;
+    int dataFd = -1;
+    int indexFd = -1;
+
+    MailboxFiles() = default;
+    MailboxFiles(const MailboxFiles &) = delete;
+    MailboxFiles &operator=(const MailboxFiles &) = delete;
 
-    for (const unsigned char c: input) {
-        val = (val << 8) + c;
-        valb += 8;
-        while (valb >= 0) {
-            encoded.push_back(base64Chars[(val >> valb) & 0x3F]);
-            valb -= 6;
+    ~MailboxFiles() {
+        if (dataFd >= 0) {
+            close(dataFd);
+        }
+
+        if (indexFd >= 0) {
+            close(indexFd);
         }
     }
+};
 
-    if (valb > -6) {
-        encoded.push_back(base64Chars[((val << 8) >> (valb + 8)) & 0x3F]);
+// `records` counts every index record of the generation the snapshot covers, including committed deletions that
+// have not been compacted away yet; `count` and `totalSize` describe only the live messages.
+struct MailboxSnapshot {
+    shared_ptr<const MailboxFiles> files;
+    size_t records = 0;
+    shared_ptr<const Tombstones> tombstones = make_shared<const Tombstones>();
+    size_t tombstoned = 0;
+    size_t count = 0;
+    size_t totalSize = 0;
+};
+
+string serializeEmail(const Email &email) {
+    const auto &[from, to, subject, body, attachments] = email;
+    string message = "From: " + from + "\r\nTo: " + to + "\r\nSubject: " + subject + "\r\n";
+
+    if (attachments.empty()) {
+        return message + "\r\n" + body + "\r\n";
     }
 
-    while (encoded.size() % 4 != 0) {
-        encoded.push_back('=');
+    char boundary[40];
+    snprintf(boundary, sizeof(boundary), "boundary_%016zx", hash<string>{}(message + body));
+
+    message += "MIME-Version: 1.0\r\n";
+    message += "Content-Type: multipart/mixed; boundary=\"" + string(boundary) + "\"\r\n";
+    message += "\r\n";
+    message += "This is a multi-part message in MIME format.\r\n";
+    message += "--" + string(boundary) + "\r\n";
+    message += "Content-Type: text/plain; charset=utf-8\r\n";
+    message += "Content-Transfer-Encoding: 8bit\r\n\r\n";
+    message += body + "\r\n\r\n";
+
+    for (const auto &[filename, contentType]: attachments) {
+        message += "--" + string(boundary) + "\r\n";
+        message += "Content-Type: " + contentType + "\r\n";
+        message += "Content-Disposition: attachment; filename=\"" + filename + "\"\r\n";
+        message += "Content-Transfer-Encoding: base64\r\n\r\n";
+
+        const string dummyImageData = "This is a simulated image content for testing attachments.";
+        message += base64EncodeMime(dummyImageData);
+        message += "\r\n";
     }
 
-    return encoded;
+    message += "--" + string(boundary) + "--\r\n";
+
+    return message;
 }
 
-void handleClient(int clientSocket, map<string, string> &users, map<string, vector<Email> > &userEmails,
-                  mutex &emailsMutex) {
-    char buffer[4096] = {0};
-    string currentUser;
-    bool isAuthenticated = false;
-    string authenticationStage;
+// Builds the RETR payload once: the message dot-stuffed and followed by the terminating ".\r\n".
+StoredMessage storeEmail(const Email &email) {
+    const string message = serializeEmail(email);
+    StoredMessage stored;
+    stored.size = message.size();
+    stored.wire.reserve(message.size() + message.size() / 64 + 3);
 
-    send(clientSocket, "+OK POP3 server ready\r\n", 23, 0);
+    bool lineStart = true;
+    for (const char c : message) {
+        if (lineStart && c == '.') {
+            stored.wire += '.';
+        }
 
-    while (true) {
-        memset(buffer, 0, sizeof(buffer));
+        stored.wire += c;
+        lineStart = c == '\n';
+    }
 
-        if (const ssize_t bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0); bytesReceived <= 0) {
-            break;
+    stored.wire += ".\r\n";
+
+    return stored;
+}
+
+bool writeAt(const int fd, const void *data, const size_t length, const off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t bytesWritten = pwrite(fd, static_cast<const char *>(data) + done, length - done, offset + done);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
         }
 
-        string command(buffer);
-        if (!command.empty() && command.back() == '\n') {
-            command.pop_back();
+        done += bytesWritten;
+    }
+
+    return true;
+}
+
+bool readAt(const int fd, void *data, const size_t length, const off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t bytesRead = pread(fd, static_cast<char *>(data) + done, length - done, offset + done);
+        if (bytesRead <= 0) {
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+
+            return false;
         }
-        if (!command.empty() && command.back() == '\r') {
-            command.pop_back();
+
+        done += bytesRead;
+    }
+
+    return true;
+}
+
+bool copyRange(const int inFd, off_t inOffset, const int outFd, off_t outOffset, size_t length) {
+    while (length > 0) {
+        const ssize_t copied = copy_file_range(inFd, &inOffset, outFd, &outOffset, length, 0);
+        if (copied > 0) {
+            length -= copied;
+            continue;
         }
 
-        cout << "Received command: " << command << endl;
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (copied == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)) {
+            return false;
+        }
+
+        vector<char> buffer(min(length, COPY_BUFFER_SIZE));
+        while (length > 0) {
+            const size_t block = min(length, buffer.size());
+            if (!readAt(inFd, buffer.data(), block, inOffset) || !writeAt(outFd, buffer.data(), block, outOffset)) {
+                return false;
+            }
+
+            inOffset += static_cast<off_t>(block);
+            outOffset += static_cast<off_t>(block);
+            length -= block;
+        }
+    }
+
+    return true;
+}
+
+off_t recordOffset(const size_t position) {
+    return static_cast<off_t>(sizeof(IndexHeader) + position * sizeof(MessageRecord));
+}
+
+// Calls visitor(position, record) for records [first, last) of a snapshot's index, read in blocks.
+template <typename Visitor>
+bool forEachRecord(const MailboxSnapshot &snapshot, const size_t first, const size_t last, Visitor &&visitor) {
+    vector<MessageRecord> block(INDEX_BLOCK_RECORDS);
+    for (size_t position = first; position < last; position += block.size()) {
+        const size_t records = min(block.size(), last - position);
+        if (!readAt(snapshot.files->indexFd, block.data(), records * sizeof(MessageRecord), recordOffset(position))) {
+            return false;
+        }
+
+        for (size_t i = 0; i < records; i++) {
+            visitor(position + i, block[i]);
+        }
+    }
+
+    return true;
+}
+
+// A mailbox on disk is a <name>.idx of fixed-size MessageRecords behind an IndexHeader, pointing into the data file
+// of the generation the header names, <name>.<generation>.dat, which holds every message in RETR wire format.
+// Deletions committed at QUIT are appended to <name>.del as message ids until the compactor rewrites the live
+// messages into the next generation. Only counts, sizes and the tombstone bitmap live in memory.
+struct Mailbox {
+    atomic<shared_ptr<const MailboxSnapshot> > current{make_shared<const MailboxSnapshot>()};
+    mutex deliveryMutex;
+    mutex compactionMutex;
+    atomic<bool> compactionQueued = false;
+    filesystem::path directory;
+    string name;
+    uint64_t dataEnd = 0;
+    uint64_t nextId = 1;
+
+    filesystem::path dataPath(const uint64_t generation) const {
+        return directory / (name + "." + to_string(generation) + ".dat");
+    }
+
+    filesystem::path indexPath() const {
+        return directory / (name + ".idx");
+    }
+
+    filesystem::path tombstonePath() const {
+        return directory / (name + ".del");
+    }
+
+    vector<uint64_t> readTombstoneIds() const {
+        vector<uint64_t> ids;
+
+        const int fd = ::open(tombstonePath().c_str(), O_RDONLY);
+        struct stat info{};
+        if (fd >= 0 && fstat(fd, &info) == 0) {
+            ids.resize(info.st_size / sizeof(uint64_t));
+            if (!readAt(fd, ids.data(), ids.size() * sizeof(uint64_t), 0)) {
+                ids.clear();
+            }
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        sort(ids.begin(), ids.end());
+
+        return ids;
+    }
 
-        if (command.substr(0, 4) == "USER") {
-            currentUser = command.substr(5);
-            authenticationStage = "USER";
-            send(clientSocket, "+OK User accepted\r\n", 19, 0);
-        } else if (command.substr(0, 4) == "PASS") {
-            if (authenticationStage != "USER") {
-                send(clientSocket, "-ERR Send USER first\r\n", 22, 0);
+    bool open(const filesystem::path &storeDirectory, string mailboxName) {
+        replace(mailboxName.begin(), mailboxName.end(), '/', '_');
+        directory = storeDirectory;
+        name = std::move(mailboxName);
+
+        auto files = make_shared<MailboxFiles>();
+        files->indexFd = ::open(indexPath().c_str(), O_RDWR | O_CREAT, 0600);
+        if (files->indexFd < 0) {
+            return false;
+        }
+
+        IndexHeader header{};
+        if (const ssize_t headerBytes = pread(files->indexFd, &header, sizeof(header), 0); headerBytes == 0) {
+            memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+            header.generation = 1;
+            header.nextId = 1;
+
+            if (!writeAt(files->indexFd, &header, sizeof(header), 0)) {
+                return false;
+            }
+        } else if (headerBytes != sizeof(header) || memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0) {
+            return false;
+        }
+
+        files->generation = header.generation;
+        files->dataFd = ::open(dataPath(files->generation).c_str(), O_RDWR | O_CREAT, 0600);
+        nextId = header.nextId;
+
+        struct stat indexInfo{};
+        if (files->dataFd < 0 || fstat(files->indexFd, &indexInfo) < 0) {
+            return false;
+        }
+
+        auto next = make_shared<MailboxSnapshot>();
+        next->files = files;
+        next->records = (indexInfo.st_size - sizeof(IndexHeader)) / sizeof(MessageRecord);
+
+        const vector<uint64_t> deletedIds = readTombstoneIds();
+        Tombstones tombstones;
+
+        const bool complete = forEachRecord(*next, 0, next->records, [&](const size_t position,
+                                                                         const MessageRecord &record) {
+            dataEnd = record.offset + record.wireLength;
+            nextId = max(nextId, record.id + 1);
+
+            if (binary_search(deletedIds.begin(), deletedIds.end(), record.id)) {
+                setTombstone(tombstones, position);
+                next->tombstoned++;
             } else {
-                if (const string password = command.substr(5);
-                    users.find(currentUser) != users.end() && users[currentUser] == password) {
-                    isAuthenticated = true;
-                    send(clientSocket, "+OK Login successful\r\n", 23, 0);
-                } else {
-                    send(clientSocket, "-ERR Login failed\r\n", 19, 0);
+                next->count++;
+                next->totalSize += record.size;
+            }
+        });
+
+        if (!complete || ftruncate(files->indexFd, recordOffset(next->records)) < 0 ||
+            ftruncate(files->dataFd, static_cast<off_t>(dataEnd)) < 0) {
+            return false;
+        }
+
+        next->tombstones = make_shared<const Tombstones>(std::move(tombstones));
+        current.store(std::move(next));
+
+        return true;
+    }
+
+    shared_ptr<const MailboxSnapshot> snapshot() const {
+        return current.load();
+    }
+
+    bool deliver(const Email &email) {
+        const StoredMessage message = storeEmail(email);
+
+        lock_guard lock(deliveryMutex);
+
+        const shared_ptr<const MailboxSnapshot> previous = current.load();
+        const MessageRecord record{nextId, dataEnd, message.wire.size(), message.size};
+
+        if (!writeAt(previous->files->dataFd, message.wire.data(), message.wire.size(), static_cast<off_t>(dataEnd)) ||
+            !writeAt(previous->files->indexFd, &record, sizeof(record), recordOffset(previous->records))) {
+            return false;
+        }
+
+        nextId++;
+        dataEnd += message.wire.size();
+
+        auto next = make_shared<MailboxSnapshot>(*previous);
+        next->records++;
+        next->count++;
+        next->totalSize += message.size;
+
+        current.store(std::move(next));
+
+        return true;
+    }
+
+    // Finds a message by id in a generation's index; ids grow with every delivery and compaction keeps their order.
+    static bool findRecord(const MailboxSnapshot &snapshot, const uint64_t id, size_t &position) {
+        size_t low = 0;
+        size_t high = snapshot.records;
+        MessageRecord record{};
+
+        while (low < high) {
+            const size_t middle = low + (high - low) / 2;
+            if (!readAt(snapshot.files->indexFd, &record, sizeof(record), recordOffset(middle))) {
+                return false;
+            }
+
+            if (record.id == id) {
+                position = middle;
+
+                return true;
+            }
+
+            if (record.id < id) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        return false;
+    }
+
+    // The UPDATE state of a session: tombstones the records it marked, given as positions in the generation it
+    // logged in to. Messages another session already removed are skipped.
+    bool commitDeletions(const MailboxSnapshot &seen, const MessageRecord *seenRecords,
+                         const vector<size_t> &positions) {
+        lock_guard lock(deliveryMutex);
+
+        const shared_ptr<const MailboxSnapshot> previous = current.load();
+        auto tombstones = make_shared<Tombstones>(*previous->tombstones);
+        auto next = make_shared<MailboxSnapshot>(*previous);
+        vector<uint64_t> ids;
+
+        for (const size_t seenPosition : positions) {
+            const MessageRecord &record = seenRecords[seenPosition];
+            size_t position = seenPosition;
+
+            if (previous->files != seen.files && !findRecord(*previous, record.id, position)) {
+                continue;
+            }
+
+            if (isTombstoned(*tombstones, position)) {
+                continue;
+            }
+
+            setTombstone(*tombstones, position);
+            ids.push_back(record.id);
+            next->tombstoned++;
+            next->count--;
+            next->totalSize -= record.size;
+        }
+
+        if (ids.empty()) {
+            return true;
+        }
+
+        const int fd = ::open(tombstonePath().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+        const auto bytes = static_cast<ssize_t>(ids.size() * sizeof(uint64_t));
+        const bool written = fd >= 0 && write(fd, ids.data(), bytes) == bytes && fdatasync(fd) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (!written) {
+            return false;
+        }
+
+        next->tombstones = std::move(tombstones);
+        current.store(std::move(next));
+
+        return true;
+    }
+
+    bool needsCompaction() const {
+        const shared_ptr<const MailboxSnapshot> latest = snapshot();
+
+        return latest->tombstoned > 0 &&
+               (latest->tombstoned >= COMPACT_MIN_TOMBSTONES || latest->tombstoned * 4 >= latest->records);
+    }
+
+    // Copies the live messages into the next data file generation and renames a fresh index over the old one. The
+    // bulk copy runs without the delivery lock; only messages delivered or deleted meanwhile are handled under it.
+    // Sessions still holding an older snapshot keep reading its files, which stay open until they log out.
+    bool compact() {
+        lock_guard compactionLock(compactionMutex);
+
+        const shared_ptr<const MailboxSnapshot> base = snapshot();
+        if (base->tombstoned == 0) {
+            return true;
+        }
+
+        const auto started = chrono::steady_clock::now();
+
+        auto files = make_shared<MailboxFiles>();
+        files->generation = base->files->generation + 1;
+        files->dataFd = ::open(dataPath(files->generation).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (files->dataFd < 0) {
+            return false;
+        }
+
+        vector<MessageRecord> records;
+        vector<size_t> remap(base->records);
+        uint64_t end = 0;
+        uint64_t runSource = 0;
+        uint64_t runTarget = 0;
+        uint64_t runLength = 0;
+        bool copied = true;
+
+        auto flushRun = [&](const MailboxSnapshot &source) {
+            copied = copied && copyRange(source.files->dataFd, static_cast<off_t>(runSource), files->dataFd,
+                                         static_cast<off_t>(runTarget), runLength);
+            runLength = 0;
+        };
+
+        auto copyLive = [&](const MailboxSnapshot &source, const size_t first, const size_t last) {
+            const bool read = forEachRecord(source, first, last, [&](const size_t position,
+                                                                     const MessageRecord &record) {
+                if (isTombstoned(*source.tombstones, position)) {
+                    return;
                 }
+
+                if (runLength > 0 && runSource + runLength != record.offset) {
+                    flushRun(source);
+                }
+
+                if (runLength == 0) {
+                    runSource = record.offset;
+                    runTarget = end;
+                }
+
+                runLength += record.wireLength;
+
+                if (position < remap.size()) {
+                    remap[position] = records.size();
+                }
+
+                records.push_back({record.id, end, record.wireLength, record.size});
+                end += record.wireLength;
+            });
+
+            if (runLength > 0) {
+                flushRun(source);
             }
-        } else if (command == "QUIT") {
-            send(clientSocket, "+OK POP3 server signing off\r\n", 30, 0);
-            break;
-        } else if (!isAuthenticated) {
-            send(clientSocket, "-ERR Not authenticated\r\n", 23, 0);
-        } else if (command == "STAT") {
-            int numEmails = 0;
-            int totalSize = 0;
-
-            emailsMutex.lock();
-            if (userEmails.find(currentUser) != userEmails.end()) {
-                numEmails = userEmails[currentUser].size();
-
-                for (const auto &email: userEmails[currentUser]) {
-                    totalSize += email.body.length();
+
+            return read && copied;
+        };
+
+        if (!copyLive(*base, 0, base->records) || fdatasync(files->dataFd) < 0) {
+            unlink(dataPath(files->generation).c_str());
+
+            return false;
+        }
+
+        lock_guard lock(deliveryMutex);
+
+        const shared_ptr<const MailboxSnapshot> latest = current.load();
+        auto next = make_shared<MailboxSnapshot>(*latest);
+        Tombstones tombstones;
+        vector<uint64_t> remainingIds;
+
+        next->tombstoned = 0;
+        for (size_t position = 0; position < base->records; position++) {
+            if (isTombstoned(*latest->tombstones, position) && !isTombstoned(*base->tombstones, position)) {
+                setTombstone(tombstones, remap[position]);
+                remainingIds.push_back(records[remap[position]].id);
+                next->tombstoned++;
+            }
+        }
+
+        const string temporaryIndex = indexPath().string() + ".tmp";
+        const string temporaryTombstones = tombstonePath().string() + ".tmp";
+        IndexHeader header{};
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.generation = files->generation;
+        header.nextId = nextId;
+
+        files->indexFd = ::open(temporaryIndex.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        const int tombstoneFd = ::open(temporaryTombstones.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+        const bool written = files->indexFd >= 0 && tombstoneFd >= 0 &&
+                             copyLive(*latest, base->records, latest->records) && fdatasync(files->dataFd) == 0 &&
+                             writeAt(files->indexFd, &header, sizeof(header), 0) &&
+                             writeAt(files->indexFd, records.data(), records.size() * sizeof(MessageRecord),
+                                     recordOffset(0)) &&
+                             fdatasync(files->indexFd) == 0 &&
+                             writeAt(tombstoneFd, remainingIds.data(), remainingIds.size() * sizeof(uint64_t), 0) &&
+                             fdatasync(tombstoneFd) == 0 &&
+                             rename(temporaryIndex.c_str(), indexPath().c_str()) == 0 &&
+                             rename(temporaryTombstones.c_str(), tombstonePath().c_str()) == 0;
+
+        if (tombstoneFd >= 0) {
+            close(tombstoneFd);
+        }
+
+        if (!written) {
+            unlink(temporaryIndex.c_str());
+            unlink(temporaryTombstones.c_str());
+            unlink(dataPath(files->generation).c_str());
+
+            return false;
+        }
+
+        unlink(dataPath(base->files->generation).c_str());
+
+        const size_t removed = latest->records - records.size();
+        const uint64_t reclaimed = dataEnd - end;
+
+        next->files = std::move(files);
+        next->records = records.size();
+        next->tombstones = make_shared<const Tombstones>(std::move(tombstones));
+        dataEnd = end;
+
+        current.store(std::move(next));
+
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - started;
+        cout << "Compacted mailbox " << name << ": removed " << removed << " messages, reclaimed " << reclaimed
+             << " bytes in " << elapsed.count() << " s" << endl;
+
+        return true;
+    }
+};
+
+struct Compactor {
+    mutex queueMutex;
+    condition_variable queueWake;
+    deque<Mailbox *> queue;
+
+    void start() {
+        thread(&Compactor::run, this).detach();
+    }
+
+    void schedule(Mailbox &mailbox) {
+        if (mailbox.compactionQueued.exchange(true)) {
+            return;
+        }
+
+        {
+            lock_guard lock(queueMutex);
+            queue.push_back(&mailbox);
+        }
+        queueWake.notify_one();
+    }
+
+    void run() {
+        while (true) {
+            Mailbox *mailbox;
+            {
+                unique_lock lock(queueMutex);
+                queueWake.wait(lock, [this] {
+                    return !queue.empty();
+                });
+
+                mailbox = queue.front();
+                queue.pop_front();
+            }
+
+            mailbox->compactionQueued = false;
+            if (!mailbox->compact()) {
+                cerr << "Failed to compact mailbox " << mailbox->name << endl;
+            }
+        }
+    }
+};
+
+// A session's view of its mailbox: the snapshot taken at login, the index records it covers, mapped from the page
+// cache, and the messages this session has marked with DELE.
+struct Maildrop {
+    shared_ptr<const MailboxSnapshot> snapshot = make_shared<const MailboxSnapshot>();
+    const MessageRecord *records = nullptr;
+    void *mapping = MAP_FAILED;
+    size_t mappingSize = 0;
+    vector<size_t> visible;
+    vector<bool> deleted;
+    size_t deletedCount = 0;
+    size_t deletedSize = 0;
+
+    Maildrop() = default;
+    Maildrop(const Maildrop &) = delete;
+    Maildrop &operator=(const Maildrop &) = delete;
+
+    ~Maildrop() {
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, mappingSize);
+        }
+    }
+
+    bool open(shared_ptr<const MailboxSnapshot> mailboxSnapshot) {
+        snapshot = std::move(mailboxSnapshot);
+        deleted.assign(snapshot->count, false);
+
+        if (snapshot->count == 0) {
+            return true;
+        }
+
+        mappingSize = recordOffset(snapshot->records);
+        mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, snapshot->files->indexFd, 0);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+
+        records = reinterpret_cast<const MessageRecord *>(static_cast<const char *>(mapping) + sizeof(IndexHeader));
+
+        if (snapshot->tombstoned > 0) {
+            visible.reserve(snapshot->count);
+            for (size_t position = 0; position < snapshot->records; position++) {
+                if (!isTombstoned(*snapshot->tombstones, position)) {
+                    visible.push_back(position);
                 }
             }
-            emailsMutex.unlock();
+        }
+
+        return true;
+    }
+
+    size_t count() const {
+        return snapshot->count;
+    }
+
+    size_t position(const size_t index) const {
+        return visible.empty() ? index : visible[index];
+    }
+
+    const MessageRecord &record(const size_t index) const {
+        return records[position(index)];
+    }
+};
+
+constexpr size_t MAX_COMMAND_LINE = 4096;
 
-            const string response = "+OK " + to_string(numEmails) + " " + to_string(totalSize) + "\r\n";
-            send(clientSocket, response.c_str(), response.length(), 0);
-        } else if (command.substr(0, 4) == "LIST") {
-            emailsMutex.lock();
-            int numEmails = 0;
+// Packs a command verb into one big-endian word, uppercased and space-padded, so dispatch is a single switch.
+constexpr uint32_t commandCode(const string_view verb) {
+    if (verb.size() > 4) {
+        return 0;
+    }
+
+    uint32_t code = 0;
+    for (size_t i = 0; i < 4; i++) {
+        const char c = i < verb.size() ? verb[i] : ' ';
+        code = code << 8 | static_cast<unsigned char>(c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c);
+    }
+
+    return code;
+}
+
+struct ReplyBatch {
+    int socket;
+    string pending;
 
-            if (userEmails.find(currentUser) != userEmails.end()) {
-                numEmails = userEmails[currentUser].size();
+    void add(const string_view reply) {
+        pending += reply;
+    }
+
+    bool flush(const int flags = 0) {
+        size_t done = 0;
+        while (done < pending.size()) {
+            const ssize_t bytesSent = send(socket, pending.data() + done, pending.size() - done, flags | MSG_NOSIGNAL);
+            if (bytesSent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return false;
             }
 
-            string response = "+OK " + to_string(numEmails) + " messages\r\n";
+            done += bytesSent;
+        }
+
+        pending.clear();
+
+        return true;
+    }
+};
+
+struct Pop3Session {
+    const map<string, string> &users;
+    map<string, Mailbox> &mailboxes;
+    Compactor &compactor;
+    ReplyBatch replies;
+    string currentUser;
+    bool isAuthenticated = false;
+    string authenticationStage;
+    Mailbox *mailbox = nullptr;
+    Maildrop maildrop;
+
+    Pop3Session(const int clientSocket, const map<string, string> &userTable, map<string, Mailbox> &mailboxTable,
+                Compactor &mailboxCompactor)
+        : users(userTable), mailboxes(mailboxTable), compactor(mailboxCompactor), replies{clientSocket, ""} {
+    }
 
-            if (userEmails.find(currentUser) != userEmails.end()) {
-                for (size_t i = 0; i < userEmails[currentUser].size(); i++) {
-                    response += to_string(i + 1) + " " + to_string(userEmails[currentUser][i].body.length()) + "\r\n";
+    // Accepts a message number that is not marked as deleted, queuing the error reply otherwise.
+    bool messageIndex(const string_view argument, size_t &index) {
+        size_t number = 0;
+        const auto [end, error] = from_chars(argument.data(), argument.data() + argument.size(), number);
+        if (error != errc() || end != argument.data() + argument.size() || number == 0 || number > maildrop.count()) {
+            replies.add("-ERR No such message\r\n");
+
+            return false;
+        }
+
+        index = number - 1;
+        if (maildrop.deleted[index]) {
+            replies.add("-ERR Message already deleted\r\n");
+
+            return false;
+        }
+
+        return true;
+    }
+
+    // The UPDATE state: messages marked with DELE are only removed once the client quits properly.
+    bool commitDeletions() {
+        if (mailbox == nullptr || maildrop.deletedCount == 0) {
+            return true;
+        }
+
+        vector<size_t> positions;
+        positions.reserve(maildrop.deletedCount);
+        for (size_t index = 0; index < maildrop.count(); index++) {
+            if (maildrop.deleted[index]) {
+                positions.push_back(maildrop.position(index));
+            }
+        }
+
+        if (!mailbox->commitDeletions(*maildrop.snapshot, maildrop.records, positions)) {
+            return false;
+        }
+
+        if (mailbox->needsCompaction()) {
+            compactor.schedule(*mailbox);
+        }
+
+        return true;
+    }
+
+    bool sendMessage(const MessageRecord &record) {
+        replies.add("+OK message follows\r\n");
+        if (!replies.flush(MSG_MORE)) {
+            return false;
+        }
+
+        off_t offset = static_cast<off_t>(record.offset);
+        for (size_t remaining = record.wireLength; remaining > 0;) {
+            const ssize_t bytesSent = sendfile(replies.socket, maildrop.snapshot->files->dataFd, &offset, remaining);
+            if (bytesSent <= 0) {
+                if (bytesSent < 0 && errno == EINTR) {
+                    continue;
                 }
+
+                return false;
             }
 
-            response += ".\r\n";
-            emailsMutex.unlock();
-
-            send(clientSocket, response.c_str(), response.length(), 0);
-        } else if (command.substr(0, 4) == "RETR") {
-            const int emailIndex = stoi(command.substr(5)) - 1;
-
-            emailsMutex.lock();
-            if (userEmails.find(currentUser) != userEmails.end() && emailIndex >= 0 &&
-                emailIndex < static_cast<int>(userEmails[currentUser].size())) {
-                const auto &[from, to, subject, body, attachments] = userEmails[currentUser][emailIndex];
-                const string boundary = "boundary_" + to_string(rand());
-                stringstream response;
-
-                response << "+OK message follows\r\n";
-                response << "From: " << from << "\r\n";
-                response << "To: " << to << "\r\n";
-                response << "Subject: " << subject << "\r\n";
-
-                if (!attachments.empty()) {
-                    response << "MIME-Version: 1.0\r\n";
-                    response << "Content-Type: multipart/mixed; boundary=\"" << boundary << "\"\r\n";
-                    response << "\r\n";
-                    response << "This is a multi-part message in MIME format.\r\n";
-                    response << "--" << boundary << "\r\n";
-                    response << "Content-Type: text/plain; charset=utf-8\r\n";
-                    response << "Content-Transfer-Encoding: 8bit\r\n\r\n";
-                    response << body << "\r\n\r\n";
-
-                    for (const auto &[filename, contentType]: attachments) {
-                        response << "--" << boundary << "\r\n";
-                        response << "Content-Type: " << contentType << "\r\n";
-                        response << "Content-Disposition: attachment; filename=\"" << filename << "\"\r\n";
-                        response << "Content-Transfer-Encoding: base64\r\n\r\n";
-
-                        string dummyImageData = "This is a simulated image content for testing attachments.";
-                        string base64Data = base64Encode(dummyImageData);
-
-                        for (size_t i = 0; i < base64Data.length(); i += 76) {
-                            response << base64Data.substr(i, 76) << "\r\n";
-                        }
-                        response << "\r\n";
-                    }
+            remaining -= bytesSent;
+        }
 
-                    response << "--" << boundary << "--\r\n";
+        return true;
+    }
+
+    // Runs one command line and queues its reply. Returns false once the session should end.
+    bool execute(const string_view command) {
+        cout << "Received command: " << command << endl;
+
+        const size_t space = command.find(' ');
+        const string_view verb = command.substr(0, space);
+        const string_view argument = space == string_view::npos ? string_view() : command.substr(space + 1);
+        const uint32_t code = commandCode(verb);
+
+        switch (code) {
+            case commandCode("CAPA"):
+                replies.add("+OK Capability list follows\r\nUSER\r\nPIPELINING\r\n.\r\n");
+                return true;
+            case commandCode("USER"):
+                currentUser = argument;
+                authenticationStage = "USER";
+                replies.add("+OK User accepted\r\n");
+                return true;
+            case commandCode("PASS"):
+                if (isAuthenticated) {
+                    replies.add("-ERR Already logged in\r\n");
+                } else if (authenticationStage != "USER") {
+                    replies.add("-ERR Send USER first\r\n");
+                } else if (const auto user = users.find(currentUser); user == users.end() || user->second != argument) {
+                    replies.add("-ERR Login failed\r\n");
+                } else if (const auto found = mailboxes.find(currentUser);
+                           found != mailboxes.end() && !maildrop.open(found->second.snapshot())) {
+                    replies.add("-ERR Unable to open maildrop\r\n");
+                } else {
+                    mailbox = found == mailboxes.end() ? nullptr : &found->second;
+                    isAuthenticated = true;
+                    replies.add("+OK Login successful\r\n");
+                }
+                return true;
+            case commandCode("QUIT"):
+                if (isAuthenticated && !commitDeletions()) {
+                    replies.add("-ERR Some deleted messages not removed\r\n");
                 } else {
-                    response << "\r\n" << body << "\r\n";
+                    replies.add("+OK POP3 server signing off\r\n");
                 }
+                return false;
+            default:
+                break;
+        }
 
-                response << ".\r\n";
+        if (!isAuthenticated) {
+            replies.add("-ERR Not authenticated\r\n");
 
-                const string responseStr = response.str();
-                send(clientSocket, responseStr.c_str(), responseStr.length(), 0);
-            } else {
-                send(clientSocket, "-ERR No such message\r\n", 22, 0);
+            return true;
+        }
+
+        size_t index = 0;
+        switch (code) {
+            case commandCode("STAT"):
+                replies.add("+OK " + to_string(maildrop.count() - maildrop.deletedCount) + " " +
+                            to_string(maildrop.snapshot->totalSize - maildrop.deletedSize) + "\r\n");
+                break;
+            case commandCode("LIST"):
+                if (!argument.empty()) {
+                    if (messageIndex(argument, index)) {
+                        replies.add("+OK " + to_string(index + 1) + " " + to_string(maildrop.record(index).size) +
+                                    "\r\n");
+                    }
+                    break;
+                }
+
+                replies.add("+OK " + to_string(maildrop.count() - maildrop.deletedCount) + " messages\r\n");
+                for (size_t i = 0; i < maildrop.count(); i++) {
+                    if (!maildrop.deleted[i]) {
+                        replies.add(to_string(i + 1) + " " + to_string(maildrop.record(i).size) + "\r\n");
+                    }
+                }
+                replies.add(".\r\n");
+                break;
+            case commandCode("RETR"):
+                if (messageIndex(argument, index) && !sendMessage(maildrop.record(index))) {
+                    return false;
+                }
+                break;
+            case commandCode("DELE"):
+                if (messageIndex(argument, index)) {
+                    maildrop.deleted[index] = true;
+                    maildrop.deletedCount++;
+                    maildrop.deletedSize += maildrop.record(index).size;
+                    replies.add("+OK Message deleted\r\n");
+                }
+                break;
+            case commandCode("RSET"):
+                maildrop.deleted.assign(maildrop.count(), false);
+                maildrop.deletedCount = 0;
+                maildrop.deletedSize = 0;
+                replies.add("+OK\r\n");
+                break;
+            case commandCode("NOOP"):
+                replies.add("+OK\r\n");
+                break;
+            default:
+                replies.add("-ERR Command not implemented\r\n");
+                break;
+        }
+
+        return true;
+    }
+};
+
+// Every complete line of a read is executed before the replies go out, so a pipelining client gets one write back
+// per batch of commands instead of one per command.
+void handleClient(int clientSocket, const map<string, string> &users, map<string, Mailbox> &mailboxes,
+                  Compactor &compactor) {
+    Pop3Session session(clientSocket, users, mailboxes, compactor);
+    string input;
+    char buffer[4096];
+    bool open = true;
+
+    session.replies.add("+OK POP3 server ready\r\n");
+
+    while (open && session.replies.flush()) {
+        const ssize_t bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
+        if (bytesReceived <= 0) {
+            break;
+        }
+
+        input.append(buffer, bytesReceived);
+
+        size_t lineStart = 0;
+        for (size_t lineEnd; open && (lineEnd = input.find('\n', lineStart)) != string::npos; lineStart = lineEnd + 1) {
+            string_view line(input.data() + lineStart, lineEnd - lineStart);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
             }
-            emailsMutex.unlock();
-        } else if (command.substr(0, 4) == "DELE") {
-            send(clientSocket, "+OK Message deleted\r\n", 22, 0);
-        } else if (command == "RSET") {
-            send(clientSocket, "+OK\r\n", 5, 0);
-        } else if (command == "NOOP") {
-            send(clientSocket, "+OK\r\n", 5, 0);
-        } else {
-            send(clientSocket, "-ERR Command not implemented\r\n", 30, 0);
+
+            open = session.execute(line);
+        }
+
+        input.erase(0, lineStart);
+
+        if (open && input.size() > MAX_COMMAND_LINE) {
+            session.replies.add("-ERR Command line too long\r\n");
+            open = false;
         }
     }
 
+    session.replies.flush();
+
     close(clientSocket);
     cout << "Client disconnected" << endl;
 }
 
-int main() {
+Email syntheticEmail(const string &recipient, const size_t number) {
+    Email email;
+    email.from = "load@example.com";
+    email.to = recipient;
+    email.subject = "Synthetic message " + to_string(number);
+    email.body = "Synthetic message body " + to_string(number) + " for mailbox contention tests.";
+
+    return email;
+}
+
+int main(const int argc, char *argv[]) {
     const string ipAddress = "127.0.0.1";
     constexpr int port = 8110;  // Changed from 110 to 8110 (non-privileged port)
 
-    mutex emailsMutex;
+    filesystem::path storeDirectory = "mailstore";
+    size_t seedMessages = 0;
+    double deliveryRate = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (const string option = argv[i]; option == "--store") {
+            storeDirectory = argv[i + 1];
+        } else if (option == "--seed") {
+            seedMessages = stoul(argv[i + 1]);
+        } else if (option == "--deliver") {
+            deliveryRate = stod(argv[i + 1]);
+        }
+    }
 
     map<string, string> users;
-    map<string, vector<Email> > userEmails;
+    map<string, Mailbox> mailboxes;
 
     users["pas2017@interia.pl"] = "P4SInf2017";
 
@@ -230,8 +1058,33 @@ int main() {
     email3.attachments.push_back(make_pair("image1.png", "image/png"));
     email3.attachments.push_back(make_pair("image2.gif", "image/gif"));
 
-    vector emails = {email1, email2, email3};
-    userEmails["pas2017@interia.pl"] = emails;
+    error_code error;
+    filesystem::create_directories(storeDirectory, error);
+
+    Mailbox &mailbox = mailboxes["pas2017@interia.pl"];
+    if (error || !mailbox.open(storeDirectory, "pas2017@interia.pl")) {
+        cerr << "Failed to open mailbox store in " << storeDirectory.string() << endl;
+
+        return 1;
+    }
+
+    if (mailbox.nextId == 1 && !(mailbox.deliver(email1) && mailbox.deliver(email2) && mailbox.deliver(email3))) {
+        cerr << "Failed to seed the mailbox store." << endl;
+
+        return 1;
+    }
+
+    // Only tops up what was never delivered: nextId survives compaction, so a mailbox the user emptied stays empty.
+    for (size_t i = mailbox.nextId - 1; i < 3 + seedMessages; i++) {
+        if (!mailbox.deliver(syntheticEmail("pas2017@interia.pl", i - 3))) {
+            cerr << "Failed to seed the mailbox store." << endl;
+
+            return 1;
+        }
+    }
+
+    cout << "Mailbox store " << storeDirectory.string() << ": " << mailbox.snapshot()->count << " messages, "
+         << mailbox.snapshot()->totalSize << " bytes" << endl;
 
     int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket < 0) {
@@ -269,7 +1122,7 @@ int main() {
         return 1;
     }
 
-    if (listen(serverSocket, 5) < 0) {
+    if (listen(serverSocket, SOMAXCONN) < 0) {
         cerr << "Failed to listen on socket." << endl;
 
         close(serverSocket);
@@ -277,6 +1130,25 @@ int main() {
         return 1;
     }
 
+    Compactor compactor;
+    compactor.start();
+    if (mailbox.needsCompaction()) {
+        compactor.schedule(mailbox);
+    }
+
+    if (deliveryRate > 0) {
+        thread([&mailbox, deliveryRate, seedMessages] {
+            const auto interval = chrono::duration<double>(1.0 / deliveryRate);
+            for (size_t i = seedMessages; ; i++) {
+                this_thread::sleep_for(interval);
+
+                if (!mailbox.deliver(syntheticEmail("pas2017@interia.pl", i))) {
+                    cerr << "Failed to deliver synthetic message " << i << endl;
+                }
+            }
+        }).detach();
+    }
+
     cout << "POP3 server started on " << ipAddress << ":" << port << endl;
 
     while (true) {
@@ -293,7 +1165,7 @@ int main() {
         inet_ntop(AF_INET, &(clientAddress.sin_addr), clientIP, INET_ADDRSTRLEN);
         cout << "New connection from " << clientIP << ":" << ntohs(clientAddress.sin_port) << endl;
 
-        thread clientThread(handleClient, clientSocket, ref(users), ref(userEmails), ref(emailsMutex));
+        thread clientThread(handleClient, clientSocket, cref(users), ref(mailboxes), ref(compactor));
         clientThread.detach();
     }
 
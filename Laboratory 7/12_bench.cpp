@@ -0,0 +1,197 @@
+#include <iostream>
+#include <cstring>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+using namespace std::chrono;
+
+struct ReplyReader {
+    int socket;
+    string buffer;
+
+    bool readLine(string &line) {
+        while (true) {
+            if (const size_t pos = buffer.find("\r\n"); pos != string::npos) {
+                line = buffer.substr(0, pos);
+                buffer.erase(0, pos + 2);
+
+                return true;
+            }
+
+            char chunk[16384];
+            const ssize_t bytesRead = recv(socket, chunk, sizeof(chunk), 0);
+            if (bytesRead <= 0) {
+                return false;
+            }
+
+            buffer.append(chunk, bytesRead);
+        }
+    }
+
+    bool command(const string &text, const bool multiLine) {
+        if (send(socket, text.c_str(), text.length(), 0) < 0) {
+            return false;
+        }
+
+        string line;
+        if (!readLine(line) || !line.starts_with("+OK")) {
+            return false;
+        }
+
+        while (multiLine) {
+            if (!readLine(line)) {
+                return false;
+            }
+
+            if (line == ".") {
+                break;
+            }
+        }
+
+        return true;
+    }
+};
+
+struct SessionResult {
+    bool loggedIn = false;
+    bool failed = false;
+    vector<uint32_t> latencies;
+};
+
+int connectTo(const string &serverIp, const int port) {
+    const int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    sockaddr_in serverAddress{};
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    inet_pton(AF_INET, serverIp.c_str(), &serverAddress.sin_addr);
+
+    if (connect(sock, reinterpret_cast<sockaddr *>(&serverAddress), sizeof(serverAddress)) < 0) {
+        close(sock);
+
+        return -1;
+    }
+
+    return sock;
+}
+
+const vector<pair<string, bool> > MIXED_CYCLE = {{"STAT\r\n", false}, {"LIST\r\n", true}, {"RETR 1\r\n", true}};
+const vector<pair<string, bool> > RETR_CYCLE = {{"RETR 1\r\n", true}, {"RETR 2\r\n", true}, {"RETR 3\r\n", true}};
+
+// Each session logs in once, waits for the others, then cycles through its commands until the deadline. Every
+// command latency is recorded in microseconds.
+void runSession(const string &serverIp, const int port, const vector<pair<string, bool> > &cycle, atomic<int> &ready,
+                const atomic<bool> &go, const atomic<bool> &stop, SessionResult &result) {
+    const int sock = connectTo(serverIp, port);
+    ReplyReader reader{sock, ""};
+    string greeting;
+
+    result.loggedIn = sock >= 0 && reader.readLine(greeting) && reader.command("USER pas2017@interia.pl\r\n", false) &&
+                      reader.command("PASS P4SInf2017\r\n", false);
+    ready++;
+    ready.notify_one();
+
+    if (!result.loggedIn) {
+        if (sock >= 0) {
+            close(sock);
+        }
+
+        return;
+    }
+
+    go.wait(false);
+
+    for (size_t step = 0; !stop; step = (step + 1) % cycle.size()) {
+        const auto start = steady_clock::now();
+        if (!reader.command(cycle[step].first, cycle[step].second)) {
+            result.failed = true;
+            break;
+        }
+
+        const auto latency = duration_cast<microseconds>(steady_clock::now() - start);
+        result.latencies.push_back(static_cast<uint32_t>(latency.count()));
+    }
+
+    reader.command("QUIT\r\n", false);
+    close(sock);
+}
+
+int main(const int argc, char *argv[]) {
+    const string serverIp = argc > 1 ? argv[1] : "127.0.0.1";
+    const int port = argc > 2 ? stoi(argv[2]) : 8110;
+    const int sessions = argc > 3 ? stoi(argv[3]) : 300;
+    const double seconds = argc > 4 ? stod(argv[4]) : 10;
+    const string mode = argc > 5 ? argv[5] : "mixed";
+    const auto &cycle = mode == "retr" ? RETR_CYCLE : MIXED_CYCLE;
+
+    cout << "Running " << sessions << " concurrent POP3 sessions against " << serverIp << ":" << port << " for "
+         << seconds << " s (" << (mode == "retr" ? "RETR 1-3" : "STAT, LIST, RETR 1") << ")" << endl;
+
+    vector<SessionResult> results(sessions);
+    vector<thread> threads;
+    atomic<int> ready = 0;
+    atomic<bool> go = false;
+    atomic<bool> stop = false;
+
+    for (int i = 0; i < sessions; i++) {
+        threads.emplace_back(runSession, cref(serverIp), port, cref(cycle), ref(ready), cref(go), cref(stop),
+                             ref(results[i]));
+    }
+
+    for (int count = ready; count < sessions; count = ready) {
+        ready.wait(count);
+    }
+
+    const auto start = steady_clock::now();
+    go = true;
+    go.notify_all();
+
+    this_thread::sleep_for(duration<double>(seconds));
+    stop = true;
+
+    for (auto &worker : threads) {
+        worker.join();
+    }
+
+    const double elapsed = duration<double>(steady_clock::now() - start).count();
+
+    vector<uint32_t> latencies;
+    int loggedIn = 0;
+    int failed = 0;
+    for (const auto &result : results) {
+        loggedIn += result.loggedIn;
+        failed += result.failed;
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+
+    if (latencies.empty()) {
+        cerr << "No commands completed (" << loggedIn << " of " << sessions << " sessions logged in)." << endl;
+
+        return 1;
+    }
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](const double fraction) {
+        return latencies[min(latencies.size() - 1, static_cast<size_t>(fraction * latencies.size()))] / 1000.0;
+    };
+
+    cout << loggedIn << " sessions logged in, " << failed << " failed during the run" << endl;
+    cout << latencies.size() << " commands in " << elapsed << " s: " << latencies.size() / elapsed << " commands/s"
+         << endl;
+    cout << "Latency p50 " << percentile(0.50) << " ms, p99 " << percentile(0.99) << " ms, p99.9 "
+         << percentile(0.999) << " ms, max " << latencies.back() / 1000.0 << " ms" << endl;
+
+    return failed > 0 || loggedIn < sessions ? 1 : 0;
+}
@@ -6,6 +6,7 @@
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include "../Common/pop3_client.h"
 
 using namespace std;
 
@@ -173,8 +174,10 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    ResponseReader reader;
+    string listStatus;
+    string response;
+    if (!reader.readResponse(clientSocket, true, listStatus, response) || !listStatus.starts_with("+OK")) {
         cerr << "Failed to receive response to LIST command." << endl;
 
         close(clientSocket);
@@ -184,7 +187,6 @@ int main() {
 
     vector<pair<int, int>> messageSizes;
 
-    string response(buffer);
     size_t pos = 0;
     string line;
 
@@ -235,8 +237,8 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    string retrStatus;
+    if (!reader.readLine(clientSocket, retrStatus) || !retrStatus.starts_with("+OK")) {
         cerr << "Failed to receive response to RETR command." << endl;
 
         close(clientSocket);
@@ -245,7 +247,20 @@ int main() {
     }
 
     cout << "\nContent of the largest message (#" << index << "):\n" << endl;
-    cout << buffer << endl;
+
+    const bool complete = reader.streamBody(clientSocket, [](const char *data, const size_t length) {
+        cout.write(data, length);
+    });
+
+    if (!complete) {
+        cerr << "Connection lost while receiving the message." << endl;
+
+        close(clientSocket);
+
+        return 1;
+    }
+
+    cout << endl;
 
     const string quitCmd = "QUIT\r\n";
     if (send(clientSocket, quitCmd.c_str(), quitCmd.length(), 0) < 0) {
@@ -256,12 +271,12 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    string quitReply;
+    if (!reader.readLine(clientSocket, quitReply)) {
         cerr << "Failed to receive response to QUIT command." << endl;
     }
 
-    cout << "Server: " << buffer;
+    cout << "Server: " << quitReply;
     cout << "Session closed." << endl;
 
     close(clientSocket);
@@ -4,12 +4,18 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <sstream>
+#include <vector>
+#include <utility>
+#include "../Common/pop3_headers.h"
 
 using namespace std;
 
-int main() {
+constexpr size_t TOP_SENDERS = 10;
+
+int main(const int argc, char *argv[]) {
     const string hostname = "interia.pl";
     constexpr int port = 110;
+    const bool scanMode = argc > 1 && string(argv[1]) == "--scan";
 
     const hostent *hostent = gethostbyname(hostname.c_str());
     if (hostent == nullptr) {
@@ -170,8 +176,10 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    ResponseReader reader;
+    string listStatus;
+    string response;
+    if (!reader.readResponse(clientSocket, true, listStatus, response) || !listStatus.starts_with("+OK")) {
         cerr << "Failed to receive response to LIST command." << endl;
 
         close(clientSocket);
@@ -181,25 +189,32 @@ int main() {
 
     cout << "Size of each message in the mailbox:" << endl;
 
-    string response(buffer);
+    vector<pair<int, int>> messageSizes;
     istringstream stream(response);
     string line;
 
-    getline(stream, line);
-
     while (getline(stream, line)) {
         if (!line.empty() && line.back() == '\r') {
             line.pop_back();
         }
 
-        if (line == ".") {
-            break;
-        }
-
         int msgNum, msgSize;
         if (istringstream lineStream(line); lineStream >> msgNum >> msgSize) {
             cout << "Message #" << msgNum << ": " << msgSize << " bytes" << endl;
+            messageSizes.emplace_back(msgNum, msgSize);
+        }
+    }
+
+    if (scanMode) {
+        HeaderSummary summary;
+        if (!scanHeaders(clientSocket, reader, messageSizes, summary)) {
+            close(clientSocket);
+
+            return 1;
         }
+
+        summary.printLargestSenders(TOP_SENDERS);
+        summary.printMessagesWithAttachments();
     }
 
     const string quitCmd = "QUIT\r\n";
@@ -211,12 +226,12 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    string quitReply;
+    if (!reader.readLine(clientSocket, quitReply)) {
         cerr << "Failed to receive response to QUIT command." << endl;
     }
 
-    cout << "Server: " << buffer;
+    cout << "Server: " << quitReply;
     cout << "Session closed." << endl;
 
     close(clientSocket);
@@ -7,12 +7,48 @@
 #include <utility>
 #include <algorithm>
 #include <sstream>
+#include "../Common/pop3_headers.h"
 
 using namespace std;
 
-int main() {
+constexpr size_t TOP_SENDERS = 10;
+
+bool printMessage(const int sock, ResponseReader &reader, const int index) {
+    string retrCmd = "RETR " + to_string(index) + "\r\n";
+    if (send(sock, retrCmd.c_str(), retrCmd.length(), 0) < 0) {
+        cerr << "Failed to send RETR command." << endl;
+
+        return false;
+    }
+
+    string retrStatus;
+    if (!reader.readLine(sock, retrStatus) || !retrStatus.starts_with("+OK")) {
+        cerr << "Failed to receive response to RETR command." << endl;
+
+        return false;
+    }
+
+    cout << "\nContent of the largest message (#" << index << "):\n" << endl;
+
+    const bool complete = reader.streamBody(sock, [](const char *data, const size_t length) {
+        cout.write(data, length);
+    });
+
+    if (!complete) {
+        cerr << "Connection lost while receiving the message." << endl;
+
+        return false;
+    }
+
+    cout << endl;
+
+    return true;
+}
+
+int main(const int argc, char *argv[]) {
     const string hostname = "interia.pl";
     constexpr int port = 110;
+    const bool scanMode = argc > 1 && string(argv[1]) == "--scan";
 
     const hostent *hostent = gethostbyname(hostname.c_str());
     if (hostent == nullptr) {
@@ -174,8 +210,10 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    ResponseReader reader;
+    string listStatus;
+    string response;
+    if (!reader.readResponse(clientSocket, true, listStatus, response) || !listStatus.starts_with("+OK")) {
         cerr << "Failed to receive response to LIST command." << endl;
 
         close(clientSocket);
@@ -185,12 +223,9 @@ int main() {
 
     vector<pair<int, int>> messageSizes;
 
-    string response(buffer);
     istringstream stream(response);
     string line;
 
-    getline(stream, line);
-
     while (getline(stream, line)) {
         if (!line.empty() && line.back() == '\r') {
             line.pop_back();
@@ -224,27 +259,27 @@ int main() {
 
     cout << "Largest message is #" << index << " with size " << size << " bytes." << endl;
 
-    string retrCmd = "RETR " + to_string(index) + "\r\n";
-    if (send(clientSocket, retrCmd.c_str(), retrCmd.length(), 0) < 0) {
-        cerr << "Failed to send RETR command." << endl;
+    if (scanMode) {
+        HeaderSummary summary;
+        if (!scanHeaders(clientSocket, reader, messageSizes, summary)) {
+            close(clientSocket);
 
-        close(clientSocket);
+            return 1;
+        }
 
-        return 1;
-    }
-
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
-        cerr << "Failed to receive response to RETR command." << endl;
+        summary.printLargestSenders(TOP_SENDERS);
+        summary.printMessagesWithAttachments();
 
+        if (const auto row = ranges::find(summary.numbers, index); row != summary.numbers.end()) {
+            cout << "\nHeaders of the largest message:" << endl;
+            summary.printRow(row - summary.numbers.begin());
+        }
+    } else if (!printMessage(clientSocket, reader, index)) {
         close(clientSocket);
 
         return 1;
     }
 
-    cout << "\nContent of the largest message (#" << index << "):\n" << endl;
-    cout << buffer << endl;
-
     const string quitCmd = "QUIT\r\n";
     if (send(clientSocket, quitCmd.c_str(), quitCmd.length(), 0) < 0) {
         cerr << "Failed to send QUIT command." << endl;
@@ -254,12 +289,12 @@ int main() {
         return 1;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(clientSocket, buffer, sizeof(buffer) - 1, 0) < 0) {
+    string quitReply;
+    if (!reader.readLine(clientSocket, quitReply)) {
         cerr << "Failed to receive response to QUIT command." << endl;
     }
 
-    cout << "Server: " << buffer;
+    cout << "Server: " << quitReply;
     cout << "Session closed." << endl;
 
     close(clientSocket);